@@ -0,0 +1,197 @@
+/*
+ * bench.c - Robust statistics of repeated timings, see bench.h
+ */
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "bench.h"
+
+/* A value of one of the two sets compared by bench_mann_whitney */
+typedef struct {
+    double value;
+    int from_x;
+} ranked_t;
+
+static int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return (x > y) - (x < y);
+}
+
+static int compare_ranked(const void *a, const void *b)
+{
+    return compare_double(&((const ranked_t *)a)->value,
+                          &((const ranked_t *)b)->value);
+}
+
+/*
+ * next_random - xorshift64*, good enough to draw resamples and cheap
+ */
+static uint64_t next_random(uint64_t *state)
+{
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545F4914F6CDD1DULL;
+}
+
+double bench_median(double *x, int n)
+{
+    if (n == 0) {
+        return 0;
+    }
+    qsort(x, n, sizeof(double), compare_double);
+    return n % 2 ? x[n / 2] : (x[n / 2 - 1] + x[n / 2]) / 2;
+}
+
+double bench_mad(const double *x, int n, double median)
+{
+    double *dev;
+    double mad;
+    int i;
+
+    if (n == 0 || (dev = malloc(n * sizeof(double))) == NULL) {
+        return 0;
+    }
+    for (i = 0; i < n; i++) {
+        dev[i] = fabs(x[i] - median);
+    }
+    mad = bench_median(dev, n);
+    free(dev);
+    return mad;
+}
+
+void bench_median_ci(const double *x, int n, double level,
+                     double *lo, double *hi)
+{
+    uint64_t state = 0x9E3779B97F4A7C15ULL;
+    double *resample, *medians;
+    int r, i, tail;
+
+    *lo = *hi = 0;
+    if (n == 0) {
+        return;
+    }
+    resample = malloc(n * sizeof(double));
+    medians = malloc(BENCH_RESAMPLES * sizeof(double));
+    if (resample != NULL && medians != NULL) {
+        for (r = 0; r < BENCH_RESAMPLES; r++) {
+            for (i = 0; i < n; i++) {
+                resample[i] = x[next_random(&state) % n];
+            }
+            medians[r] = bench_median(resample, n);
+        }
+        qsort(medians, BENCH_RESAMPLES, sizeof(double), compare_double);
+        tail = (int)((1 - level) / 2 * BENCH_RESAMPLES);
+        *lo = medians[tail];
+        *hi = medians[BENCH_RESAMPLES - 1 - tail];
+    }
+    free(resample);
+    free(medians);
+}
+
+/*
+ * exact_p - Return the two-sided p-value of u from the exact distribution
+ *     of U for nx and ny values without ties.  The number of ways to get
+ *     each U is a coefficient of the Gaussian binomial (nx + ny, nx), the
+ *     product of (1 - q^(ny + i)) / (1 - q^i) for i from 1 to nx.
+ */
+static double exact_p(double u, int nx, int ny)
+{
+    int m = nx * ny;
+    double *count = calloc(m + 1, sizeof(double));
+    double total = 0, below = 0, above = 0;
+    int i, k;
+
+    if (count == NULL) {
+        return 1;
+    }
+    count[0] = 1;
+    for (i = 1; i <= nx; i++) {
+        for (k = m; k >= ny + i; k--) {
+            count[k] -= count[k - ny - i];
+        }
+        for (k = i; k <= m; k++) {
+            count[k] += count[k - i];
+        }
+    }
+    for (k = 0; k <= m; k++) {
+        total += count[k];
+        below += k <= u ? count[k] : 0;
+        above += k >= u ? count[k] : 0;
+    }
+    free(count);
+    return fmin(1, 2 * fmin(below, above) / total);
+}
+
+double bench_mann_whitney(const double *x, int nx, const double *y, int ny)
+{
+    ranked_t *all;
+    double rank_sum = 0, ties = 0;
+    double u, mean, var, z;
+    int n = nx + ny;
+    int i, j, k;
+
+    if (nx == 0 || ny == 0 || (all = malloc(n * sizeof(ranked_t))) == NULL) {
+        return 1;
+    }
+    for (i = 0; i < nx; i++) {
+        all[i].value = x[i];
+        all[i].from_x = 1;
+    }
+    for (i = 0; i < ny; i++) {
+        all[nx + i].value = y[i];
+        all[nx + i].from_x = 0;
+    }
+    qsort(all, n, sizeof(ranked_t), compare_ranked);
+
+    /* Equal values all get the mean of their ranks, counted from 1 */
+    for (i = 0; i < n; i = j) {
+        for (j = i + 1; j < n && all[j].value == all[i].value; j++)
+            ;
+        for (k = i; k < j; k++) {
+            if (all[k].from_x) {
+                rank_sum += (i + j + 1) / 2.0;
+            }
+        }
+        ties += (double)(j - i) * (j - i) * (j - i) - (j - i);
+    }
+    free(all);
+
+    u = rank_sum - nx * (nx + 1) / 2.0;
+    if (n <= BENCH_EXACT_MAX && ties == 0) {
+        return exact_p(u, nx, ny);
+    }
+    mean = nx * (double)ny / 2;
+    var = nx * (double)ny / 12 * ((n + 1) - ties / ((double)n * (n - 1)));
+    if (var <= 0) {
+        return 1;
+    }
+    /* With a continuity correction of 1/2 towards the mean */
+    z = (fabs(u - mean) - 0.5) / sqrt(var);
+    if (z < 0) {
+        z = 0;
+    }
+    return erfc(z / sqrt(2));
+}
+
+double bench_mann_whitney_min(int nx, int ny)
+{
+    double ways = 1, sd;
+    int i;
+
+    if (nx == 0 || ny == 0) {
+        return 1;
+    }
+    if (nx + ny <= BENCH_EXACT_MAX) {
+        /* Only the two orders where one set is all below the other */
+        for (i = 1; i <= nx; i++) {
+            ways = ways * (ny + i) / i;
+        }
+        return fmin(1, 2 / ways);
+    }
+    sd = sqrt(nx * (double)ny * (nx + ny + 1) / 12);
+    return erfc((nx * (double)ny / 2 - 0.5) / sd / sqrt(2));
+}
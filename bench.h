@@ -0,0 +1,59 @@
+/*
+ * bench.h - Robust statistics of repeated timings
+ *
+ * A benchmark on a shared machine is disturbed now and then by other
+ * work, so its timings have a long right tail.  They are summarized by
+ * their median and median absolute deviation, which a few outliers do
+ * not move, with a bootstrap confidence interval of the median.  Two
+ * sets of timings are compared with the Mann-Whitney U test, which only
+ * uses their ranks and so makes no assumption about their distribution.
+ */
+#ifndef __BENCH_H_
+#define __BENCH_H_
+
+/* Resamples drawn for a bootstrap confidence interval */
+#define BENCH_RESAMPLES 2000
+
+/*
+ * Largest total of values whose U test uses the exact distribution of U;
+ * its counts, at most C(50, 25), are exact in a double
+ */
+#define BENCH_EXACT_MAX 50
+
+/*
+ * Return the median of the n values of x, sorting them in place
+ */
+double bench_median(double *x, int n);
+
+/*
+ * Return the median absolute deviation of the n values of x from their
+ * median, not scaled to estimate a standard deviation
+ */
+double bench_mad(const double *x, int n, double median);
+
+/*
+ * Set *lo and *hi to the bounds of the percentile bootstrap confidence
+ * interval of the median of the n values of x, at the given level
+ * (e.g. 0.95).  The resamples are drawn from a fixed seed, so the same
+ * timings always give the same interval.
+ */
+void bench_median_ci(const double *x, int n, double level,
+                     double *lo, double *hi);
+
+/*
+ * Return the two-sided p-value of the Mann-Whitney U test that the
+ * nx values of x and the ny values of y come from the same distribution;
+ * 1 if either set is empty.  Up to BENCH_EXACT_MAX values without ties,
+ * it is computed from the exact distribution of U, else from the normal
+ * approximation corrected for ties.
+ */
+double bench_mann_whitney(const double *x, int nx, const double *y, int ny);
+
+/*
+ * Return the smallest p-value bench_mann_whitney can give for nx and ny
+ * values, when they do not overlap at all.  A test at a level below it
+ * can never find a change.
+ */
+double bench_mann_whitney_min(int nx, int ny);
+
+#endif /* __BENCH_H_ */
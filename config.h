@@ -124,15 +124,45 @@
 
 /*********** Parameters controlling dense memory version of heap ***********/
 /*
- * Maximum heap size in bytes
+ * Maximum heap size in bytes.  Outside the driver (libmm.so), memlib
+ * reserves address space for real programs, only backed by the pages
+ * they touch.
  */
+#ifdef DRIVER
 #define MAX_DENSE_HEAP (100*(1<<20))  /* 100 MB */
+#else
+#define MAX_DENSE_HEAP (1UL<<36)      /* 64 GB */
+#endif
 
 /*
  * Starting address of the memory allocated for the heap by mmap
  */
 #define TRY_DENSE_HEAP_START (void *) 0x800000000
 
+/*
+ * Maximum number of heap regions, including the heap itself.  Each
+ * additional region reserves 1/MEM_MAX_REGIONS of the address space
+ * at its top (see mem_region_create).
+ */
+#define MEM_MAX_REGIONS 8
+
+/*
+ * Size of the address space reserved for the mapped areas of mem_map,
+ * placed right after the heap
+ */
+#ifdef DRIVER
+#define MAX_DENSE_MAP (100*(1<<20))  /* 100 MB */
+#else
+#define MAX_DENSE_MAP (1UL<<36)      /* 64 GB */
+#endif
+
+/*
+ * Maximum number of holes left between mapped areas and reused by
+ * mem_map.  The address space of further holes is only reused once it
+ * reaches the top of the mapped areas.
+ */
+#define MEM_MAX_MAP_HOLES 4096
+
 
 /*********** Parameters controlling sparse memory version of heap ***********/
 
@@ -141,6 +171,12 @@
  */
 #define MAX_SPARSE_HEAP (1UL<<62)  /* 1 EB */
 
+/*
+ * Size of the address space reserved for the mapped areas of mem_map,
+ * placed right after the heap
+ */
+#define MAX_SPARSE_MAP (1UL<<62)  /* 1 EB */
+
 /*
  * Initial address of emulated heap
  */
@@ -0,0 +1,52 @@
+/*
+ * hist.c - Log-bucketed histograms of operation latencies, see hist.h
+ */
+#include <string.h>
+
+#include "hist.h"
+
+/*
+ * hist_bucket_high - Largest value counted in bucket
+ */
+static uint64_t hist_bucket_high(int bucket)
+{
+    int shift;
+
+    if (bucket < 2 * HIST_SUB) {
+        return bucket;
+    }
+    shift = bucket / HIST_SUB - 1;
+    return (((uint64_t)(HIST_SUB + bucket % HIST_SUB) + 1) << shift) - 1;
+}
+
+void hist_reset(hist_t *hist)
+{
+    memset(hist, 0, sizeof(*hist));
+}
+
+uint64_t hist_percentile(const hist_t *hist, double fraction)
+{
+    uint64_t rank, seen = 0;
+    uint64_t high;
+    int i;
+
+    if (hist->total == 0) {
+        return 0;
+    }
+    /* Rank of the value wanted, from 1 */
+    rank = (uint64_t)(fraction * hist->total);
+    if (rank < fraction * hist->total || rank < 1) {
+        rank++;
+    }
+    if (rank >= hist->total) {
+        return hist->max;
+    }
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        seen += hist->counts[i];
+        if (seen >= rank) {
+            break;
+        }
+    }
+    high = hist_bucket_high(i);
+    return high < hist->max ? high : hist->max;
+}
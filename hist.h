@@ -0,0 +1,89 @@
+/*
+ * hist.h - Log-bucketed histograms of operation latencies
+ *
+ * A value is counted in a bucket whose width is at most 1/HIST_SUB of
+ * the value, as in HdrHistogram: values below 2*HIST_SUB have a bucket
+ * each, and every later power of two is split into HIST_SUB buckets.
+ * Recording a value is a few instructions and the histogram has a fixed
+ * size, so one can be kept for each type of request while a trace is
+ * replayed, and its percentiles read within 1/HIST_SUB afterwards.
+ */
+#ifndef __HIST_H_
+#define __HIST_H_
+
+#include <stdint.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+/* Buckets in each power of two, and its log */
+#define HIST_SUB_BITS 4
+#define HIST_SUB (1 << HIST_SUB_BITS)
+
+/* Enough buckets for any 64-bit value */
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+/* Name of the unit of cycle_count */
+#if defined(__x86_64__) || defined(__i386__)
+#define CYCLE_UNIT "cycles"
+#else
+#define CYCLE_UNIT "ns"
+#endif
+
+typedef struct {
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t total;         /* values recorded */
+    uint64_t max;           /* largest value recorded */
+} hist_t;
+
+/*
+ * cycle_count - A cheap timestamp for timing a single request: the time
+ *     stamp counter on x86, whose ticks are reference cycles, and a
+ *     monotonic clock in nanoseconds elsewhere
+ */
+static inline uint64_t cycle_count(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+/* hist_bucket - Index of the bucket counting value */
+static inline int hist_bucket(uint64_t value)
+{
+    int shift;
+
+    if (value < 2 * HIST_SUB) {
+        return (int)value;
+    }
+    /* Keep the leading one and the HIST_SUB_BITS bits after it */
+    shift = 63 - __builtin_clzll(value) - HIST_SUB_BITS;
+    return (shift + 1) * HIST_SUB + (int)((value >> shift) - HIST_SUB);
+}
+
+/* hist_add - Record one value */
+static inline void hist_add(hist_t *hist, uint64_t value)
+{
+    hist->counts[hist_bucket(value)]++;
+    hist->total++;
+    if (value > hist->max) {
+        hist->max = value;
+    }
+}
+
+/* Forget every value recorded */
+void hist_reset(hist_t *hist);
+
+/*
+ * Return the smallest value that at least fraction of the recorded
+ * values do not exceed, rounded up to the end of its bucket; 0 if no
+ * value was recorded.  hist_percentile(hist, 1.0) is hist->max.
+ */
+uint64_t hist_percentile(const hist_t *hist, double fraction);
+
+#endif /* __HIST_H_ */
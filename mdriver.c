@@ -7,9 +7,11 @@
  * Copyright (c) 2004-2016, R. Bryant and D. O'Hallaron, All rights
  * reserved.  May not be used, modified, or copied without permission.
  */
+#define _GNU_SOURCE
 #include <assert.h>
 #include <errno.h>
 #include <float.h>
+#include <sched.h>
 #include <setjmp.h>
 #include <signal.h>
 #include <stdarg.h>
@@ -20,12 +22,22 @@
 #include <unistd.h>
 #include <stdbool.h>
 #include <math.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#ifdef THREAD_SAFE
+#include <pthread.h>
+#endif
 
 #include "mm.h"
 #include "memlib.h"
 #include "fcyc.h"
+#include "clock.h"
 #include "config.h"
 #include "stree.h"
+#include "trace.h"
+#include "bench.h"
+#include "hist.h"
+#include "perfctr.h"
 
 /**********************
  * Constants and macros
@@ -35,6 +47,15 @@
 #define MAXLINE     1024          /* max string size */
 #define HDRLINES       4          /* number of header lines in a trace file */
 #define LINENUM(i) (i+HDRLINES+1) /* cnvt trace request nums to linenums (origin 1) */
+#define RSS_SAMPLES  256          /* resident memory samples per trace */
+#define STREAM_CHUNK_OPS (1<<16)  /* requests per chunk of a streamed trace */
+#define STREAM_MIN_SLOTS 1024     /* initial live blocks of a streamed trace */
+#define BENCH_MAX_SAMPLES 100     /* most timed replays of a trace with -B */
+#define BENCH_WARMUP     3        /* untimed replays before the samples */
+#define BENCH_MIN_SECS   0.01     /* shortest sample, repeating the replay */
+#define BENCH_LEVEL      0.95     /* confidence level of the intervals */
+#define BENCH_ALPHA      0.01     /* significance level of a change with -C */
+#define BENCH_MIN_CHANGE 0.01     /* smallest change reported with -C */
 
 #ifndef REF_ONLY
 #define REF_ONLY 0
@@ -78,12 +99,11 @@ typedef struct {
     tree_t *lo_tree;
 } range_set_t;
 
-/* Characterizes a single trace operation (allocator request) */
+/* Maps the id of a live block to its slot, id is -1 for an empty entry */
 typedef struct {
-    enum { ALLOC, FREE, REALLOC } type; /* type of request */
-    long index;                         /* index for free() to use later */
-    size_t size;                        /* byte size of alloc/realloc request */
-} traceop_t;
+    int id;
+    int slot;
+} live_t;
 
 /* Holds the information for one trace file */
 typedef struct {
@@ -93,9 +113,30 @@ typedef struct {
     int num_ops;          /* number of distinct requests */
     weight_t weight;      /* weight for this trace */
     traceop_t *ops;       /* array of requests */
+    trace_file_t file;    /* owner of ops, possibly a mapped binary trace */
     char **blocks;        /* array of ptrs returned by malloc/realloc... */
     size_t *block_sizes;  /* ... and a corresponding array of payload sizes */
     int *block_rand_base; /* index into random_data, if debug is on */
+
+    /* Requests chunk_start up to chunk_end are at chunk */
+    const traceop_t *chunk;
+    int chunk_start;
+    int chunk_end;
+
+    /*
+     * A streamed trace (-S) never holds all of its requests, and its
+     * block arrays are indexed by slot rather than by id: a hash map
+     * assigns a slot to each live id, so they are sized by the peak
+     * number of live blocks rather than by num_ids.
+     */
+    trace_stream_t *stream; /* NULL if the trace was loaded */
+    live_t *live;         /* open-addressed map from ids to slots */
+    int live_mask;        /* number of map entries - 1 */
+    int num_live;         /* ids in the map */
+    int *free_slots;      /* stack of slots released by frees */
+    int num_free_slots;
+    int num_slots;        /* slots handed out so far... */
+    int max_slots;        /* ... and the length of the block arrays */
 } trace_t;
 
 /*
@@ -108,6 +149,26 @@ typedef struct {
     range_set_t *ranges;
 } speed_t;
 
+#ifdef THREAD_SAFE
+/* Holds the params of one thread replaying a trace in eval_mm_threads */
+typedef struct {
+    trace_t *trace;
+    char **blocks;              /* this thread's own block pointers */
+    pthread_barrier_t *start;   /* released once all threads are ready */
+    bool failed;                /* set if an allocation failed */
+} thread_arg_t;
+#endif
+
+/* Number of slowest requests of each type reported with -L */
+#define LATENCY_WORST 3
+
+/* Latency of each request of a trace, measured with -L */
+typedef struct {
+    hist_t hists[3];    /* by request type: ALLOC, FREE, REALLOC */
+    int worst_ops[3][LATENCY_WORST];         /* slowest requests, slowest first */
+    uint64_t worst_cycles[3][LATENCY_WORST]; /* ... and their latencies */
+} latency_t;
+
 /* Summarizes the important stats for some malloc function on some trace */
 typedef struct {
     /* set in read_trace */
@@ -122,6 +183,17 @@ typedef struct {
 
     /* defined only for the student malloc package */
     double util;       /* space utilization for this trace (always 0 for libc) */
+    double copied;     /* bytes copied by reallocs which moved their block */
+    double sbrks;      /* number of mem_sbrk calls made during the trace */
+    double rss_avg;    /* resident heap bytes, averaged over the trace */
+    double rss_end;    /* resident heap bytes left at the end of the trace */
+    latency_t *latency; /* latency of each request, only with -L */
+    mm_stats_t counters; /* allocator counters of one replay (mm_stats)... */
+    bool has_counters;   /* ... if it was built with -DMM_STATS */
+    double events[PERFCTR_EVENTS]; /* hardware events of one replay (-H)... */
+    bool has_events;     /* ... if any could be counted, -1 for the others */
+    int num_samples;     /* secs of each replay timed with -B */
+    double samples[BENCH_MAX_SAMPLES];
 
     /* Note: secs and util are only defined if valid is true */
 } stats_t;
@@ -163,6 +235,19 @@ static bool onetime_flag = false;
 static bool tab_mode = false;     /* Print output as tab-separated fields */
 /* If set, use sparse memory emulation */
 static bool sparse_mode = SPARSE_MODE;
+/* If set, stream the traces in chunks instead of loading them (-S) */
+static bool stream_mode = false;
+/* If set, time each request of the traces separately (-L) */
+static bool latency_mode = false;
+/* Cost of reading the cycle counter, taken off each latency */
+static uint64_t timer_overhead = 0;
+/* If set, count the hardware events of a replay of each trace (-H) */
+static bool events_mode = false;
+/* If set, time this many replays of each trace instead of the K best (-B) */
+static int bench_samples = 0;
+/* Files to write the samples to (-o), and to compare them with (-C) */
+static char *bench_out = NULL;
+static char *bench_baseline = NULL;
 static size_t maxfill = SPARSE_MODE ? MAXFILL_SPARSE : MAXFILL;
 
 #ifdef SPARSE_MODE
@@ -172,6 +257,17 @@ size_t queryGlobalSpaceUsage(void);
 /* by default, no timeouts */
 static int set_timeout = 0;
 
+/* If set, sample the shape of the heap every so many requests (-P) */
+static int profile_period = 0;
+
+/* If set, run the traces in this many worker processes (-j) */
+static int num_jobs = 0;
+
+#ifdef THREAD_SAFE
+/* Replay each trace on up to this many threads (set by -m) */
+static int max_threads = 0;
+#endif
+
 /* Directory where default tracefiles are found */
 static char tracedir[MAXLINE] = TRACEDIR;
 
@@ -211,6 +307,7 @@ static range_set_t *new_range_set();
 static bool add_range(range_set_t *ranges, char *lo, size_t size,
                       const trace_t *trace, int opnum, int index);
 static void remove_range(range_set_t *ranges, char *lo);
+static void clear_ranges(range_set_t *ranges);
 static void free_range_set(range_set_t *ranges);
 
 /* These functions implement the debugging code */
@@ -224,6 +321,13 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
 static void reinit_trace(trace_t *trace);
 static void free_trace(trace_t *trace);
 
+/* These functions walk the requests and the live blocks of a trace */
+static inline const traceop_t *trace_op(trace_t *trace, int i);
+static const traceop_t *next_chunk(trace_t *trace, int i);
+static int find_slot(const trace_t *trace, int index);
+static int block_slot(trace_t *trace, int index);
+static void drop_block(trace_t *trace, int index);
+
 /* Routines for evaluating the correctness and speed of libc malloc */
 static bool eval_libc_valid(trace_t *trace);
 static void eval_libc_speed(void *ptr);
@@ -231,11 +335,37 @@ static void eval_libc_speed(void *ptr);
 /* Routines for evaluating correctnes, space utilization, and speed
    of the student's malloc package in mm.c */
 static bool eval_mm_valid(trace_t *trace, range_set_t *ranges);
-static double eval_mm_util(trace_t *trace, int tracenum);
+static void eval_mm_util(trace_t *trace, int tracenum, stats_t *stats);
 static void eval_mm_speed(void *ptr);
+static void eval_mm_latency(trace_t *trace, latency_t *latency);
+static double bench_trace(speed_t *speed_params, stats_t *stats);
+static void count_events(speed_t *speed_params, stats_t *stats);
+static void touch_block(char *p, size_t size);
+static FILE *profile_open(const trace_t *trace);
+static void profile_sample(FILE *profile, int opnum, size_t live_bytes);
+
+#ifdef THREAD_SAFE
+/* Routines for the multithreaded replay of the thread-safe mm.c */
+static void run_thread_tests(int num_tracefiles, const char *tracedir,
+                             char **tracefiles);
+static double eval_mm_threads(trace_t *trace, int nthreads);
+static void *replay_thread(void *ptr);
+#endif
 
 /* Various helper routines */
 static void printresults(int n, stats_t *stats, sum_stats_t *sumstats);
+static void printlatency(int n, stats_t *stats);
+static void printcounters(int n, stats_t *stats);
+static void printbench(int n, stats_t *stats);
+static void printevents(int n, stats_t *stats);
+static void write_samples(const char *path, int n, stats_t *stats);
+static int compare_samples(const char *path, int n, stats_t *stats);
+static void read_counters(stats_t *stats);
+static void *shared_calloc(size_t n, size_t size);
+static int count_cpus(void);
+static void pin_to_cpu(int n);
+static void warn_turbo(void);
+static uint64_t measure_timer_overhead(void);
 static void usage(char *prog);
 static void malloc_error(const trace_t *trace, int opnum, const char *fmt, ...)
     __attribute__((format(printf, 3,4)));
@@ -259,69 +389,236 @@ static double lookup_ref_throughput(bool checkpoint);
 static double measure_ref_throughput(bool checkpoint);
 
 /*
- * Run the tests; return the number of tests run (may be less than
- * num_tracefiles, if there's a timeout)
+ * Run the tests on trace i; return false if no other trace should be run
+ * (with -c)
  */
-static void run_tests(int num_tracefiles, const char *tracedir,
-                      char **tracefiles,
+static bool run_trace(int i, const char *tracedir, char **tracefiles,
                       stats_t *mm_stats, speed_t *speed_params) {
-    volatile int i;
+    /* initialize simulated memory system in memlib.c *
+     * start each trace with a clean system */
+    mem_init(sparse_mode);
+    range_set_t *ranges = new_range_set();
 
-    for (i=0; i < num_tracefiles; i++) {
-        /* initialize simulated memory system in memlib.c *
-         * start each trace with a clean system */
-        mem_init(sparse_mode);
-        range_set_t *ranges = new_range_set();
 
+    // NOTE: If times out, then it will reread the trace file
 
-        // NOTE: If times out, then it will reread the trace file
+    trace_t *trace;
+    trace = read_trace(&mm_stats[i], tracedir, tracefiles[i]);
+    strcpy(mm_stats[i].filename, trace->filename);
+    mm_stats[i].ops = trace->num_ops;
 
-        trace_t *trace;
-        trace = read_trace(&mm_stats[i], tracedir, tracefiles[i]);
-        strcpy(mm_stats[i].filename, trace->filename);
-        mm_stats[i].ops = trace->num_ops;
+    /* Prepare for timeout */
+    if (setjmp(timeout_jmpbuf) != 0) {
+        mm_stats[i].valid = false;
+    } else {
+        if (verbose > 1)
+            printf("Checking mm_malloc for correctness, ");
+        mm_stats[i].valid =
+            /* Do 2 tests, since may fail to reinitialize properly */
+            eval_mm_valid(trace, ranges) && eval_mm_valid(trace, ranges);
 
-        /* Prepare for timeout */
-        if (setjmp(timeout_jmpbuf) != 0) {
-            mm_stats[i].valid = false;
-        } else {
-            if (verbose > 1)
-                printf("Checking mm_malloc for correctness, ");
-            mm_stats[i].valid =
-                /* Do 2 tests, since may fail to reinitialize properly */
-                eval_mm_valid(trace, ranges) && eval_mm_valid(trace, ranges);
-
-            if (onetime_flag) {
-                free_trace(trace);
-                free_range_set(ranges);
-                return;
-            }
+        if (onetime_flag) {
+            free_trace(trace);
+            free_range_set(ranges);
+            return false;
         }
-        if (mm_stats[i].valid) {
-            if (verbose > 1)
-                printf("efficiency, ");
-            mm_stats[i].util = eval_mm_util(trace, i);
-            speed_params->trace = trace;
-            speed_params->ranges = ranges;
+    }
+    if (mm_stats[i].valid) {
+        if (verbose > 1)
+            printf("efficiency, ");
+        eval_mm_util(trace, i, &mm_stats[i]);
+        speed_params->trace = trace;
+        speed_params->ranges = ranges;
+        if (verbose > 1)
+            printf("and performance.\n");
+        if (sparse_mode)
+            mm_stats[i].secs = 1.0;
+        else if (bench_samples > 0)
+            mm_stats[i].secs = bench_trace(speed_params, &mm_stats[i]);
+        else
+            mm_stats[i].secs = fsec(eval_mm_speed, speed_params);
+        mm_stats[i].tput = mm_stats[i].ops / (mm_stats[i].secs * 1000.0);
+        /* The counters of the last timed replay, mm_init resets them */
+        read_counters(&mm_stats[i]);
+        if (events_mode && !sparse_mode)
+            count_events(speed_params, &mm_stats[i]);
+        if (latency_mode && !sparse_mode) {
             if (verbose > 1)
-                printf("and performance.\n");
-            mm_stats[i].secs = sparse_mode ? 1.0 : fsec(eval_mm_speed, speed_params);
-            mm_stats[i].tput = mm_stats[i].ops / (mm_stats[i].secs * 1000.0);
+                printf("Timing each request.\n");
+            /* Already set if it is shared with the parent (-j) */
+            if (mm_stats[i].latency == NULL)
+                mm_stats[i].latency = malloc(sizeof(latency_t));
+            if (mm_stats[i].latency == NULL)
+                unix_error("malloc of latency_t failed in run_trace");
+            eval_mm_latency(trace, mm_stats[i].latency);
         }
+    }
 
 #if 0
-        printf(" %d operations.  %ld comparisons.  Avg = %.1f\n",
-               trace->num_ops, ranges->lo_tree->comparison_count,
-               (double) ranges->lo_tree->comparison_count / trace->num_ops);
+    printf(" %d operations.  %ld comparisons.  Avg = %.1f\n",
+           trace->num_ops, ranges->lo_tree->comparison_count,
+           (double) ranges->lo_tree->comparison_count / trace->num_ops);
 #endif
-        free_trace(trace);
-        free_range_set(ranges);
+    free_trace(trace);
+    free_range_set(ranges);
+
+    /* clean up memory system */
+    mem_deinit();
+    return true;
+}
 
-        /* clean up memory system */
-        mem_deinit();
+/*
+ * Run the tests on each trace in turn
+ */
+static void run_tests(int num_tracefiles, const char *tracedir,
+                      char **tracefiles,
+                      stats_t *mm_stats, speed_t *speed_params) {
+    int i;
+
+    for (i=0; i < num_tracefiles; i++) {
+        if (!run_trace(i, tracedir, tracefiles, mm_stats, speed_params))
+            return;
     }
 }
 
+/*
+ * Run the tests in <jobs> worker processes, each one pinned to a core of
+ * its own and with its own memlib heap.  A worker takes the next trace
+ * nobody has started, until none is left, and writes its stats straight
+ * into mm_stats, which must come from shared_calloc.  The errors found
+ * by the workers are added up from their exit status.
+ */
+static void run_tests_parallel(int jobs, int num_tracefiles,
+                               const char *tracedir, char **tracefiles,
+                               stats_t *mm_stats, speed_t *speed_params) {
+    int *next_trace = shared_calloc(1, sizeof(int));
+    int cpus = count_cpus();
+    unsigned timeout = alarm(0); /* the rest of it goes to the workers */
+    latency_t *latencies;
+    int i, w, status;
+    pid_t pid;
+
+    /* Workers sharing a core would slow each other down */
+    if (jobs > cpus) {
+        fprintf(stderr, "Only %d cores are available, running %d workers\n",
+                cpus, cpus);
+        jobs = cpus;
+    }
+    warn_turbo();
+
+    /* The workers fill in the latencies in place of the parent */
+    if (latency_mode) {
+        latencies = shared_calloc(num_tracefiles, sizeof(latency_t));
+        for (i = 0; i < num_tracefiles; i++)
+            mm_stats[i].latency = &latencies[i];
+    }
+
+    fflush(stdout);
+    fflush(stderr);
+    for (w = 0; w < jobs; w++) {
+        if ((pid = fork()) < 0)
+            unix_error("fork failed in run_tests_parallel");
+        if (pid == 0) {
+            pin_to_cpu(w);
+            if (timeout > 0)
+                alarm(timeout);
+            while ((i = __atomic_fetch_add(next_trace, 1, __ATOMIC_RELAXED))
+                   < num_tracefiles)
+                run_trace(i, tracedir, tracefiles, mm_stats, speed_params);
+            fflush(stdout);
+            _exit(errors < 255 ? errors : 255);
+        }
+    }
+
+    for (w = 0; w < jobs; w++) {
+        if (wait(&status) < 0)
+            unix_error("wait failed in run_tests_parallel");
+        if (WIFEXITED(status)) {
+            errors += WEXITSTATUS(status);
+        } else {
+            fprintf(stderr, "A worker was killed by signal %d\n",
+                    WTERMSIG(status));
+            errors++;
+        }
+    }
+}
+
+/*
+ * shared_calloc - Allocate n zeroed elements of size bytes, in memory
+ *    which the worker processes forked afterwards share with the driver
+ */
+static void *shared_calloc(size_t n, size_t size)
+{
+    void *p = mmap(NULL, n * size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+    if (p == MAP_FAILED)
+        unix_error("mmap failed in shared_calloc");
+    return p;
+}
+
+/*
+ * count_cpus - Return the number of cores the driver may run on
+ */
+static int count_cpus(void)
+{
+    cpu_set_t set;
+
+    if (sched_getaffinity(0, sizeof(set), &set) < 0)
+        return 1;
+    return CPU_COUNT(&set);
+}
+
+/*
+ * pin_to_cpu - Bind the calling process to the n-th core the driver may
+ *    run on, so that it is not migrated while it is timed
+ */
+static void pin_to_cpu(int n)
+{
+    cpu_set_t set, one;
+    int cpu;
+
+    if (sched_getaffinity(0, sizeof(set), &set) < 0)
+        return;
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &set) && n-- == 0) {
+            CPU_ZERO(&one);
+            CPU_SET(cpu, &one);
+            if (sched_setaffinity(0, sizeof(one), &one) < 0)
+                fprintf(stderr, "Could not pin a worker to core %d\n", cpu);
+            return;
+        }
+    }
+}
+
+/*
+ * warn_turbo - Warn if the cores may boost their clock above its base
+ *    rate: how far they boost depends on how many of them are busy, so
+ *    the throughput of parallel runs would not match that of sequential
+ *    ones.  See the README for turning it off.
+ */
+static void warn_turbo(void)
+{
+    FILE *fp;
+    int c;
+
+    if ((fp = fopen("/sys/devices/system/cpu/intel_pstate/no_turbo", "r"))) {
+        c = fgetc(fp);
+        fclose(fp);
+        if (c != '0')
+            return;
+    } else if ((fp = fopen("/sys/devices/system/cpu/cpufreq/boost", "r"))) {
+        c = fgetc(fp);
+        fclose(fp);
+        if (c != '1')
+            return;
+    } else {
+        return;
+    }
+    fprintf(stderr, "Warning: turbo boost is on, the throughput of parallel "
+            "runs varies with the load\n");
+}
+
 /**************
  * Main routine
  **************/
@@ -338,6 +635,7 @@ int main(int argc, char **argv)
     bool run_libc = false;     /* If set, run libc malloc (set by -l) */
     bool autograder = false;   /* if set then called by autograder (-A) */
     bool checkpoint = false;
+    int regressions = 0;       /* traces slower than the baseline of -C */
 
     setbuf(stdout, 0);
     setbuf(stderr, 0);
@@ -352,7 +650,7 @@ int main(int argc, char **argv)
     /*
      * Read and interpret the command line arguments
      */
-    while ((c = getopt(argc, argv, "d:f:c:s:t:v:hpOVAlDT")) != EOF) {
+    while ((c = getopt(argc, argv, "d:f:c:s:t:v:m:P:j:B:o:C:hpOVAlDSTLH")) != EOF) {
         switch (c) {
 
         case 'A': /* Hidden Autolab driver argument */
@@ -409,6 +707,53 @@ int main(int argc, char **argv)
             tab_mode = true;
             break;
 
+        case 'S': /* Stream the traces instead of loading them */
+            stream_mode = true;
+            break;
+
+        case 'L': /* Report the latency of each type of request */
+            latency_mode = true;
+            break;
+
+        case 'H': /* Count the hardware events of each trace */
+            events_mode = true;
+            break;
+
+        case 'B': /* Time <n> replays of each trace */
+            bench_samples = atoi(optarg);
+            if (bench_samples < 2 || bench_samples > BENCH_MAX_SAMPLES)
+                app_error("-B needs between 2 and %d samples", BENCH_MAX_SAMPLES);
+            break;
+
+        case 'o': /* Write the samples of -B to <file> */
+            bench_out = optarg;
+            break;
+
+        case 'C': /* Compare the samples of -B with those in <file> */
+            bench_baseline = optarg;
+            break;
+
+        case 'j': /* Run the traces in <n> worker processes */
+            num_jobs = atoi(optarg);
+            if (num_jobs <= 0)
+                app_error("-j needs a positive number of workers");
+            break;
+
+        case 'P': /* Write the shape of the heap every <n> requests */
+            profile_period = atoi(optarg);
+            if (profile_period <= 0)
+                app_error("-P needs a positive number of requests");
+            break;
+
+        case 'm': /* Replay the traces on up to <n> threads */
+#ifdef THREAD_SAFE
+            max_threads = atoi(optarg);
+#else
+            fprintf(stderr, "-m requires the thread-safe driver (mdriver-mt)\n");
+            exit(1);
+#endif
+            break;
+
         case 'h': /* Print this message */
             usage(argv[0]);
             exit(0);
@@ -420,6 +765,14 @@ int main(int argc, char **argv)
     }
 #endif /* !REF_ONLY */
 
+    /* Only the mm evaluation knows how to replay a streamed trace */
+    if (stream_mode && run_libc)
+        app_error("-S cannot be combined with -l");
+#ifdef THREAD_SAFE
+    if (stream_mode && max_threads > 0)
+        app_error("-S cannot be combined with -m");
+#endif
+
     if (num_global_tracefiles == 0) {
         int i;
         if (sparse_mode & !run_libc) {
@@ -501,12 +854,39 @@ int main(int argc, char **argv)
         printf("\nTesting mm malloc\n");
 
     /* Allocate the mm stats array, with one stats_t struct per tracefile */
-    mm_stats = (stats_t *)calloc(num_global_tracefiles, sizeof(stats_t));
-    if (mm_stats == NULL)
-        unix_error("mm_stats calloc in main failed");
+    if ((bench_out != NULL || bench_baseline != NULL) && bench_samples == 0)
+        app_error("-o and -C need the samples of -B");
+
+    /* With too few samples even two sets apart cannot reach BENCH_ALPHA,
+     * and -C would call every trace the same: 5 a side at 1% */
+    if (bench_baseline != NULL &&
+        bench_mann_whitney_min(bench_samples, bench_samples) >= BENCH_ALPHA) {
+        int need = bench_samples;
+        while (bench_mann_whitney_min(need, need) >= BENCH_ALPHA)
+            need++;
+        app_error("-C needs -B %d or more to find a change at p < %g",
+                  need, BENCH_ALPHA);
+    }
 
-    run_tests(num_global_tracefiles, tracedir, global_tracefiles, mm_stats,
-              &speed_params);
+    /* -c stops at the first trace, which workers cannot share */
+    if (onetime_flag)
+        num_jobs = 0;
+    if (num_jobs > 0) {
+        mm_stats = shared_calloc(num_global_tracefiles, sizeof(stats_t));
+    } else {
+        mm_stats = (stats_t *)calloc(num_global_tracefiles, sizeof(stats_t));
+        if (mm_stats == NULL)
+            unix_error("mm_stats calloc in main failed");
+    }
+
+    if (latency_mode)
+        timer_overhead = measure_timer_overhead();
+    if (num_jobs > 0)
+        run_tests_parallel(num_jobs, num_global_tracefiles, tracedir,
+                           global_tracefiles, mm_stats, &speed_params);
+    else
+        run_tests(num_global_tracefiles, tracedir, global_tracefiles,
+                  mm_stats, &speed_params);
 
 
     /* Display the mm results in a compact table */
@@ -524,9 +904,33 @@ int main(int argc, char **argv)
             printf("\nResults for mm malloc:\n");
             printresults(num_global_tracefiles, mm_stats, &global_mm_sum_stats);
             printf("\n");
+            if (latency_mode && !sparse_mode) {
+                printlatency(num_global_tracefiles, mm_stats);
+                printf("\n");
+            }
+            printcounters(num_global_tracefiles, mm_stats);
+            if (events_mode && !sparse_mode)
+                printevents(num_global_tracefiles, mm_stats);
         }
     }
 
+    /* Optionally summarize, save and compare the timings of -B */
+    if (bench_samples > 0 && !onetime_flag && !sparse_mode) {
+        printbench(num_global_tracefiles, mm_stats);
+        if (bench_out != NULL)
+            write_samples(bench_out, num_global_tracefiles, mm_stats);
+        if (bench_baseline != NULL)
+            regressions = compare_samples(bench_baseline,
+                                          num_global_tracefiles, mm_stats);
+        printf("\n");
+    }
+
+#ifdef THREAD_SAFE
+    /* Optionally replay the traces on several threads */
+    if (max_threads > 0 && !onetime_flag && errors == 0)
+        run_thread_tests(num_global_tracefiles, tracedir, global_tracefiles);
+#endif
+
     /* Optionally compare the performance of mm and libc */
     if (run_libc) {
         printf("Comparison with libc malloc: mm/libc = %.0f Kops / %.0f Kops = %.2f\n",
@@ -681,7 +1085,7 @@ int main(int argc, char **argv)
                 avg_mm_harm_throughput, avg_mm_util*100);
         printf("%s\n", autoresult);
     }
-    exit(0);
+    exit(regressions > 0 ? 2 : 0);
 }
 
 
@@ -731,9 +1135,8 @@ static bool add_range(range_set_t *ranges, char *lo, size_t size,
         return false;
     }
 
-    /* The payload must lie within the extent of the heap */
-    if ((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) ||
-        (hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi())) {
+    /* The payload must lie within the extent of the heap (or a region) */
+    if (!mem_in_heap(lo, hi - lo + 1)) {
         malloc_error(trace, opnum,
                      "Payload (%p:%p) lies outside heap (%p:%p)",
                      lo, hi, mem_heap_lo(), mem_heap_hi());
@@ -801,6 +1204,17 @@ static void remove_range(range_set_t *ranges, char *lo)
     free(p);
 }
 
+/*
+ * clear_ranges - free the records of the blocks a previous run of the
+ *     trace left allocated
+ */
+static void clear_ranges(range_set_t *ranges)
+{
+    tree_free(ranges->lo_tree, free);
+    ranges->list = NULL;
+    ranges->lo_tree = tree_new();
+}
+
 /*
  * free_range_set - free all of the range records for a trace
  */
@@ -830,19 +1244,21 @@ static void randomize_block(trace_t *traces, int index) {
     size_t i;
     randint_t *block;
     int base;
+    int slot;
 
     if (debug_mode == DBG_NONE) return;
 
-    traces->block_rand_base[index] = random();
+    slot = find_slot(traces, index);
+    traces->block_rand_base[slot] = random();
 
-    block = (randint_t*)traces->blocks[index];
-    size = traces->block_sizes[index] / sizeof(*block);
+    block = (randint_t*)traces->blocks[slot];
+    size = traces->block_sizes[slot] / sizeof(*block);
     if (size == 0)
         return;
     fsize = size;
     if (fsize > maxfill)
         fsize = maxfill;
-    base = traces->block_rand_base[index];
+    base = traces->block_rand_base[slot];
 
     // NOTE: It's expensive to do this one byte at a time.
 
@@ -863,12 +1279,14 @@ static bool check_index(const trace_t *trace, int opnum, int index) {
     int base;
     int ngarbled = 0;
     int firstgarbled = -1;
+    int slot;
 
     if (index < 0) return true; /* we're doing free(NULL) */
     if (debug_mode == DBG_NONE) return true;
+    if ((slot = find_slot(trace, index)) < 0) return true;
 
-    block = (randint_t*)trace->blocks[index];
-    size = trace->block_sizes[index] / sizeof(*block);
+    block = (randint_t*)trace->blocks[slot];
+    size = trace->block_sizes[slot] / sizeof(*block);
     if (size == 0)
         return true;
     fsize = size;
@@ -877,7 +1295,7 @@ static bool check_index(const trace_t *trace, int opnum, int index) {
     if (fsize > thresh)
         fsize = thresh;
 
-    base = trace->block_rand_base[index];
+    base = trace->block_rand_base[slot];
 
     // NOTE: It's expensive to do this one byte at a time.
     setUBCheck(false);
@@ -907,14 +1325,8 @@ static bool check_index(const trace_t *trace, int opnum, int index) {
 static trace_t *read_trace(stats_t *stats, const char *tracedir,
                            const char *filename)
 {
-    FILE *tracefile;
     trace_t *trace;
-    char type[MAXLINE];
-    int index;
-    size_t size;
-    int max_index = 0;
-    int op_index;
-    int ignore = 0;
+    const trace_header_t *header;
 
     if (verbose > 1)
         printf("Reading tracefile: %s\n", filename);
@@ -926,76 +1338,67 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
     /* Read the trace file header */
     strcpy(trace->filename, tracedir);
     strcat(trace->filename, filename);
-    if ((tracefile = fopen(trace->filename, "r")) == NULL) {
-        unix_error("Could not open %s in read_trace", trace->filename);
+    memset(&trace->file, 0, sizeof(trace->file));
+    trace->stream = NULL;
+    trace->live = NULL;
+    trace->free_slots = NULL;
+
+    if (stream_mode) {
+        /* Only read the header, the requests come in chunks */
+        if ((trace->stream = malloc(sizeof(trace_stream_t))) == NULL)
+            unix_error("malloc 2 failed in read_trace");
+        if (!trace_stream_open(trace->filename, trace->stream,
+                               STREAM_CHUNK_OPS)) {
+            app_error("Could not open %s in read_trace", trace->filename);
+        }
+        header = &trace->stream->header;
+        trace->ops = NULL;
+    } else {
+        /* Load the requests, in place if the trace is binary */
+        if (!trace_load(trace->filename, &trace->file)) {
+            app_error("Could not load %s in read_trace", trace->filename);
+        }
+        header = &trace->file.header;
+        trace->ops = trace->file.ops;
     }
-    int iweight;
-    ignore += fscanf(tracefile, "%d", &iweight);
-    trace->weight = iweight;
-    ignore += fscanf(tracefile, "%d", &trace->num_ids);
-    ignore +=  fscanf(tracefile, "%d", &trace->num_ops);
-    ignore +=  fscanf(tracefile, "%zd", &trace->data_bytes);
+    trace->weight = header->weight;
+    trace->num_ids = header->num_ids;
+    trace->num_ops = header->num_ops;
+    trace->data_bytes = header->data_bytes;
 
     if (trace->weight > 3) {
         app_error("%s: weight can only be in {0, 1, 2 3}", trace->filename);
     }
 
-    /* We'll store each request line in the trace in this array */
-    if ((trace->ops =
-         (traceop_t *)malloc(trace->num_ops * sizeof(traceop_t))) == NULL)
-        unix_error("malloc 2 failed in read_trace");
+    /*
+     * A streamed trace starts with STREAM_MIN_SLOTS slots and a map
+     * twice as large, and doubles them as the live blocks grow.
+     */
+    trace->max_slots = stream_mode ? STREAM_MIN_SLOTS : trace->num_ids;
+    if (stream_mode) {
+        trace->live_mask = 2 * STREAM_MIN_SLOTS - 1;
+        if ((trace->live = malloc(2 * STREAM_MIN_SLOTS * sizeof(live_t)))
+            == NULL
+            || (trace->free_slots = malloc(STREAM_MIN_SLOTS * sizeof(int)))
+            == NULL)
+            unix_error("malloc 6 failed in read_trace");
+    }
 
     /* We'll keep an array of pointers to the allocated blocks here... */
     if ((trace->blocks =
-         (char **)calloc(trace->num_ids, sizeof(char *))) == NULL)
+         (char **)calloc(trace->max_slots, sizeof(char *))) == NULL)
         unix_error("malloc 3 failed in read_trace");
 
     /* ... along with the corresponding byte sizes of each block */
     if ((trace->block_sizes =
-         (size_t *)calloc(trace->num_ids,  sizeof(size_t))) == NULL)
+         (size_t *)calloc(trace->max_slots,  sizeof(size_t))) == NULL)
         unix_error("malloc 4 failed in read_trace");
 
     /* and, if we're debugging, the offset into the random data */
     if ((trace->block_rand_base =
-         calloc(trace->num_ids, sizeof(*trace->block_rand_base))) == NULL)
+         calloc(trace->max_slots, sizeof(*trace->block_rand_base))) == NULL)
         unix_error("malloc 5 failed in read_trace");
 
-
-    /* read every request line in the trace file */
-    index = 0;
-    op_index = 0;
-    while (fscanf(tracefile, "%s", type) != EOF) {
-        switch(type[0]) {
-        case 'a':
-            ignore += fscanf(tracefile, "%u %lu", &index, &size);
-            trace->ops[op_index].type = ALLOC;
-            trace->ops[op_index].index = index;
-            trace->ops[op_index].size = size;
-            max_index = (index > max_index) ? index : max_index;
-            break;
-        case 'r':
-            ignore += fscanf(tracefile, "%u %lu", &index, &size);
-            trace->ops[op_index].type = REALLOC;
-            trace->ops[op_index].index = index;
-            trace->ops[op_index].size = size;
-            max_index = (index > max_index) ? index : max_index;
-            break;
-        case 'f':
-            ignore += fscanf(tracefile, "%u", &index);
-            trace->ops[op_index].type = FREE;
-            trace->ops[op_index].index = index;
-            break;
-        default:
-            app_error("Bogus type character (%c) in tracefile %s\n",
-                      type[0], trace->filename);
-        }
-        op_index++;
-        if (op_index == trace->num_ops) break;
-    }
-    fclose(tracefile);
-    assert(max_index == trace->num_ids - 1);
-    assert(trace->num_ops == op_index);
-
     /* fill in the stats */
     strcpy(stats->filename, trace->filename);
     stats->weight = trace->weight;
@@ -1009,24 +1412,217 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
  */
 static void reinit_trace(trace_t *trace)
 {
-    memset(trace->blocks, 0, trace->num_ids * sizeof(*trace->blocks));
-    memset(trace->block_sizes, 0, trace->num_ids * sizeof(*trace->block_sizes));
+    memset(trace->blocks, 0, trace->max_slots * sizeof(*trace->blocks));
+    memset(trace->block_sizes, 0, trace->max_slots * sizeof(*trace->block_sizes));
     /* block_rand_base is unused if size is zero */
+
+    if (trace->stream == NULL) {
+        trace->chunk = trace->ops;
+        trace->chunk_start = 0;
+        trace->chunk_end = trace->num_ops;
+        return;
+    }
+
+    /* Start streaming from the first request, with no live blocks */
+    trace_stream_rewind(trace->stream);
+    trace->chunk = NULL;
+    trace->chunk_start = 0;
+    trace->chunk_end = 0;
+    memset(trace->live, -1, (trace->live_mask + 1) * sizeof(*trace->live));
+    trace->num_live = 0;
+    trace->num_free_slots = 0;
+    trace->num_slots = 0;
 }
 
 /*
- * free_trace - Free the trace record and the four arrays it points
- *              to, all of which were allocated in read_trace().
+ * free_trace - Free the trace record, its requests and the arrays it
+ *              points to, all set up in read_trace().
  */
 static void free_trace(trace_t *trace)
 {
-    free(trace->ops);         /* free the three arrays... */
+    if (trace->stream != NULL) {
+        trace_stream_close(trace->stream);
+        free(trace->stream);
+    } else {
+        trace_unload(&trace->file); /* release the requests... */
+    }
     free(trace->blocks);
     free(trace->block_sizes);
     free(trace->block_rand_base);
+    free(trace->live);
+    free(trace->free_slots);
     free(trace);              /* and the trace record itself... */
 }
 
+/*
+ * trace_op - Return request i of the trace, or NULL past its end.  The
+ *     requests must be visited in order, starting from 0 after
+ *     reinit_trace.
+ */
+static inline const traceop_t *trace_op(trace_t *trace, int i)
+{
+    if (i < trace->chunk_end)
+        return &trace->chunk[i - trace->chunk_start];
+    return next_chunk(trace, i);
+}
+
+/*
+ * next_chunk - Move on to the chunk starting at request i, which is
+ *     only ever needed for a streamed trace.
+ */
+static const traceop_t *next_chunk(trace_t *trace, int i)
+{
+    size_t count;
+
+    if (trace->stream == NULL)
+        return NULL;
+    count = trace_stream_next(trace->stream, &trace->chunk);
+    if (count == 0) {
+        if (trace->stream->failed)
+            app_error("Could not read %s", trace->filename);
+        return NULL;
+    }
+    trace->chunk_start = i;
+    trace->chunk_end = i + count;
+    return trace->chunk;
+}
+
+/*
+ * live_hash - Home entry of an id in the live-block map
+ */
+static int live_hash(const trace_t *trace, int index)
+{
+    unsigned h = (unsigned) index * 0x9e3779b1u;
+    return (h ^ (h >> 16)) & trace->live_mask;
+}
+
+/*
+ * find_slot - Return the slot of the block of id index, or -1 if a
+ *     streamed trace has no such live block.
+ */
+static int find_slot(const trace_t *trace, int index)
+{
+    int i;
+
+    if (trace->live == NULL)
+        return index;
+    for (i = live_hash(trace, index); trace->live[i].id != -1;
+         i = (i + 1) & trace->live_mask) {
+        if (trace->live[i].id == index)
+            return trace->live[i].slot;
+    }
+    return -1;
+}
+
+/*
+ * reserve_live - Make room for one more live block in a streamed trace,
+ *     doubling its slots or its map when they are full
+ */
+static void reserve_live(trace_t *trace)
+{
+    int i, j;
+
+    if (trace->num_free_slots == 0 && trace->num_slots == trace->max_slots) {
+        int n = 2 * trace->max_slots;
+        if ((trace->blocks = realloc(trace->blocks, n * sizeof(char *))) == NULL
+            || (trace->block_sizes =
+                realloc(trace->block_sizes, n * sizeof(size_t))) == NULL
+            || (trace->block_rand_base =
+                realloc(trace->block_rand_base, n * sizeof(int))) == NULL
+            || (trace->free_slots =
+                realloc(trace->free_slots, n * sizeof(int))) == NULL)
+            unix_error("realloc failed in reserve_live");
+        memset(trace->blocks + trace->max_slots, 0,
+               trace->max_slots * sizeof(char *));
+        memset(trace->block_sizes + trace->max_slots, 0,
+               trace->max_slots * sizeof(size_t));
+        trace->max_slots = n;
+    }
+
+    /* Keep the map at most half full, so that probe runs stay short */
+    if (2 * (trace->num_live + 1) > trace->live_mask + 1) {
+        live_t *old = trace->live;
+        int old_size = trace->live_mask + 1;
+
+        trace->live_mask = 2 * old_size - 1;
+        if ((trace->live = malloc(2 * old_size * sizeof(live_t))) == NULL)
+            unix_error("malloc failed in reserve_live");
+        memset(trace->live, -1, 2 * old_size * sizeof(live_t));
+        for (i = 0; i < old_size; i++) {
+            if (old[i].id == -1)
+                continue;
+            for (j = live_hash(trace, old[i].id); trace->live[j].id != -1;
+                 j = (j + 1) & trace->live_mask)
+                ;
+            trace->live[j] = old[i];
+        }
+        free(old);
+    }
+}
+
+/*
+ * block_slot - Return the slot of the block of id index, handing out a
+ *     fresh slot if a streamed trace has no such live block.  Slots are
+ *     the ids themselves for a loaded trace.
+ */
+static int block_slot(trace_t *trace, int index)
+{
+    int i, slot;
+
+    if (trace->live == NULL)
+        return index;
+    if ((slot = find_slot(trace, index)) >= 0)
+        return slot;
+
+    reserve_live(trace);
+    slot = trace->num_free_slots > 0 ?
+        trace->free_slots[--trace->num_free_slots] : trace->num_slots++;
+
+    for (i = live_hash(trace, index); trace->live[i].id != -1;
+         i = (i + 1) & trace->live_mask)
+        ;
+    trace->live[i].id = index;
+    trace->live[i].slot = slot;
+    trace->num_live++;
+    return slot;
+}
+
+/*
+ * drop_block - Forget the block of id index once it has been freed, so
+ *     that its slot can be handed out again.  A loaded trace keeps the
+ *     state of every id.
+ */
+static void drop_block(trace_t *trace, int index)
+{
+    int i, j, home;
+
+    if (trace->live == NULL || index < 0)
+        return;
+    for (i = live_hash(trace, index); trace->live[i].id != index;
+         i = (i + 1) & trace->live_mask) {
+        if (trace->live[i].id == -1)
+            return;
+    }
+    trace->blocks[trace->live[i].slot] = NULL;
+    trace->block_sizes[trace->live[i].slot] = 0;
+    trace->free_slots[trace->num_free_slots++] = trace->live[i].slot;
+    trace->num_live--;
+
+    /*
+     * Close the gap: move back every later entry of the probe run that
+     * cannot be found from its home entry anymore.
+     */
+    for (j = (i + 1) & trace->live_mask; trace->live[j].id != -1;
+         j = (j + 1) & trace->live_mask) {
+        home = live_hash(trace, trace->live[j].id);
+        if (((j - home) & trace->live_mask) >= ((j - i) & trace->live_mask)) {
+            trace->live[i] = trace->live[j];
+            i = j;
+        }
+    }
+    trace->live[i].id = -1;
+}
+
 /**********************************************************************
  * The following functions evaluate the correctness, space utilization,
  * and throughput of the libc and mm malloc packages.
@@ -1037,9 +1633,10 @@ static void free_trace(trace_t *trace)
  */
 static bool eval_mm_valid(trace_t *trace, range_set_t *ranges)
 {
-    int i;
+    int i, slot;
     int index;
     size_t size;
+    const traceop_t *op;
     char *newp;
     char *oldp;
     char *p;
@@ -1047,6 +1644,7 @@ static bool eval_mm_valid(trace_t *trace, range_set_t *ranges)
 
     /* Reset the heap and free any records in the range list */
     mem_reset_brk();
+    clear_ranges(ranges);
     reinit_trace(trace);
 
     /* Call the mm package's init function */
@@ -1056,9 +1654,9 @@ static bool eval_mm_valid(trace_t *trace, range_set_t *ranges)
     }
 
     /* Interpret each operation in the trace in order */
-    for (i = 0;  i < trace->num_ops;  i++) {
-        index = trace->ops[i].index;
-        size = trace->ops[i].size;
+    for (i = 0;  (op = trace_op(trace, i)) != NULL;  i++) {
+        index = op->index;
+        size = op->size;
 
         if (debug_mode == DBG_EXPENSIVE) {
             range_t *r;
@@ -1080,7 +1678,7 @@ static bool eval_mm_valid(trace_t *trace, range_set_t *ranges)
             }
         }
 
-        switch (trace->ops[i].type) {
+        switch (op->type) {
 
         case ALLOC: /* mm_malloc */
 
@@ -1099,8 +1697,9 @@ static bool eval_mm_valid(trace_t *trace, range_set_t *ranges)
                 return false;
 
             /* Remember region */
-            trace->blocks[index] = p;
-            trace->block_sizes[index] = size;
+            slot = block_slot(trace, index);
+            trace->blocks[slot] = p;
+            trace->block_sizes[slot] = size;
 
             /* Set to random data, for debugging. */
             randomize_block(trace, index);
@@ -1113,7 +1712,8 @@ static bool eval_mm_valid(trace_t *trace, range_set_t *ranges)
             }
 
             /* Call the student's realloc */
-            oldp = trace->blocks[index];
+            slot = block_slot(trace, index);
+            oldp = trace->blocks[slot];
             setUBCheck(false);
             newp = mm_realloc(oldp, size);
             setUBCheck(true);
@@ -1139,9 +1739,9 @@ static bool eval_mm_valid(trace_t *trace, range_set_t *ranges)
 
             /* Move the region from where it was.
              * Check up to min(size, oldsize) for correct copying. */
-            trace->blocks[index] = newp;
-            if (size < trace->block_sizes[index]) {
-                trace->block_sizes[index] = size;
+            trace->blocks[slot] = newp;
+            if (size < trace->block_sizes[slot]) {
+                trace->block_sizes[slot] = size;
             }
             // NOTE: Might help to pass old size here to check bytes at each end of allocation
 
@@ -1149,7 +1749,7 @@ static bool eval_mm_valid(trace_t *trace, range_set_t *ranges)
             {
                 allCheck = false;
             }
-            trace->block_sizes[index] = size;
+            trace->block_sizes[slot] = size;
 
             /* Set to random data, for debugging. */
             randomize_block(trace, index);
@@ -1165,10 +1765,11 @@ static bool eval_mm_valid(trace_t *trace, range_set_t *ranges)
             if (index == -1) {
                 p = 0;
             } else {
-                p = trace->blocks[index];
+                p = trace->blocks[block_slot(trace, index)];
                 remove_range(ranges, p);
             }
             mm_free(p);
+            drop_block(trace, index);
             break;
 
         default:
@@ -1183,37 +1784,64 @@ static bool eval_mm_valid(trace_t *trace, range_set_t *ranges)
  * eval_mm_util - Evaluate the space utilization of the student's package
  *   The idea is to remember the high water mark "hwm" of the heap for
  *   an optimal allocator, i.e., no gaps and no internal fragmentation.
- *   Utilization is the ratio hwm/heapsize, where heapsize is the
- *   size of the heap in bytes after running the student's malloc
- *   package on the trace. Note that our implementation of mem_sbrk()
- *   doesn't allow the students to decrement the brk pointer, so brk
- *   is always the high water mark of the heap.
+ *   Utilization is the ratio hwm/heapsize, where heapsize is the peak
+ *   size of the heap in bytes while running the student's malloc
+ *   package on the trace. The heap may shrink, so the final break is
+ *   not necessarily its high water mark.
  *
  *   A higher number is better: 1 is optimal.
+ *
+ *   The number of bytes copied by the reallocs which moved their block,
+ *   and the number of mem_sbrk calls are recorded as well.
+ *
+ *   So is the resident memory over time: the heap bytes backed by
+ *   memory, sampled RSS_SAMPLES times along the trace, and at its end.
+ *   In dense mode, the driver touches every page of the payloads like
+ *   an application would, so the pages released by the package drop
+ *   out of the count.
+ *
+ *   With -P, the shape of the heap is written every profile_period
+ *   requests, see profile_sample.
  */
-static double eval_mm_util(trace_t *trace, int tracenum)
+static void eval_mm_util(trace_t *trace, int tracenum, stats_t *stats)
 {
-    int i;
+    int i, slot;
     int index;
     size_t size, newsize, oldsize;
     size_t max_total_size = 0;
     size_t total_size = 0;
+    size_t copied = 0;
+    double rss_sum = 0;
+    int rss_samples = 0;
+    int rss_period = trace->num_ops / RSS_SAMPLES + 1;
     char *p;
     char *newp, *oldp;
+    const traceop_t *op;
+    FILE *profile = NULL;
 
     reinit_trace(trace);
 
     /* initialize the heap and the mm malloc package */
     mem_reset_brk();
+    mem_reset_resident();
     if (!mm_init())
         app_error("trace %d: mm_init failed in eval_mm_util", tracenum);
+    if (profile_period > 0)
+        profile = profile_open(trace);
 
-    for (i = 0;  i < trace->num_ops;  i++) {
-        switch (trace->ops[i].type) {
+    for (i = 0;  (op = trace_op(trace, i)) != NULL;  i++) {
+        if (i % rss_period == 0) {
+            rss_sum += mem_resident();
+            rss_samples++;
+        }
+        if (profile != NULL && i % profile_period == 0)
+            profile_sample(profile, i, total_size);
+
+        switch (op->type) {
 
         case ALLOC: /* mm_alloc */
-            index = trace->ops[i].index;
-            size = trace->ops[i].size;
+            index = op->index;
+            size = op->size;
 
             if ((p = mm_malloc(size)) == NULL) {
                 app_error("trace %d: mm_malloc failed in eval_mm_util",
@@ -1221,43 +1849,53 @@ static double eval_mm_util(trace_t *trace, int tracenum)
             }
 
             /* Remember region and size */
-            trace->blocks[index] = p;
-            trace->block_sizes[index] = size;
+            slot = block_slot(trace, index);
+            trace->blocks[slot] = p;
+            trace->block_sizes[slot] = size;
+            touch_block(p, size);
 
             total_size += size;
             break;
 
         case REALLOC: /* mm_realloc */
-            index = trace->ops[i].index;
-            newsize = trace->ops[i].size;
-            oldsize = trace->block_sizes[index];
+            index = op->index;
+            newsize = op->size;
+            slot = block_slot(trace, index);
+            oldsize = trace->block_sizes[slot];
 
-            oldp = trace->blocks[index];
+            oldp = trace->blocks[slot];
             setUBCheck(false);
             if ((newp = mm_realloc(oldp,newsize)) == NULL && newsize != 0) {
                 app_error("trace %d: mm_realloc failed in eval_mm_util",
                           tracenum);
             }
             setUBCheck(true);
+            touch_block(newp, newsize);
+
+            /* The payload had to be copied if the block moved */
+            if (newp != NULL && oldp != NULL && newp != oldp)
+                copied += (newsize < oldsize) ? newsize : oldsize;
 
             /* Remember region and size */
-            trace->blocks[index] = newp;
-            trace->block_sizes[index] = newsize;
+            trace->blocks[slot] = newp;
+            trace->block_sizes[slot] = newsize;
 
             total_size += (newsize - oldsize);
             break;
 
         case FREE: /* mm_free */
-            index = trace->ops[i].index;
+            index = op->index;
             if (index < 0) {
                 size = 0;
                 p = 0;
             } else {
-                size = trace->block_sizes[index];
-                p = trace->blocks[index];
+                slot = block_slot(trace, index);
+                size = trace->block_sizes[slot];
+                p = trace->blocks[slot];
             }
 
             mm_free(p);
+            drop_block(trace, index);
 
             total_size -= size;
             break;
@@ -1272,11 +1910,101 @@ static double eval_mm_util(trace_t *trace, int tracenum)
             total_size : max_total_size;
     }
 
+    if (profile != NULL) {
+        profile_sample(profile, i, total_size);
+        if (fclose(profile) != 0)
+            unix_error("Could not write the heap profile");
+    }
+
 #if !REF_ONLY
     printf(".");
 #endif
 
-    return ((double)max_total_size / (double)mem_heapsize());
+    stats->util = (double)max_total_size / (double)mem_heap_peak();
+    stats->copied = copied;
+    stats->sbrks = mem_sbrk_calls();
+    stats->rss_avg = rss_samples > 0 ? rss_sum / rss_samples : 0;
+    stats->rss_end = mem_resident();
+}
+
+/*
+ * profile_open - Create the heap profile of a trace, <trace>.shape.csv
+ *     in the current directory, and write its header line
+ */
+static FILE *profile_open(const trace_t *trace)
+{
+    char path[MAXLINE + 16];
+    const char *name = strrchr(trace->filename, '/');
+    const char *dot;
+    FILE *profile;
+    int k;
+
+    name = name != NULL ? name + 1 : trace->filename;
+    dot = strrchr(name, '.');
+    snprintf(path, sizeof(path), "%.*s.shape.csv",
+             dot != NULL ? (int)(dot - name) : (int)strlen(name), name);
+    if ((profile = fopen(path, "w")) == NULL)
+        unix_error("Could not create the heap profile");
+    if (verbose > 1)
+        printf("Writing the shape of the heap to %s, ", path);
+
+    fprintf(profile, "op,live_bytes,heap_bytes,alloc_blocks,alloc_bytes,"
+            "header_bytes,header_overhead,slot_free_bytes,fast_blocks,"
+            "fast_bytes,free_blocks,free_bytes,largest_free,external_frag");
+    for (k = 0; k < MM_CLASSES; k++)
+        fprintf(profile, ",class%d_blocks", k);
+    for (k = 0; k < MM_CLASSES; k++)
+        fprintf(profile, ",class%d_bytes", k);
+    fprintf(profile, "\n");
+    return profile;
+}
+
+/*
+ * profile_sample - Write the shape of the heap after <opnum> requests,
+ *     when <live_bytes> are allocated, as one line of the profile.
+ *
+ *     header_overhead is the fraction of the allocated bytes taken by
+ *     headers, and external_frag is 1 - largest_free / free_bytes: 0
+ *     when the free bytes form one block, close to 1 when they are
+ *     scattered over many small ones.
+ */
+static void profile_sample(FILE *profile, int opnum, size_t live_bytes)
+{
+    mm_shape_t shape;
+    int k;
+
+    if (!mm_heap_shape(&shape))
+        return;
+    fprintf(profile, "%d,%lu,%lu,%lu,%lu,%lu,%.4f,%lu,%lu,%lu,%lu,%lu,%lu,%.4f",
+            opnum, (unsigned long)live_bytes, shape.heap_bytes,
+            shape.alloc_blocks, shape.alloc_bytes, shape.header_bytes,
+            shape.alloc_bytes > 0
+                ? (double)shape.header_bytes / shape.alloc_bytes : 0.0,
+            shape.slot_free_bytes, shape.fast_blocks, shape.fast_bytes,
+            shape.free_blocks, shape.free_bytes, shape.largest_free,
+            shape.free_bytes > 0
+                ? 1.0 - (double)shape.largest_free / shape.free_bytes : 0.0);
+    for (k = 0; k < MM_CLASSES; k++)
+        fprintf(profile, ",%lu", shape.class_blocks[k]);
+    for (k = 0; k < MM_CLASSES; k++)
+        fprintf(profile, ",%lu", shape.class_bytes[k]);
+    fprintf(profile, "\n");
+}
+
+/*
+ * touch_block - Write one byte of every page of a payload, so that the
+ *     pages are resident.  Skipped in sparse mode, where every payload
+ *     write costs emulated memory.
+ */
+static void touch_block(char *p, size_t size)
+{
+    size_t page = mem_pagesize();
+    size_t offset;
+
+    if (sparse_mode || p == NULL)
+        return;
+    for (offset = 0; offset < size; offset += page)
+        p[offset] = 0;
 }
 
 
@@ -1286,9 +2014,10 @@ static double eval_mm_util(trace_t *trace, int tracenum)
  */
 static void eval_mm_speed(void *ptr)
 {
-    int i, index;
+    int i, index, slot;
     size_t size, newsize;
     char *p, *newp, *oldp, *block;
+    const traceop_t *op;
     trace_t *trace = ((speed_t *)ptr)->trace;
     reinit_trace(trace);
 
@@ -1298,36 +2027,38 @@ static void eval_mm_speed(void *ptr)
         app_error("mm_init failed in eval_mm_speed");
 
     /* Interpret each trace request */
-    for (i = 0;  i < trace->num_ops;  i++)
-        switch (trace->ops[i].type) {
+    for (i = 0;  (op = trace_op(trace, i)) != NULL;  i++)
+        switch (op->type) {
 
         case ALLOC: /* mm_malloc */
-            index = trace->ops[i].index;
-            size = trace->ops[i].size;
+            index = op->index;
+            size = op->size;
             if ((p = mm_malloc(size)) == NULL)
                 app_error("mm_malloc error in eval_mm_speed");
-            trace->blocks[index] = p;
+            trace->blocks[block_slot(trace, index)] = p;
             break;
 
         case REALLOC: /* mm_realloc */
-            index = trace->ops[i].index;
-            newsize = trace->ops[i].size;
-            oldp = trace->blocks[index];
+            index = op->index;
+            newsize = op->size;
+            slot = block_slot(trace, index);
+            oldp = trace->blocks[slot];
             setUBCheck(false);
             if ((newp = mm_realloc(oldp,newsize)) == NULL && newsize != 0)
                 app_error("mm_realloc error in eval_mm_speed");
             setUBCheck(true);
-            trace->blocks[index] = newp;
+            trace->blocks[slot] = newp;
             break;
 
         case FREE: /* mm_free */
-            index = trace->ops[i].index;
+            index = op->index;
             if (index < 0) {
                 block = 0;
             } else {
-                block = trace->blocks[index];
+                block = trace->blocks[block_slot(trace, index)];
             }
             mm_free(block);
+            drop_block(trace, index);
             break;
 
         default:
@@ -1335,6 +2066,306 @@ static void eval_mm_speed(void *ptr)
         }
 }
 
+/*
+ * record_latency - Count the latency of request opnum, of the given type,
+ *    and keep it if it is among the slowest of its type
+ */
+static void record_latency(latency_t *latency, int type, int opnum,
+                           uint64_t start, uint64_t end)
+{
+    uint64_t cycles = end - start;
+    int *ops = latency->worst_ops[type];
+    uint64_t *worst = latency->worst_cycles[type];
+    int i;
+
+    cycles = cycles > timer_overhead ? cycles - timer_overhead : 0;
+    hist_add(&latency->hists[type], cycles);
+    if (cycles <= worst[LATENCY_WORST - 1])
+        return;
+    for (i = LATENCY_WORST - 1; i > 0 && cycles > worst[i - 1]; i--) {
+        worst[i] = worst[i - 1];
+        ops[i] = ops[i - 1];
+    }
+    worst[i] = cycles;
+    ops[i] = opnum;
+}
+
+/*
+ * bench_trace - Time bench_samples replays of the trace, in place of fsec,
+ *    and return the median secs of a replay.  The first few replays are
+ *    not timed, and tell how many replays each sample must add up so as
+ *    to be well above the resolution of the timer.
+ */
+static double bench_trace(speed_t *speed_params, stats_t *stats)
+{
+    double secs = 0, sorted[BENCH_MAX_SAMPLES];
+    int reps = 1, r, k;
+
+    for (k = 0; k < BENCH_WARMUP; k++) {
+        start_timer();
+        eval_mm_speed(speed_params);
+        secs = get_timer();
+    }
+    if (secs < BENCH_MIN_SECS)
+        reps = secs > 0 ? (int)ceil(BENCH_MIN_SECS / secs) : 1000;
+
+    for (k = 0; k < bench_samples; k++) {
+        start_timer();
+        for (r = 0; r < reps; r++)
+            eval_mm_speed(speed_params);
+        stats->samples[k] = get_timer() / reps;
+    }
+    stats->num_samples = bench_samples;
+    memcpy(sorted, stats->samples, bench_samples * sizeof(double));
+    return bench_median(sorted, bench_samples);
+}
+
+/*
+ * count_events - Count the hardware events of one more replay of the
+ *    trace, as timed by eval_mm_speed.  The counters are opened by each
+ *    process on its first trace, as those of the driver would not count
+ *    the workers of -j; if none can be, it says so once and leaves
+ *    stats->has_events unset.
+ */
+static void count_events(speed_t *speed_params, stats_t *stats)
+{
+    static perfctr_t counters;
+    static int opened = 0;      /* 1 if some can be counted, -1 if none */
+
+    if (opened == 0) {
+        opened = perfctr_open(&counters) ? 1 : -1;
+        if (opened < 0)
+            fprintf(stderr, "Hardware events cannot be counted here, see "
+                    "/proc/sys/kernel/perf_event_paranoid\n");
+    }
+    if (opened < 0)
+        return;
+    perfctr_start(&counters);
+    eval_mm_speed(speed_params);
+    perfctr_stop(&counters, stats->events);
+    stats->has_events = true;
+}
+
+/*
+ * eval_mm_latency - Replay the trace as eval_mm_speed does, reading the
+ *    cycle counter around each call to the mm malloc package
+ */
+static void eval_mm_latency(trace_t *trace, latency_t *latency)
+{
+    int i, t, index, slot;
+    size_t size, newsize;
+    char *p, *newp, *oldp, *block;
+    const traceop_t *op;
+    uint64_t start, end;
+
+    for (t = 0; t < 3; t++) {
+        hist_reset(&latency->hists[t]);
+        for (i = 0; i < LATENCY_WORST; i++) {
+            latency->worst_ops[t][i] = -1;
+            latency->worst_cycles[t][i] = 0;
+        }
+    }
+    reinit_trace(trace);
+
+    /* Reset the heap and initialize the mm package */
+    mem_reset_brk();
+    if (!mm_init())
+        app_error("mm_init failed in eval_mm_latency");
+
+    /* Interpret each trace request */
+    for (i = 0;  (op = trace_op(trace, i)) != NULL;  i++)
+        switch (op->type) {
+
+        case ALLOC: /* mm_malloc */
+            index = op->index;
+            size = op->size;
+            start = cycle_count();
+            p = mm_malloc(size);
+            end = cycle_count();
+            if (p == NULL)
+                app_error("mm_malloc error in eval_mm_latency");
+            record_latency(latency, ALLOC, i, start, end);
+            trace->blocks[block_slot(trace, index)] = p;
+            break;
+
+        case REALLOC: /* mm_realloc */
+            index = op->index;
+            newsize = op->size;
+            slot = block_slot(trace, index);
+            oldp = trace->blocks[slot];
+            setUBCheck(false);
+            start = cycle_count();
+            newp = mm_realloc(oldp, newsize);
+            end = cycle_count();
+            if (newp == NULL && newsize != 0)
+                app_error("mm_realloc error in eval_mm_latency");
+            setUBCheck(true);
+            record_latency(latency, REALLOC, i, start, end);
+            trace->blocks[slot] = newp;
+            break;
+
+        case FREE: /* mm_free */
+            index = op->index;
+            if (index < 0) {
+                block = 0;
+            } else {
+                block = trace->blocks[block_slot(trace, index)];
+            }
+            start = cycle_count();
+            mm_free(block);
+            end = cycle_count();
+            record_latency(latency, FREE, i, start, end);
+            drop_block(trace, index);
+            break;
+
+        default:
+            app_error("Nonexistent request type in eval_mm_latency");
+        }
+}
+
+#ifdef THREAD_SAFE
+/*
+ * run_thread_tests - Replay every trace on 1, 2, 4, ... up to max_threads
+ *    threads, and print the aggregate throughput and its scaling over
+ *    one thread. Each thread replays its own copy of the trace.
+ */
+static void run_thread_tests(int num_tracefiles, const char *tracedir,
+                             char **tracefiles)
+{
+    int i, n;
+    stats_t stats;
+    double secs, tput, base_tput;
+
+    if (sparse_mode)
+        app_error("the multithreaded replay is not supported in sparse mode");
+
+    printf("Results for multithreaded replay:\n");
+    printf("  %7s %10s %8s  %s\n", "threads", "Kops/s", "scaling", "trace");
+    for (i = 0; i < num_tracefiles; i++) {
+        trace_t *trace = read_trace(&stats, tracedir, tracefiles[i]);
+        base_tput = 0.0;
+        for (n = 1; n <= max_threads; n = (n == max_threads) ? n + 1 :
+                 (2 * n > max_threads ? max_threads : 2 * n)) {
+            mem_init(sparse_mode);
+            secs = eval_mm_threads(trace, n);
+            mem_deinit();
+            if (secs < 0) {
+                printf("  %7d %10s %8s  %s\n", n, "-", "-", trace->filename);
+                continue;
+            }
+            tput = n * trace->num_ops / (secs * 1000.0);
+            if (n == 1)
+                base_tput = tput;
+            printf("  %7d %10.0f %7.2fx  %s\n", n, tput,
+                   base_tput > 0 ? tput / base_tput : 0.0, trace->filename);
+        }
+        free_trace(trace);
+    }
+    printf("\n");
+}
+
+/*
+ * eval_mm_threads - Replay the trace on <nthreads> threads sharing one
+ *    mm heap. Returns the wall-clock seconds of the best of three runs,
+ *    or a negative value if the heap ran out of memory.
+ */
+static double eval_mm_threads(trace_t *trace, int nthreads)
+{
+    int i, run;
+    double secs, best = -1.0;
+    struct timespec begin, end;
+    pthread_barrier_t start;
+    pthread_t *tids = malloc(nthreads * sizeof(pthread_t));
+    thread_arg_t *args = malloc(nthreads * sizeof(thread_arg_t));
+    bool failed = false;
+
+    if (tids == NULL || args == NULL)
+        unix_error("malloc failed in eval_mm_threads");
+
+    for (run = 0; run < 3 && !failed; run++) {
+        mem_reset_brk();
+        if (!mm_init())
+            app_error("mm_init failed in eval_mm_threads");
+        pthread_barrier_init(&start, NULL, nthreads + 1);
+        for (i = 0; i < nthreads; i++) {
+            args[i].trace = trace;
+            args[i].blocks = calloc(trace->num_ids, sizeof(char *));
+            args[i].start = &start;
+            args[i].failed = false;
+            if (args[i].blocks == NULL)
+                unix_error("calloc failed in eval_mm_threads");
+            if (pthread_create(&tids[i], NULL, replay_thread, &args[i]) != 0)
+                unix_error("pthread_create failed in eval_mm_threads");
+        }
+
+        /* The workers are all parked on the barrier until we arrive, so
+         * start the clock first: none of them can have begun yet */
+        clock_gettime(CLOCK_MONOTONIC, &begin);
+        pthread_barrier_wait(&start);
+        for (i = 0; i < nthreads; i++)
+            pthread_join(tids[i], NULL);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        pthread_barrier_destroy(&start);
+
+        for (i = 0; i < nthreads; i++) {
+            failed |= args[i].failed;
+            free(args[i].blocks);
+        }
+        secs = (end.tv_sec - begin.tv_sec) + (end.tv_nsec - begin.tv_nsec) / 1e9;
+        if (best < 0 || secs < best)
+            best = secs;
+    }
+
+    free(tids);
+    free(args);
+    return failed ? -1.0 : best;
+}
+
+/*
+ * replay_thread - The body of one thread of eval_mm_threads
+ */
+static void *replay_thread(void *ptr)
+{
+    thread_arg_t *arg = ptr;
+    trace_t *trace = arg->trace;
+    char **blocks = arg->blocks;
+    int i, index;
+    char *p;
+
+    pthread_barrier_wait(arg->start);
+    for (i = 0; i < trace->num_ops; i++) {
+        index = trace->ops[i].index;
+        switch (trace->ops[i].type) {
+
+        case ALLOC: /* mm_malloc */
+            if ((p = mm_malloc(trace->ops[i].size)) == NULL) {
+                arg->failed = true;
+                return NULL;
+            }
+            blocks[index] = p;
+            break;
+
+        case REALLOC: /* mm_realloc */
+            p = mm_realloc(blocks[index], trace->ops[i].size);
+            if (p == NULL && trace->ops[i].size != 0) {
+                arg->failed = true;
+                return NULL;
+            }
+            blocks[index] = p;
+            break;
+
+        case FREE: /* mm_free */
+            mm_free(index < 0 ? NULL : blocks[index]);
+            break;
+
+        default:
+            app_error("Nonexistent request type in replay_thread");
+        }
+    }
+    return NULL;
+}
+#endif /* def THREAD_SAFE */
+
 /*
  * eval_libc_valid - We run this function to make sure that the
  *    libc malloc can run to completion on the set of traces.
@@ -1439,6 +2470,381 @@ static void eval_libc_speed(void *ptr)
  ************************************/
 
 
+/*
+ * measure_timer_overhead - Return the least number of cycles between two
+ *    consecutive reads of the cycle counter
+ */
+static uint64_t measure_timer_overhead(void)
+{
+    uint64_t start, end, least = UINT64_MAX;
+    int i;
+
+    for (i = 0; i < 1000; i++) {
+        start = cycle_count();
+        end = cycle_count();
+        if (end - start < least)
+            least = end - start;
+    }
+    return least;
+}
+
+/*
+ * printlatency - prints the percentiles of the latency of each type of
+ *                request, and the slowest requests of each trace (-L)
+ */
+static void printlatency(int n, stats_t *stats)
+{
+    static const char *type_names[3] = { "malloc", "free", "realloc" };
+    int i, t, w;
+
+    if (tab_mode) {
+        printf("type\tcount\tp50\tp99\tp99.9\tmax\tslowest\ttrace\n");
+    } else {
+        printf("Latency of mm malloc requests, in %s less %lu for the timer:\n",
+               CYCLE_UNIT, (unsigned long)timer_overhead);
+        printf("  %7s %9s %8s %8s %8s %10s  %s\n",
+               "request", "count", "p50", "p99", "p99.9", "max", "slowest lines");
+    }
+    for (i = 0; i < n; i++) {
+        latency_t *latency = stats[i].latency;
+
+        if (!stats[i].valid || latency == NULL)
+            continue;
+        if (!tab_mode)
+            printf("%s\n", stats[i].filename);
+        for (t = 0; t < 3; t++) {
+            const hist_t *hist = &latency->hists[t];
+
+            if (hist->total == 0)
+                continue;
+            printf(tab_mode ? "%s\t%lu\t%lu\t%lu\t%lu\t%lu\t"
+                            : "  %7s %9lu %8lu %8lu %8lu %10lu",
+                   type_names[t],
+                   (unsigned long)hist->total,
+                   (unsigned long)hist_percentile(hist, 0.50),
+                   (unsigned long)hist_percentile(hist, 0.99),
+                   (unsigned long)hist_percentile(hist, 0.999),
+                   (unsigned long)hist->max);
+            /* Trace lines of the slowest requests, as in error messages */
+            for (w = 0; w < LATENCY_WORST && latency->worst_ops[t][w] >= 0; w++)
+                printf("%s%d", !tab_mode ? " " : w > 0 ? "," : "",
+                       LINENUM(latency->worst_ops[t][w]));
+            if (tab_mode)
+                printf("\t%s", stats[i].filename);
+            printf("\n");
+        }
+    }
+}
+
+/*
+ * read_counters - Keep the counters of the mm malloc package, if it has
+ *    them, for the trace of stats
+ */
+static void read_counters(stats_t *stats)
+{
+    stats->has_counters = mm_stats(&stats->counters);
+}
+
+/*
+ * printcounters - prints the counters of the mm malloc package for each
+ *                 trace, next to its throughput, if it has them.  Only the
+ *                 counters which are not zero are listed, except in tab mode.
+ */
+static void printcounters(int n, stats_t *stats)
+{
+    static const char *names[MM_STAT_COUNT] = {
+        [MM_STAT_MALLOC] = "malloc",
+        [MM_STAT_FREE] = "free",
+        [MM_STAT_REALLOC] = "realloc",
+        [MM_STAT_FAST_HIT] = "fast-hit",
+        [MM_STAT_FAST_FLUSH] = "fast-flush",
+        [MM_STAT_SLAB_MALLOC] = "slab-malloc",
+        [MM_STAT_RUN_CREATE] = "run-create",
+        [MM_STAT_FIT_SEARCH] = "fit-search",
+        [MM_STAT_FIT_MISS] = "fit-miss",
+        [MM_STAT_FIT_CLASS] = "fit-class",
+        [MM_STAT_FIT_BLOCK] = "fit-block",
+        [MM_STAT_FIT_NODE] = "fit-node",
+        [MM_STAT_SPLIT] = "split",
+        [MM_STAT_COALESCE_NONE] = "coalesce-none",
+        [MM_STAT_COALESCE_NEXT] = "coalesce-next",
+        [MM_STAT_COALESCE_PREV] = "coalesce-prev",
+        [MM_STAT_COALESCE_BOTH] = "coalesce-both",
+        [MM_STAT_EXTEND] = "extend",
+        [MM_STAT_EXTEND_BYTES] = "extend-bytes",
+        [MM_STAT_TRIM] = "trim",
+        [MM_STAT_RELEASE] = "release",
+        [MM_STAT_HUGE_MAP] = "huge-map",
+        [MM_STAT_HUGE_REMAP] = "huge-remap",
+        [MM_STAT_REALLOC_NEXT] = "realloc-next",
+        [MM_STAT_REALLOC_EXTEND] = "realloc-extend",
+        [MM_STAT_REALLOC_PREV] = "realloc-prev",
+        [MM_STAT_REALLOC_MOVE] = "realloc-move",
+        [MM_STAT_CACHE_REFILL] = "cache-refill",
+        [MM_STAT_CACHE_FLUSH] = "cache-flush",
+        [MM_STAT_REMOTE_FREE] = "remote-free",
+    };
+    int i, k, col;
+    char field[64];
+
+    for (i = 0; i < n && !stats[i].has_counters; i++)
+        ;
+    if (i == n)
+        return;
+
+    if (tab_mode) {
+        printf("Kops/s");
+        for (k = 0; k < MM_STAT_COUNT; k++)
+            printf("\t%s", names[k]);
+        printf("\ttrace\n");
+    } else {
+        printf("Counters of mm malloc, for one replay of each trace:\n");
+    }
+    for (i = 0; i < n; i++) {
+        if (!stats[i].valid || !stats[i].has_counters)
+            continue;
+        if (tab_mode) {
+            printf("%.0f", sparse_mode ? 0.0 : stats[i].tput);
+            for (k = 0; k < MM_STAT_COUNT; k++)
+                printf("\t%lu", stats[i].counters.counts[k]);
+            printf("\t%s\n", stats[i].filename);
+            continue;
+        }
+        printf("%s, %.0f Kops/s\n", stats[i].filename,
+               sparse_mode ? 0.0 : stats[i].tput);
+        col = 0;
+        for (k = 0; k < MM_STAT_COUNT; k++) {
+            if (stats[i].counters.counts[k] == 0)
+                continue;
+            snprintf(field, sizeof(field), "  %s %lu", names[k],
+                     stats[i].counters.counts[k]);
+            if (col > 0 && col + strlen(field) > 78) {
+                printf("\n");
+                col = 0;
+            }
+            col += printf("%s", field);
+        }
+        if (col > 0)
+            printf("\n");
+    }
+    printf("\n");
+}
+
+/*
+ * printevents - prints the hardware events counted with -H for each trace,
+ *               per request, with the instructions per cycle, in both
+ *               modes.  Events that could not be counted are shown as "-".
+ */
+static void printevents(int n, stats_t *stats)
+{
+    int i, k;
+
+    for (i = 0; i < n && !stats[i].has_events; i++)
+        ;
+    if (i == n)
+        return;
+
+    if (tab_mode) {
+        printf("ops\tipc");
+        for (k = 0; k < PERFCTR_EVENTS; k++)
+            printf("\t%s", perfctr_names[k]);
+        printf("\ttrace\n");
+    } else {
+        printf("Hardware events per request, over one replay of each trace:\n");
+        printf("  %5s", "IPC");
+        for (k = 0; k < PERFCTR_EVENTS; k++)
+            printf(" %9s", perfctr_names[k]);
+        printf("  trace\n");
+    }
+    for (i = 0; i < n; i++) {
+        const double *events = stats[i].events;
+
+        if (!stats[i].valid || !stats[i].has_events)
+            continue;
+        if (tab_mode)
+            printf("%.0f\t", stats[i].ops);
+        if (events[PERFCTR_CYCLES] > 0 && events[PERFCTR_INSTRUCTIONS] >= 0)
+            printf(tab_mode ? "%.4f" : "  %5.2f",
+                   events[PERFCTR_INSTRUCTIONS] / events[PERFCTR_CYCLES]);
+        else
+            printf(tab_mode ? "%s" : "  %5s", "-");
+        for (k = 0; k < PERFCTR_EVENTS; k++) {
+            if (events[k] < 0)
+                printf(tab_mode ? "\t%s" : " %9s", "-");
+            else
+                printf(tab_mode ? "\t%.6g" : " %9.3f",
+                       events[k] / stats[i].ops);
+        }
+        printf(tab_mode ? "\t%s\n" : "  %s\n", stats[i].filename);
+    }
+    printf("\n");
+}
+
+/*
+ * trace_basename - The name of a trace without its directory, by which
+ *    the timings of runs from different directories are matched
+ */
+static const char *trace_basename(const char *filename)
+{
+    const char *slash = strrchr(filename, '/');
+
+    return slash != NULL ? slash + 1 : filename;
+}
+
+/*
+ * printbench - prints the median secs of a replay of each trace timed
+ *              with -B, their median absolute deviation and the
+ *              confidence interval of the median
+ */
+static void printbench(int n, stats_t *stats)
+{
+    double sorted[BENCH_MAX_SAMPLES];
+    double median, mad, lo, hi;
+    int i;
+
+    if (tab_mode) {
+        printf("samples\tmedian\tmad\tci_lo\tci_hi\ttrace\n");
+    } else {
+        printf("Timing of %d replays of each trace, in msecs, with the %.0f%% "
+               "confidence interval of the median:\n",
+               bench_samples, BENCH_LEVEL * 100);
+        printf("  %10s %9s %6s %21s  %s\n",
+               "median", "MAD", "MAD%", "interval", "trace");
+    }
+    for (i = 0; i < n; i++) {
+        if (!stats[i].valid || stats[i].num_samples == 0)
+            continue;
+        memcpy(sorted, stats[i].samples, stats[i].num_samples * sizeof(double));
+        median = bench_median(sorted, stats[i].num_samples);
+        mad = bench_mad(sorted, stats[i].num_samples, median);
+        bench_median_ci(sorted, stats[i].num_samples, BENCH_LEVEL, &lo, &hi);
+        if (tab_mode) {
+            printf("%d\t%.9g\t%.9g\t%.9g\t%.9g\t%s\n", stats[i].num_samples,
+                   median, mad, lo, hi, stats[i].filename);
+        } else {
+            printf("  %10.3f %9.3f %5.1f%% %10.3f-%-10.3f  %s\n",
+                   median * 1e3, mad * 1e3, 100 * mad / median,
+                   lo * 1e3, hi * 1e3, stats[i].filename);
+        }
+    }
+}
+
+/*
+ * write_samples - Write the timings of -B to path, one line per trace:
+ *    its name, the number of samples and the secs of each
+ */
+static void write_samples(const char *path, int n, stats_t *stats)
+{
+    FILE *fp;
+    int i, k;
+
+    if ((fp = fopen(path, "w")) == NULL)
+        unix_error("Could not open %s in write_samples", path);
+    for (i = 0; i < n; i++) {
+        if (!stats[i].valid || stats[i].num_samples == 0)
+            continue;
+        fprintf(fp, "%s %d", trace_basename(stats[i].filename),
+                stats[i].num_samples);
+        for (k = 0; k < stats[i].num_samples; k++)
+            fprintf(fp, " %.9g", stats[i].samples[k]);
+        fprintf(fp, "\n");
+    }
+    if (fclose(fp) != 0)
+        unix_error("Could not write %s in write_samples", path);
+}
+
+/*
+ * compare_samples - Compare the timings of -B with those written by -o to
+ *    path, for another build or an earlier run, and return the number of
+ *    traces which got slower.  A trace changed if the Mann-Whitney U test
+ *    rejects that both sets of timings have the same distribution at
+ *    BENCH_ALPHA, and its median moved by BENCH_MIN_CHANGE at least, so
+ *    that the verdict can gate a change even on a noisy machine.
+ */
+static int compare_samples(const char *path, int n, stats_t *stats)
+{
+    static char line[MAXLINE + BENCH_MAX_SAMPLES * 32];
+    double base[BENCH_MAX_SAMPLES], sorted[BENCH_MAX_SAMPLES];
+    char name[MAXLINE];
+    double before, after, change, p;
+    int i, k, nbase, offset, slower = 0, faster = 0;
+    const char *verdict;
+    char *pos, *end;
+    FILE *fp;
+
+    if ((fp = fopen(path, "r")) == NULL)
+        unix_error("Could not open %s in compare_samples", path);
+    if (tab_mode) {
+        printf("before\tafter\tchange\tp\tverdict\ttrace\n");
+    } else {
+        printf("\nChange from %s, with the p-value of the Mann-Whitney U "
+               "test:\n", path);
+        printf("  %10s %10s %8s %8s %8s  %s\n",
+               "before", "after", "change", "p-value", "verdict", "trace");
+    }
+    for (i = 0; i < n; i++) {
+        if (!stats[i].valid || stats[i].num_samples == 0)
+            continue;
+
+        /* Find the line of the trace, the traces need not be in order */
+        rewind(fp);
+        nbase = 0;
+        while (fgets(line, sizeof(line), fp) != NULL) {
+            if (sscanf(line, "%1023s %d%n", name, &nbase, &offset) != 2 ||
+                strcmp(name, trace_basename(stats[i].filename)) != 0) {
+                nbase = 0;
+                continue;
+            }
+            if (nbase > BENCH_MAX_SAMPLES)
+                nbase = BENCH_MAX_SAMPLES;
+            pos = line + offset;
+            for (k = 0; k < nbase; k++, pos = end) {
+                base[k] = strtod(pos, &end);
+                if (end == pos)
+                    break;
+            }
+            nbase = k;
+            break;
+        }
+        if (nbase == 0) {
+            printf("  %s is not in %s\n", stats[i].filename, path);
+            continue;
+        }
+        if (bench_mann_whitney_min(nbase, stats[i].num_samples)
+            >= BENCH_ALPHA) {
+            printf("  %s has too few samples in %s\n", stats[i].filename,
+                   path);
+            continue;
+        }
+
+        p = bench_mann_whitney(base, nbase, stats[i].samples,
+                               stats[i].num_samples);
+        before = bench_median(base, nbase);
+        memcpy(sorted, stats[i].samples, stats[i].num_samples * sizeof(double));
+        after = bench_median(sorted, stats[i].num_samples);
+        change = after / before - 1;
+        if (p >= BENCH_ALPHA || fabs(change) < BENCH_MIN_CHANGE) {
+            verdict = "same";
+        } else if (change > 0) {
+            verdict = "slower";
+            slower++;
+        } else {
+            verdict = "faster";
+            faster++;
+        }
+        if (tab_mode) {
+            printf("%.9g\t%.9g\t%.4f\t%.4g\t%s\t%s\n", before, after,
+                   change, p, verdict, stats[i].filename);
+        } else {
+            printf("  %10.3f %10.3f %+7.1f%% %8.2g %8s  %s\n", before * 1e3,
+                   after * 1e3, change * 100, p, verdict, stats[i].filename);
+        }
+    }
+    fclose(fp);
+    printf("%d traces slower, %d faster than %s\n", slower, faster, path);
+    return slower;
+}
+
 /*
  * printresults - prints a performance summary for some malloc package and returns
  *                a summary of the stats to the caller.
@@ -1460,10 +2866,11 @@ static void printresults(int n, stats_t *stats, sum_stats_t *sumstats)
 
     /* Print the individual results for each trace */
     if (tab_mode) {
-        printf("valid\tthru?\tutil?\tutil\tops\tmsecs\tKops/s\ttrace\n");
+        printf("valid\tthru?\tutil?\tutil\tops\tmsecs\tKops/s\tcopied\tsbrks\trssKB\tendKB\ttrace\n");
     } else {
-        printf("  %5s  %6s %7s%8s%8s  %s\n",
-               "valid", "util", "ops", "msecs", "Kops/s", "trace");
+        printf("  %5s  %6s %7s%8s%8s%11s%7s%8s%8s  %s\n",
+               "valid", "util", "ops", "msecs", "Kops/s", "copied", "sbrks",
+               "rssKB", "endKB", "trace");
     }
     for (i=0; i < n; i++) {
         if (stats[i].valid) {
@@ -1526,6 +2933,22 @@ static void printresults(int n, stats_t *stats, sum_stats_t *sumstats)
                     printf("%8s%10s%7s ", "--", "--", "--");
             }
 
+            /* Bytes copied by realloc + heap extensions */
+            if (tab_mode) {
+                printf("%.0f\t%.0f\t", stats[i].copied, stats[i].sbrks);
+            } else {
+                printf("%11.0f%7.0f ", stats[i].copied, stats[i].sbrks);
+            }
+
+            /* Resident memory, average and at the end, in KB */
+            if (tab_mode) {
+                printf("%.0f\t%.0f\t", stats[i].rss_avg / 1024,
+                       stats[i].rss_end / 1024);
+            } else {
+                printf("%7.0f %7.0f ", stats[i].rss_avg / 1024,
+                       stats[i].rss_end / 1024);
+            }
+
             printf("%s\n", stats[i].filename);
 
             if (stats[i].weight == WALL || stats[i].weight == WPERF)
@@ -1543,15 +2966,17 @@ static void printresults(int n, stats_t *stats, sum_stats_t *sumstats)
         }
         else {
             if (tab_mode) {
-                printf("no\t\t\t\t\t\t\t%s\n", stats[i].filename);
+                printf("no\t\t\t\t\t\t\t\t\t%s\n", stats[i].filename);
             } else {
-                printf("%2s%4s%7s%10s%7s%10s %s\n",
+                printf("%2s%4s%7s%10s%7s%10s%11s%7s %s\n",
                        stats[i].weight != 0 ? "*" : "",
                        "no",
                        "-",
                        "-",
                        "-",
                        "-",
+                       "-",
+                       "-",
                        stats[i].filename);
             }
         }
@@ -1843,5 +3268,14 @@ static void usage(char *prog)
     fprintf(stderr, "\t-v <i>     Set Verbosity Level to <i>\n");
     fprintf(stderr, "\t-s <s>     Timeout after s secs (default no timeout)\n");
     fprintf(stderr, "\t-T         Print diagnostics in tab mode\n");
-    fprintf(stderr, "\t-f <file>  Use <file> as the trace file\n");
+    fprintf(stderr, "\t-f <file>  Use <file> as the trace file (text or binary)\n");
+    fprintf(stderr, "\t-m <n>     Replay the traces on up to <n> threads (mdriver-mt only)\n");
+    fprintf(stderr, "\t-S         Stream the traces in chunks instead of loading them.\n");
+    fprintf(stderr, "\t-L         Time each request and report latency percentiles.\n");
+    fprintf(stderr, "\t-H         Count cache, TLB and branch misses per request (perf_event_open).\n");
+    fprintf(stderr, "\t-B <n>     Time <n> replays of each trace, report their median and spread.\n");
+    fprintf(stderr, "\t-o <file>  Write the timings of -B to <file>.\n");
+    fprintf(stderr, "\t-C <file>  Compare the timings of -B with <file>, exit 2 if slower.\n");
+    fprintf(stderr, "\t-j <n>     Run the traces in <n> worker processes, one per core.\n");
+    fprintf(stderr, "\t-P <n>     Write the shape of the heap every <n> requests to <trace>.shape.csv\n");
 }
@@ -24,14 +24,31 @@
  * Loading from the sparse emulation uses the above lookup and then aggregates
  *  the data into a return value.
  *
+ * The heap can be split into several disjoint regions (mem_region_create),
+ *  each one with its own break.  Additional regions are carved from the
+ *  top of the address space reserved for the heap, so the heap of
+ *  mem_sbrk (region 0) is always the lowest one.
+ *
+ * The heap can also give memory back: a negative increment lowers the
+ *  break, and mem_release drops the pages inside a range which holds no
+ *  data.  Dense mode uses madvise(MADV_DONTNEED), sparse mode moves the
+ *  emulated pages to a list of released pages reused before new ones.
+ *  mem_resident tells how much of the heap is backed by memory, and
+ *  mem_heap_peak the largest heap size reached.
+ *
+ * Built without -DDRIVER (for libmm.so), memlib serves real programs: the
+ *  heap is set up by the first request, and its address space is only
+ *  backed by the pages touched.  The process break is left alone.
+ *
  * If an emulated access is made to an address outside of the current 
- *  bounds (mem_heap_lo, mem_heap_hi), then the address is assumed to be to
+ *  bounds (mem_heap_lo, mem_heap_hi, or those of a region), then the address is assumed to be to
  *  a non-heap location, such as stack, global variables, etc.  For some
  *  implementations, this access is meant to be to the heap and was "safe"
  *  in non-emulation, as it was to the same page as actual heap data.  But
  *  sparse emulation has tighter checks.  Commonly, the CPU reports a
  *  BUS ERROR on these accesses, and should be debugged as segmentation faults.
  */
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
@@ -54,19 +71,45 @@ typedef struct MBLK {
     unsigned char bytes[SPARSE_PAGE_SIZE]; /* Page contents */
 } mem_block_t;
 
+/* A free range of the mapped space */
+typedef struct {
+    unsigned char *lo;                     /* First byte of the range */
+    unsigned char *hi;                     /* Byte past the range */
+} mem_hole_t;
+
 /* private global variables */
 static bool sparse = false;                 /* Use sparse memory emulation */
 static unsigned char *heap;                 /* Starting address of heap */
 static unsigned char *mem_brk;              /* Current position of break */
+static unsigned char *mem_brk_peak;         /* Highest break since the last reset */
 static unsigned char *mem_max_addr;         /* Maximum allowable heap address */
 static size_t mmap_length = MAX_DENSE_HEAP; /* Number of bytes allocated by mmap */
 static bool show_stats = false;             /* Should program print allocation information? */
 static bool stats_printed = false;          /* Has information been printed about allocation */
+static size_t sbrk_calls = 0;               /* Number of successful mem_sbrk calls */
+static size_t heap_bytes = 0;               /* Heap size, with all regions and mapped areas */
+static size_t heap_peak = 0;                /* Largest heap size since the last reset */
+
+/* Additional regions, index 0 is unused (the heap itself) */
+static int num_regions = 1;                 /* Number of regions, including the heap */
+static unsigned char *mem_top;              /* Maximum heap address before any region */
+static unsigned char *region_lo[MEM_MAX_REGIONS];  /* Start of each region */
+static unsigned char *region_brk[MEM_MAX_REGIONS]; /* Break of each region */
+static unsigned char *region_max[MEM_MAX_REGIONS]; /* Maximum address of each region */
+
+/* Mapped areas, carved from a space reserved after the heap */
+static unsigned char *map_lo;               /* Start of the mapped space */
+static unsigned char *map_brk;              /* Top of the mapped areas */
+static unsigned char *map_max;              /* End of the mapped space */
+static size_t map_bytes = 0;                /* Total size of the mapped areas */
+static mem_hole_t map_holes[MEM_MAX_MAP_HOLES]; /* Free ranges below map_brk, by address */
+static int num_holes = 0;                   /* Number of free ranges */
 
 /* Sparse memory representation */
 static mem_block_t *next_free_page = NULL;  /* Next free page */
 static size_t num_pages = 0;                /* Total number of pages */
 static size_t num_free_pages = 0;           /* Number of free pages */
+static mem_block_t *released_pages = NULL;  /* Pages given back by mem_release */
 static mem_block_t **page_table = NULL;     /* Hash table from page ID to page */
 static size_t num_buckets = 0;              /* Number of buckets in page table */
 
@@ -84,6 +127,18 @@ static size_t page_id(const void *addr);
 static void *page_start(size_t id);
 static void *get_mem(const void *addr, size_t, bool);
 static void print_stats();
+static void mem_ready(void);
+static void heap_grown(intptr_t incr);
+static void release_pages(unsigned char *lo, unsigned char *hi);
+static void release_sparse_pages(size_t lo_id, size_t hi_id);
+static mem_block_t *unlink_sparse_pages(size_t lo_id, size_t hi_id);
+static size_t resident_pages(unsigned char *lo, unsigned char *hi);
+static size_t map_round(size_t len);
+static unsigned char *map_take(size_t size);
+static void map_give(unsigned char *lo, unsigned char *hi);
+static int map_hole_at(unsigned char *lo);
+static void map_hole_remove(int i);
+static void move_pages(unsigned char *dst, unsigned char *src, size_t len);
 
 /* 
  * mem_init - initialize the memory system model
@@ -110,6 +165,7 @@ void mem_init(bool do_sparse){
         mmap_length = MAX_DENSE_HEAP;
     }
 
+#ifdef DRIVER
     int dev_zero = open("/dev/zero", O_RDWR);
     void *start = sparse ? NULL : TRY_DENSE_HEAP_START;
     void *addr = mmap(start,        /* suggested start*/
@@ -118,6 +174,12 @@ void mem_init(bool do_sparse){
             MAP_PRIVATE,  /* private or shared? */
             dev_zero,     /* fd */
             0);           /* offset */
+#else
+    /* Real programs only get the pages they touch */
+    void *addr = mmap(TRY_DENSE_HEAP_START, mmap_length,
+                      PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+#endif
     if (addr == MAP_FAILED) {
         fprintf(stderr, "FAILURE.  mmap couldn't allocate space for heap\n");
         exit(1);
@@ -127,21 +189,46 @@ void mem_init(bool do_sparse){
         page_table = (mem_block_t **) addr;
         heap = SPARSE_HEAP_START;
         mem_max_addr = heap + MAX_SPARSE_HEAP;
+        map_lo = mem_max_addr;
+        map_max = map_lo + MAX_SPARSE_MAP;
     } else {
         heap = addr;
         mem_max_addr = heap + MAX_DENSE_HEAP;
+        /* The mapped space is only backed by the pages touched */
+        map_lo = mmap(mem_max_addr, MAX_DENSE_MAP, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (map_lo == MAP_FAILED) {
+            fprintf(stderr, "FAILURE.  mmap couldn't allocate space for mapped areas\n");
+            exit(1);
+        }
+        map_max = map_lo + MAX_DENSE_MAP;
     }
+    mem_top = mem_max_addr;
     stats_printed = false;
     mem_brk = heap;
     mem_reset_brk();
 }
 
+/*
+ * mem_ready - set up the heap on the first request outside the driver,
+ *             where nobody calls mem_init.  The allocator makes its first
+ *             request under its lock.
+ */
+static void mem_ready(void) {
+#ifndef DRIVER
+    if (heap == NULL)
+        mem_init(false);
+#endif
+}
+
 /* 
  * mem_deinit - free the storage used by the memory system model
  */
 void mem_deinit(void){
     print_stats();
     munmap(heap, mmap_length);
+    if (!sparse)
+        munmap(map_lo, MAX_DENSE_MAP);
     next_free_page = NULL;
     num_free_pages = 0;
     page_table = NULL;
@@ -160,33 +247,57 @@ void mem_reset_brk(){
         /* First page is just beyond page table */
         next_free_page = (mem_block_t *) ((unsigned char *) page_table + ptb);
         num_free_pages = num_pages;
+        released_pages = NULL;
     }
     mem_brk = heap;
+    mem_brk_peak = heap;
+    sbrk_calls = 0;
+    heap_bytes = 0;
+    heap_peak = 0;
+    num_regions = 1;
+    mem_max_addr = mem_top;
+    map_brk = map_lo;
+    map_bytes = 0;
+    num_holes = 0;
 }
 
 /* 
  * mem_sbrk - simple model of the sbrk function. Extends the heap 
- *                by incr bytes and returns the start address of the new area. In
- *                this model, the heap cannot be shrunk.
+ *                by incr bytes and returns the start address of the new area.
+ *                A negative incr shrinks the heap, and the pages past the
+ *                new break are released.
  */
 void *mem_sbrk(intptr_t incr) {
+    mem_ready();
     unsigned char *old_brk = mem_brk;
 
     bool ok = true;
-    if (incr < 0) {
+    if (incr < 0 && mem_brk + incr < heap) {
         ok = false;
-        fprintf(stderr, "ERROR: mem_sbrk failed.  Attempt to expand heap by negative value %ld\n", (long) incr);
+        fprintf(stderr, "ERROR: mem_sbrk failed.  Attempt to shrink heap by %ld below its start\n", (long) incr);
     } else if (mem_brk + incr > mem_max_addr) {
         ok = false;
         size_t alloc = mem_brk - heap + incr;
         fprintf(stderr, "ERROR: mem_sbrk failed. Ran out of memory.  Would require heap size of %zd (0x%zx) bytes\n", alloc, alloc);
-    } else if (!sparse && sbrk(incr) == (void*) -1) {
+    }
+#ifdef DRIVER
+    /* The process break is never lowered, libc malloc may own its top, so
+     * a heap grown back after a trim only moves it past its highest break */
+    else if (!sparse && mem_brk + incr > mem_brk_peak &&
+             sbrk(mem_brk + incr - mem_brk_peak) == (void*) -1) {
         ok = false;
         fprintf(stderr, "ERROR: mem_sbrk failed.  Could not allocate more heap space\n");
     }
+#endif
 
     if (ok) {
         mem_brk += incr;
+        if (mem_brk > mem_brk_peak)
+            mem_brk_peak = mem_brk;
+        if (incr < 0)
+            release_pages(mem_brk, old_brk);
+        heap_grown(incr);
+        __atomic_fetch_add(&sbrk_calls, 1, __ATOMIC_RELAXED);
         return (void *) old_brk;
     } else {
         errno = ENOMEM;
@@ -209,10 +320,238 @@ void *mem_heap_hi(){
 }
 
 /*
- * mem_heapsize() - returns the heap size in bytes
+ * mem_heapsize() - returns the heap size in bytes, summed over all regions
+ *                  and mapped areas
  */
 size_t mem_heapsize() {
-    return (size_t)(mem_brk - heap);
+    size_t size = (size_t)(mem_brk - heap) + map_bytes;
+    int i;
+    for (i = 1; i < num_regions; i++)
+        size += (size_t)(region_brk[i] - region_lo[i]);
+    return size;
+}
+
+/*
+ * mem_heap_peak() - returns the largest heap size since the last reset,
+ *                   summed over all regions and mapped areas
+ */
+size_t mem_heap_peak() {
+    return __atomic_load_n(&heap_peak, __ATOMIC_RELAXED);
+}
+
+/*
+ * mem_region_create() - reserves a new region of 1/MEM_MAX_REGIONS of the
+ *                       heap address space, below the previous ones.
+ *                       Returns its id, or -1 if no region is left or the
+ *                       heap has already grown into the reserved space.
+ *                       The caller must serialize the calls.
+ */
+int mem_region_create() {
+    mem_ready();
+    size_t span = (size_t)(mem_top - heap) / MEM_MAX_REGIONS;
+    span -= span % mem_pagesize();
+    if (num_regions == MEM_MAX_REGIONS || mem_max_addr - span < mem_brk)
+        return -1;
+    mem_max_addr -= span;
+    region_lo[num_regions] = mem_max_addr;
+    region_brk[num_regions] = mem_max_addr;
+    region_max[num_regions] = mem_max_addr + span;
+    return num_regions++;
+}
+
+/*
+ * mem_region_sbrk() - extends (or shrinks) the region by incr bytes and
+ *                     returns the start address of the new area, like
+ *                     mem_sbrk. Regions can be extended concurrently.
+ */
+void *mem_region_sbrk(int region, intptr_t incr) {
+    if (region == 0)
+        return mem_sbrk(incr);
+
+    unsigned char *old_brk = region_brk[region];
+    if (old_brk + incr < region_lo[region] ||
+        old_brk + incr > region_max[region]) {
+        /* Not reported: mm then allocates from another region */
+        errno = ENOMEM;
+        return (void *) -1;
+    }
+    region_brk[region] += incr;
+    if (incr < 0)
+        release_pages(region_brk[region], old_brk);
+    heap_grown(incr);
+    __atomic_fetch_add(&sbrk_calls, 1, __ATOMIC_RELAXED);
+    return (void *) old_brk;
+}
+
+/*
+ * mem_region_lo() - return address of the first byte of the region
+ */
+void *mem_region_lo(int region) {
+    return region == 0 ? mem_heap_lo() : (void *) region_lo[region];
+}
+
+/*
+ * mem_region_hi() - return address of the last byte of the region
+ */
+void *mem_region_hi(int region) {
+    return region == 0 ? mem_heap_hi() : (void *)(region_brk[region] - 1);
+}
+
+/*
+ * mem_region_size() - returns the size of the region in bytes
+ */
+size_t mem_region_size(int region) {
+    return region == 0 ? (size_t)(mem_brk - heap)
+                       : (size_t)(region_brk[region] - region_lo[region]);
+}
+
+/*
+ * mem_in_heap() - is [addr, addr+len) inside the heap or one of the regions?
+ */
+bool mem_in_heap(const void *addr, size_t len) {
+    const unsigned char *lo = addr;
+    int i;
+    if (lo >= heap && lo + len <= mem_brk)
+        return true;
+    for (i = 1; i < num_regions; i++)
+        if (lo >= region_lo[i] && lo + len <= region_brk[i])
+            return true;
+    return lo >= map_lo && lo + len <= map_brk;
+}
+
+/*
+ * mem_map() - maps a new area of len bytes (rounded up to whole pages)
+ *             and returns its page-aligned start address, like mmap.
+ *             The caller must serialize the calls to mem_map, mem_unmap
+ *             and mem_remap.
+ */
+void *mem_map(size_t len) {
+    mem_ready();
+    size_t size = map_round(len);
+    unsigned char *addr = map_take(size);
+    if (addr == NULL) {
+        fprintf(stderr, "ERROR: mem_map failed.  Ran out of mapped space for %zu bytes\n", len);
+        errno = ENOMEM;
+        return (void *) -1;
+    }
+    map_bytes += size;
+    heap_grown(size);
+    return (void *) addr;
+}
+
+/*
+ * mem_unmap() - unmaps the area of len bytes at addr returned by mem_map
+ *               or mem_remap, and releases its pages
+ */
+void mem_unmap(void *addr, size_t len) {
+    unsigned char *lo = addr;
+    size_t size = map_round(len);
+    map_give(lo, lo + size);
+    map_bytes -= size;
+    heap_grown(-(intptr_t) size);
+}
+
+/*
+ * mem_remap() - resizes the area of old_len bytes at addr to new_len
+ *               bytes and returns its start address, like mremap with
+ *               MREMAP_MAYMOVE.  An area which cannot grow in place
+ *               moves its pages to a new address.
+ */
+void *mem_remap(void *addr, size_t old_len, size_t new_len) {
+    unsigned char *lo = addr;
+    size_t old_size = map_round(old_len);
+    size_t new_size = map_round(new_len);
+    unsigned char *end = lo + old_size;
+    int i;
+
+    if (new_size <= old_size) {
+        if (new_size < old_size)
+            map_give(lo + new_size, end);
+    } else if (end == map_brk && new_size - old_size <= (size_t)(map_max - map_brk)) {
+        /* The last area grows into the free space */
+        map_brk += new_size - old_size;
+    } else if ((i = map_hole_at(end)) >= 0 &&
+               (size_t)(map_holes[i].hi - end) >= new_size - old_size) {
+        /* The area grows into the hole following it */
+        map_holes[i].lo += new_size - old_size;
+        if (map_holes[i].lo == map_holes[i].hi)
+            map_hole_remove(i);
+    } else {
+        unsigned char *new_lo = map_take(new_size);
+        if (new_lo == NULL) {
+            fprintf(stderr, "ERROR: mem_remap failed.  Ran out of mapped space for %zu bytes\n", new_len);
+            errno = ENOMEM;
+            return (void *) -1;
+        }
+        move_pages(new_lo, lo, old_size);
+        map_give(lo, end);
+        lo = new_lo;
+    }
+    map_bytes += new_size - old_size;
+    heap_grown((intptr_t)(new_size - old_size));
+    return (void *) lo;
+}
+
+/*
+ * mem_is_mapped() - does addr lie in the space reserved for mapped areas?
+ *                   It can be called concurrently with mem_map.
+ */
+bool mem_is_mapped(const void *addr) {
+    const unsigned char *lo = addr;
+    return lo >= map_lo && lo < map_max;
+}
+
+/*
+ * mem_release() - tells that [addr, addr+len) holds no data any more.  The
+ *                 pages fully inside the range are given back to the
+ *                 system, and read as zero (dense) or uninitialized (sparse)
+ *                 once they are touched again.  The contents of the
+ *                 partial pages at both ends are kept.
+ */
+void mem_release(void *addr, size_t len) {
+    unsigned char *lo = addr;
+    if (len == 0 || !mem_in_heap(addr, len)) {
+        fprintf(stderr, "ERROR: mem_release failed.  Range %p + %zu is not in the heap\n",
+                addr, len);
+        return;
+    }
+    release_pages(lo, lo + len);
+}
+
+/*
+ * mem_resident() - returns the number of heap bytes backed by memory: the
+ *                  resident pages of the heap mapping (dense), or the
+ *                  emulated pages in use (sparse)
+ */
+size_t mem_resident() {
+    if (sparse)
+        return (num_pages - num_free_pages) * SPARSE_PAGE_SIZE;
+
+    size_t pages = resident_pages(heap, mem_brk) + resident_pages(map_lo, map_brk);
+    int i;
+    for (i = 1; i < num_regions; i++)
+        pages += resident_pages(region_lo[i], region_brk[i]);
+    return pages * mem_pagesize();
+}
+
+/*
+ * mem_reset_resident() - releases every page of the heap mapping, so that
+ *                        mem_resident() only counts the pages touched
+ *                        from now on.  The heap must be empty.
+ */
+void mem_reset_resident() {
+    if (!sparse) {
+        madvise(heap, mmap_length, MADV_DONTNEED);
+        madvise(map_lo, MAX_DENSE_MAP, MADV_DONTNEED);
+    }
+}
+
+/*
+ * mem_sbrk_calls() - returns the number of successful mem_sbrk calls
+ *                    since the heap was last reset
+ */
+size_t mem_sbrk_calls() {
+    return sbrk_calls;
 }
 
 /*
@@ -241,8 +580,7 @@ void mem_write128(void* addr, __int128 val)
 /* Read len bytes and return value zero-extended to 64 bits */
 uint64_t mem_read(const void *addr, size_t len) {
     uint64_t rdata;
-    if (sparse &&
-            (unsigned char *) addr >= heap && (unsigned char *) addr+len <= mem_brk) {
+    if (sparse && mem_in_heap(addr, len)) {
         /* Heap read.  Check if it crosses page boundary */
         size_t id = page_id(addr);
         void *paddr = get_mem(addr, len, false);
@@ -279,8 +617,7 @@ uint64_t mem_read(const void *addr, size_t len) {
 
 /* Write lower order len bytes of val to address */
 void mem_write(void *addr, uint64_t val, size_t len) {
-    if (sparse &&
-            (unsigned char *) addr >= heap && (unsigned char *) addr+len <= mem_brk) {
+    if (sparse && mem_in_heap(addr, len)) {
         /* Heap write.  Check to see if it crosses page boundary */
         size_t id = page_id(addr);
         void *paddr = get_mem(addr, len, true);
@@ -334,6 +671,30 @@ void *mem_memcpy(void *dst, const void *src, size_t num_bytes) {
     return savedst;
 }
 
+/* Emulation of memmove */
+void *mem_memmove(void *dst, const void *src, size_t num_bytes) {
+    /* Copying forward is safe unless dst overlaps the tail of src */
+    if ((unsigned char *) dst <= (unsigned char *) src ||
+        (unsigned char *) dst >= (unsigned char *) src + num_bytes)
+        return mem_memcpy(dst, src, num_bytes);
+    void *savedst = dst;
+    size_t word_size = sizeof(uint64_t);
+    unsigned char *dend = (unsigned char *) dst + num_bytes;
+    const unsigned char *send = (const unsigned char *) src + num_bytes;
+    while (num_bytes >= word_size) {
+        dend -= word_size;
+        send -= word_size;
+        uint64_t data = mem_read(send, word_size);
+        mem_write(dend, data, word_size);
+        num_bytes -= word_size;
+    }
+    if (num_bytes) {
+        uint64_t data = mem_read(src, num_bytes);
+        mem_write(dst, data, num_bytes);
+    }
+    return savedst;
+}
+
 /* Emulation of memset */
 void *mem_memset(void *dst, int c, size_t num_bytes) {
     void *savedst = dst;
@@ -401,6 +762,185 @@ static void print_stats() {
     stats_printed = true;
 }
 
+/* Account for a heap change of incr bytes, and update the peak */
+static void heap_grown(intptr_t incr) {
+    size_t size = __atomic_add_fetch(&heap_bytes, (size_t) incr, __ATOMIC_RELAXED);
+    size_t peak = __atomic_load_n(&heap_peak, __ATOMIC_RELAXED);
+    while (size > peak &&
+           !__atomic_compare_exchange_n(&heap_peak, &peak, size, true,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+/* Give back the pages fully inside [lo, hi) */
+static void release_pages(unsigned char *lo, unsigned char *hi) {
+    if (sparse) {
+        size_t lo_id = page_id(lo + SPARSE_PAGE_SIZE - 1);
+        size_t hi_id = page_id(hi);
+        if (lo_id < hi_id)
+            release_sparse_pages(lo_id, hi_id);
+        return;
+    }
+    uintptr_t page = mem_pagesize();
+    uintptr_t start = ((uintptr_t) lo + page - 1) & ~(page - 1);
+    uintptr_t end = (uintptr_t) hi & ~(page - 1);
+    if (start < end)
+        madvise((void *) start, end - start, MADV_DONTNEED);
+}
+
+/* Move the emulated pages with ID in [lo_id, hi_id) to the released list */
+static void release_sparse_pages(size_t lo_id, size_t hi_id) {
+    mem_block_t *block = unlink_sparse_pages(lo_id, hi_id);
+    while (block != NULL) {
+        mem_block_t *next = block->next;
+        block->next = released_pages;
+        released_pages = block;
+        num_free_pages++;
+        block = next;
+    }
+}
+
+/* Remove the emulated pages with ID in [lo_id, hi_id) from the page table,
+ * and return them as a list */
+static mem_block_t *unlink_sparse_pages(size_t lo_id, size_t hi_id) {
+    mem_block_t *list = NULL;
+    /* Visit either the IDs of the range or the whole page table */
+    bool by_id = hi_id - lo_id <= num_buckets;
+    size_t b = by_id ? lo_id : 0;
+    size_t end = by_id ? hi_id : num_buckets;
+    for (; b < end; b++) {
+        mem_block_t **link = &page_table[b % num_buckets];
+        while (*link != NULL) {
+            mem_block_t *block = *link;
+            if (block->id >= lo_id && block->id < hi_id) {
+                *link = block->next;
+                block->next = list;
+                list = block;
+            } else {
+                link = &block->next;
+            }
+        }
+    }
+    return list;
+}
+
+/* Count the resident pages of [lo, hi), lo being page-aligned */
+static size_t resident_pages(unsigned char *lo, unsigned char *hi) {
+    size_t page = mem_pagesize();
+    size_t pages = 0;
+    unsigned char vec[4096];
+    while (lo < hi) {
+        size_t len = (size_t)(hi - lo);
+        if (len > sizeof(vec) * page)
+            len = sizeof(vec) * page;
+        size_t n = (len + page - 1) / page;
+        size_t j;
+        if (mincore(lo, len, vec) == 0)
+            for (j = 0; j < n; j++)
+                pages += vec[j] & 1;
+        lo += n * page;
+    }
+    return pages;
+}
+
+/* Round a mapped area size up to whole pages */
+static size_t map_round(size_t len) {
+    size_t page = mem_pagesize();
+    return (len + page - 1) & ~(page - 1);
+}
+
+/* Take size bytes of the mapped space, from the first hole large enough
+ * or from the top.  Returns NULL if the space is exhausted */
+static unsigned char *map_take(size_t size) {
+    unsigned char *addr;
+    int i;
+    for (i = 0; i < num_holes; i++) {
+        if ((size_t)(map_holes[i].hi - map_holes[i].lo) >= size) {
+            addr = map_holes[i].lo;
+            map_holes[i].lo += size;
+            if (map_holes[i].lo == map_holes[i].hi)
+                map_hole_remove(i);
+            return addr;
+        }
+    }
+    if (size > (size_t)(map_max - map_brk))
+        return NULL;
+    addr = map_brk;
+    map_brk += size;
+    return addr;
+}
+
+/* Give [lo, hi) back to the mapped space, and release its pages */
+static void map_give(unsigned char *lo, unsigned char *hi) {
+    int i;
+    release_pages(lo, hi);
+    if (hi == map_brk) {
+        /* Lower the top, along with the hole below it */
+        map_brk = lo;
+        if (num_holes > 0 && map_holes[num_holes - 1].hi == map_brk)
+            map_brk = map_holes[--num_holes].lo;
+        return;
+    }
+    for (i = 0; i < num_holes && map_holes[i].lo < lo; i++)
+        ;
+    if (i > 0 && map_holes[i - 1].hi == lo) {
+        /* Merge with the previous hole, and maybe the next one */
+        map_holes[i - 1].hi = hi;
+        if (i < num_holes && map_holes[i].lo == hi) {
+            map_holes[i - 1].hi = map_holes[i].hi;
+            map_hole_remove(i);
+        }
+    } else if (i < num_holes && map_holes[i].lo == hi) {
+        map_holes[i].lo = lo;
+    } else if (num_holes < MEM_MAX_MAP_HOLES) {
+        memmove(&map_holes[i + 1], &map_holes[i], (num_holes - i) * sizeof(mem_hole_t));
+        map_holes[i].lo = lo;
+        map_holes[i].hi = hi;
+        num_holes++;
+    }
+}
+
+/* Return the index of the hole starting at lo, or -1 */
+static int map_hole_at(unsigned char *lo) {
+    int i;
+    for (i = 0; i < num_holes && map_holes[i].lo <= lo; i++)
+        if (map_holes[i].lo == lo)
+            return i;
+    return -1;
+}
+
+/* Remove the hole of index i */
+static void map_hole_remove(int i) {
+    num_holes--;
+    memmove(&map_holes[i], &map_holes[i + 1], (num_holes - i) * sizeof(mem_hole_t));
+}
+
+/* Move the pages of the area [src, src+len) to dst, without copying them.
+ * The source range is left empty */
+static void move_pages(unsigned char *dst, unsigned char *src, size_t len) {
+    if (sparse) {
+        size_t src_id = page_id(src);
+        size_t dst_id = page_id(dst);
+        mem_block_t *block = unlink_sparse_pages(src_id, src_id + len / SPARSE_PAGE_SIZE);
+        while (block != NULL) {
+            mem_block_t *next = block->next;
+            block->id = block->id - src_id + dst_id;
+            block->next = page_table[block->id % num_buckets];
+            page_table[block->id % num_buckets] = block;
+            block = next;
+        }
+        return;
+    }
+    /* mremap unmaps the source, which is mapped again to keep the
+     * mapped space contiguous */
+    if (mremap(src, len, len, MREMAP_MAYMOVE | MREMAP_FIXED, dst) == MAP_FAILED ||
+        mmap(src, len, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0) == MAP_FAILED) {
+        fprintf(stderr, "FAILURE.  mremap couldn't move a mapped area\n");
+        exit(1);
+    }
+}
+
 /* Given an address, compute the ID  of its page */
 static size_t page_id(const void *addr) {
     size_t offset = (unsigned char *) addr - (unsigned char *) SPARSE_HEAP_START;
@@ -434,7 +974,12 @@ static void *get_mem(const void *addr, size_t size, bool isWrite) {
             fprintf(stderr, "FAILURE.  Ran out of memory for emulation\n");
             exit(1);
         }
-        block = next_free_page++;
+        if (released_pages != NULL) {
+            block = released_pages;
+            released_pages = block->next;
+        } else {
+            block = next_free_page++;
+        }
         num_free_pages--;
         block->id = id;
         block->next = page_table[b];
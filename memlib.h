@@ -9,6 +9,28 @@ void mem_reset_brk(void);
 void *mem_heap_lo(void);
 void *mem_heap_hi(void);
 size_t mem_heapsize(void);
+size_t mem_sbrk_calls(void);
+size_t mem_heap_peak(void);
+
+/* Giving memory back to the system */
+void mem_release(void *addr, size_t len);
+size_t mem_resident(void);
+void mem_reset_resident(void);
+
+/* Additional disjoint heap regions, each one with its own break.
+ * Region 0 is the heap of mem_sbrk. */
+int mem_region_create(void);
+void *mem_region_sbrk(int region, intptr_t incr);
+void *mem_region_lo(int region);
+void *mem_region_hi(int region);
+size_t mem_region_size(int region);
+bool mem_in_heap(const void *addr, size_t len);
+
+/* Areas mapped outside of the heap break, for large objects */
+void *mem_map(size_t len);
+void mem_unmap(void *addr, size_t len);
+void *mem_remap(void *addr, size_t old_len, size_t new_len);
+bool mem_is_mapped(const void *addr);
 size_t mem_pagesize(void);
 
 /* Functions used for memory emulation */
@@ -24,6 +46,9 @@ void mem_write(void *addr, uint64_t val, size_t len);
 /* Emulation of memcpy */
 void *mem_memcpy(void *dst, const void *src, size_t n);
 
+/* Emulation of memmove */
+void *mem_memmove(void *dst, const void *src, size_t n);
+
 /* Emulation of memset */
 void *mem_memset(void *dst, int c, size_t n);
 
@@ -11,16 +11,54 @@
  *           from 10 free blocks). Once this limit has been reached,          *
  *           one block with the minimum fragmentation will be allocated.      *
  *           If none free block is found, the heap will be extended by a      *
- *           chunksize and allocate that memory to the program. If the whole  *
- *           block is too big, it will be splited. The splited part will be   *
- *           added to the free list.                                          *
+ *           chunk and allocate that memory to the program. The chunk is a    *
+ *           fraction of the heap size (from 4 KB up to 1 MB), and only the   *
+ *           missing bytes are requested when the last block is free. If the  *
+ *           whole block is too big, it will be splited. The splited part     *
+ *           will be added to the free list.                                  *
  *                                                                            *
  *           Free blocks are managed by using the FILO                        *
  *           rule, and they are linked together by using the double-linked    *
  *           list. The segregated list is implemented for optimizing the      *
  *           utilization and throughput of the malloc and free. Different     *
  *           block sizes are assigned to different classes. And each class    *
- *           is a free list.                                                  *
+ *           is a free list. Blocks up to 128 bytes have one exact class per  *
+ *           16 bytes, larger blocks are grouped by power of two. The table   *
+ *           of list heads is stored at the beginning of the heap.            *
+ *                                                                            *
+ *           Classes of blocks larger than 4096 bytes are not lists: each     *
+ *           one is a splay tree ordered by (size, address), whose nodes      *
+ *           (left/right/parent pointers) live in the free blocks. These      *
+ *           classes always return the real best fit in O(log n).             *
+ *                                                                            *
+ *           Small blocks (up to 512 bytes) are not coalesced right away      *
+ *           when they are freed. They are pushed into exact-size fast bins   *
+ *           (one per 16 bytes) and stay marked as allocated, so that the     *
+ *           next malloc of the same size pops them in constant time. The     *
+ *           fast bins are flushed into the segregated list (coalescing the   *
+ *           blocks) when they hold too many bytes, or when no fit is found   *
+ *           before the heap is extended.                                     *
+ *                                                                            *
+ *           Tiny requests (up to 48 bytes) whose header would cost a whole   *
+ *           16 bytes (9-16, 25-32 and 41-48 bytes) do not get a block at     *
+ *           all. They are served by slots of 16, 32 or 48 bytes, carved from *
+ *           2 KB runs. A run is an allocated block whose payload is aligned  *
+ *           to 2 KB, and starts with a header holding the slot class and a   *
+ *           bitmap of the free slots, so the run of a slot is found by       *
+ *           masking its address, and the slots carry no header. A page map,  *
+ *           a radix tree over the pages of the arena, records the class of   *
+ *           the pages holding runs, and tells the slots from other payloads. *
+ *           An empty run is freed back to the heap.                          *
+ *                                                                            *
+ *           Huge requests (256 KB and more) do not use the heap: each one    *
+ *           gets a memlib mapped area of its own, unmapped when it is freed, *
+ *           and remapped (moving pages rather than bytes) by realloc.        *
+ *                                                                            *
+ *           Memory goes back to the system in two ways: when a block of 4 KB *
+ *           or more is freed into a free block of 256 KB or more, its pages  *
+ *           are released (memlib drops them), and once the last free block   *
+ *           of the heap reaches 512 KB, it is shrunk to 256 KB (or a chunk)  *
+ *           and the break is lowered.                                        *
  *                                                                            *
  *           Allocated blocks have the fields of header and payload. The      *
  *           upper bits record the size of the block, and the last 4 bits     *
@@ -34,11 +72,30 @@
  *           Free blocks have two different sub-divisions: mini blocks and    *
  *           normal blocks. For mini blocks, they only have the header        *
  *           and the next free pointer. For normal blocks, they have the      *
- *           header, the next/prev free pointer, and the footer. Since mini   *
- *           blocks do not have the previous free pointer, when we want to    *
- *           search the previous free block based on the current one, we must *
- *           iterate whole free list to find it. The footer is used for       *
- *           determining the previous block size when coalescing.             *
+ *           header, the next/prev free pointer, and the footer. Since the    *
+ *           size of a mini block is always 16, the header of a free mini     *
+ *           block sets the mini bit (last 4th) and reuses the upper bits to  *
+ *           store the payload of the previous free block (which is           *
+ *           16-aligned), so a mini block is removed from its list in         *
+ *           constant time. The footer is used for determining the previous   *
+ *           block size when coalescing.                                      *
+ *                                                                            *
+ *           The heap itself is not thread-safe. Built with -DTHREAD_SAFE,    *
+ *           it is protected by one central lock, and every thread keeps a    *
+ *           cache of small blocks in front of it, refilled and flushed in    *
+ *           batches.                                                         *
+ *                                                                            *
+ *           Built without -DDRIVER, as the shared library libmm.so, the      *
+ *           file replaces the allocator of real programs: it also provides   *
+ *           posix_memalign, aligned_alloc, memalign, valloc, pvalloc and     *
+ *           malloc_usable_size, and memlib maps real memory. Aligned         *
+ *           requests are always heap blocks. Every lock is taken around      *
+ *           fork, so a child process inherits a consistent heap.             *
+ *                                                                            *
+ *           Built with -DMM_STATS, the heap counts how often each of its     *
+ *           paths is taken (searches, splits, coalescing cases, heap         *
+ *           extensions...), for mm_stats. The counters are per thread, so    *
+ *           counting is a plain increment.                                   *
  *                                                                            *
  *  ************************************************************************  *
  *  ** ADVICE FOR STUDENTS. **                                                *
@@ -57,6 +114,7 @@
  */
 
 #include <assert.h>
+#include <errno.h>
 #include <inttypes.h>
 #include <stdbool.h>
 #include <stddef.h>
@@ -65,6 +123,10 @@
 #include <string.h>
 #include <unistd.h>
 
+#ifdef THREAD_SAFE
+#include <pthread.h>
+#endif
+
 #include "memlib.h"
 #include "mm.h"
 
@@ -78,6 +140,7 @@
 #define calloc mm_calloc
 #define memset mem_memset
 #define memcpy mem_memcpy
+#define memmove mem_memmove
 #endif /* def DRIVER */
 
 /* You can change anything from here onward */
@@ -119,11 +182,26 @@ static const size_t dsize = 2 * wsize;
 // Minimum block size (bytes)
 static const size_t min_block_size = dsize;
 
-// The amount of the heap should be extended when
+// The least amount of the heap should be extended when
 // no block size is big enough for the new allocation
 // (Must be divisible by dsize)
 static const size_t chunksize = (1 << 12);
 
+// The largest amount the heap is extended by at once
+static const size_t chunk_max = (1 << 20);
+
+// The heap is extended by (heap size >> chunk_shift) between the two above
+static const unsigned chunk_shift = 7;
+
+// The last free block is shrunk to this many bytes (or a chunk if larger),
+// returning the rest of the heap to memlib, once it is twice as large
+static const size_t trim_threshold = (1 << 18);
+
+// The pages of a free block of at least this size are released, as far as
+// they are covered by a block of at least release_min bytes freed into it
+static const size_t release_threshold = (1 << 18);
+static const size_t release_min = (1 << 12);
+
 // The mask for the last bit of the header (alloc bit)
 static const word_t alloc_mask = 0x1;
 
@@ -133,6 +211,20 @@ static const word_t prev_alloc_mask = 0x1 << 1;
 // The mask for the last third bit of the header (if prev block is tiny block)
 static const word_t prev_min_mask = 0x1 << 2;
 
+// The mask for the last fourth bit of the header (set for free mini blocks,
+// whose upper header bits hold the previous free pointer instead of the size)
+static const word_t mini_mask = 0x1 << 3;
+
+// The mask for the flag bits kept by a free mini block header
+static const word_t flag_mask = 0x7;
+
+// The mini bit is never set in an allocated block, which reuses it to
+// record its growth history (set once the block has been grown by realloc)
+static const word_t grow_mask = 0x1 << 3;
+
+// A grown block that has to move gets (asize >> shift) bytes of headroom
+static const unsigned realloc_headroom_shift = 1;
+
 // Payload is aligned to dsize (16), therefore,
 // the lower 4 bits of the header are "dont care"
 static const word_t size_mask = ~(word_t)0xF;
@@ -140,6 +232,53 @@ static const word_t size_mask = ~(word_t)0xF;
 // The max search number for the best-fit approach
 static const unsigned max_search = 10;
 
+// The number of classes in the segregated list, also the length of the
+// per-class arrays of mm_shape_t
+static const unsigned seg_classes = MM_CLASSES;
+
+// The largest block size which has its own exact class (one per dsize)
+static const size_t seg_exact_max = 128;
+
+// The first class indexed by a splay tree instead of a list,
+// it holds the blocks in (4096, 8192]
+static const unsigned tree_class = 13;
+
+// The number of fast bins, one for each block size from 16 to 512 bytes
+static const unsigned fast_classes = 32;
+
+// The largest block size which goes to the fast bins
+static const size_t fast_max = 32 * 16;
+
+// The fast bins are flushed once they hold more bytes than this
+static const size_t fast_limit = (1 << 16);
+
+// Requests up to this many bytes may be served by the slab runs
+static const size_t slab_max = 48;
+
+// The number of slab classes, one per 16 bytes up to slab_max
+#define SLAB_CLASSES 3
+
+// The size of a slab run, including the header of its heap block, which
+// is also its alignment
+static const size_t run_size = (1 << 11);
+
+// The number of words of the free slot bitmap of a run
+#define RUN_WORDS 2
+
+// A leaf of the page map has (1 << map_leaf_shift) entries, one per page
+static const unsigned map_leaf_shift = 8;
+
+// An inner node of the page map has (1 << map_inner_shift) children
+static const unsigned map_inner_shift = 6;
+
+// Requests of at least this many bytes get a memlib mapped area of their
+// own instead of a heap block
+static const size_t huge_threshold = (1 << 18);
+
+// The mapped areas are aligned to (at least) this size, and a huge block
+// starts dsize bytes into its area
+static const size_t huge_align = (1 << 12);
+
 /* Represents the header and payload of one block in the heap */
 typedef struct block {
   /* Header contains size + allocation flag */
@@ -185,34 +324,262 @@ typedef struct {
   block_t *prev;
 } link_t;
 
+/*
+ * The node of a size-ordered tree of large free blocks
+ */
+typedef struct {
+  block_t *left;
+  block_t *right;
+  block_t *parent;
+} tree_link_t;
+
 /*
  * Payload and free pointer aliasing
  */
 typedef union {
   link_t *link;
+  tree_link_t *tree;
   char *ptr;
 } node_t;
 
+/*
+ * The header of a slab run: an allocated block of run_size bytes, whose
+ * payload is aligned to run_size, and cut into equal slots of one slab
+ * class. The run of a slot is found by masking the slot address, so the
+ * slots have no header at all.
+ */
+typedef struct run {
+  // The list of the runs of the class which have free slots
+  struct run *next;
+  struct run *prev;
+
+  // The slab class of the slots
+  unsigned class;
+
+  // The number of free slots
+  unsigned free_count;
+
+  // Bit i is set iff the slot i is free
+  word_t free_bits[RUN_WORDS];
+} run_t;
+
+/*
+ * A node of the page map, a radix tree indexed by the page (of run_size
+ * bytes) of an address, counted from the start of the arena. The tree only
+ * covers the pages up to the highest run so far: it grows by one level at
+ * the root whenever a run is placed beyond it. Its nodes are allocated on
+ * the heap.
+ */
+typedef struct map_node {
+  // The height of the node, 0 for a leaf
+  word_t level;
+
+  union {
+    // The children of an inner node, NULL if none of their pages has a run
+    struct map_node *children[0];
+
+    // The entries of a leaf: 0 if the page holds no run, and otherwise the
+    // slab class of its run plus one
+    unsigned char classes[0];
+  };
+} map_node_t;
+
+/*
+ * An independent heap. It is placed at the beginning of its memlib region,
+ * followed by the free list and fast bin tables, so that its size does not
+ * count as global data. The single-threaded build has one arena on the
+ * memlib heap (region 0), the thread-safe build adds one arena per region.
+ */
+typedef struct {
+  // Pointer to first block
+  block_t *heap_start;
+
+  // Segregated free block lists
+  block_t **free_start;
+
+  // Bitmap of the non-empty classes, bit i is set iff free_start[i] != NULL
+  word_t free_map;
+
+  // Fast bins of small freed blocks, right after the free list table
+  block_t **fast_start;
+
+  // Total bytes held by the fast bins
+  size_t fast_bytes;
+
+  // The memlib region holding the arena
+  int region;
+
+  // The runs which have free slots, one list per slab class
+  run_t *runs[SLAB_CLASSES];
+
+  // The root of the page map, NULL until the first run is created
+  map_node_t *page_map;
+
+#ifdef THREAD_SAFE
+  // The lock of the arena
+  pthread_mutex_t lock;
+
+  // Blocks freed by the threads of other arenas, linked through their
+  // payload, and returned to the heap by the next owner taking the lock
+  block_t *remote;
+#endif
+} arena_t;
+
 /* Global variables */
 
-// Pointer to first block
-static block_t *heap_start = NULL;
+#ifdef THREAD_SAFE
+// The arena of the calling thread
+static __thread arena_t *arena = NULL;
+#else
+// The only arena
+static arena_t *arena = NULL;
+#endif
+
+#ifdef THREAD_SAFE
+// The number of thread cache bins, one per fast bin and one per slab class
+#define CACHE_BINS (32 + SLAB_CLASSES)
+
+// A thread cache bin is refilled with this many blocks at once
+static const unsigned cache_batch = 8;
+
+// A thread cache bin is flushed down to half once it holds more blocks
+static const unsigned cache_max = 32;
+
+/*
+ * The cache of small blocks owned by one thread. The blocks keep their
+ * allocated flag, like the blocks in the fast bins, and are linked through
+ * their payload. The cache is dropped when the heap has been reinitialized
+ * since it was filled (its epoch is stale).
+ */
+typedef struct cache {
+  unsigned long epoch;
+  bool registered;
+  block_t *bins[CACHE_BINS];
+  unsigned counts[CACHE_BINS];
+#ifdef MM_STATS
+  // The counters of the thread, and the next thread in the list of caches
+  mm_stats_t stats;
+  struct cache *next;
+#endif
+} cache_t;
+
+// The cache of the calling thread
+static __thread cache_t cache;
 
-// Segregated free block lists
-static block_t *free_start[15];
+// The maximum number of arenas, at most one per memlib region
+#define MAX_ARENAS 8
+
+// All the arenas, arenas[0] is on the memlib heap and the others are
+// carved downward from the top, so each one starts above the previous
+static arena_t *arenas[MAX_ARENAS];
+static int num_arenas = 0;
+
+// Threads are assigned to the arenas round-robin by this counter
+static unsigned long arena_next = 0;
+
+// The lock for creating and assigning arenas
+static pthread_mutex_t arenas_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// The lock of the memlib mapped areas, shared by all the arenas
+static pthread_mutex_t huge_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// The key whose destructor flushes the cache of an exiting thread, created
+// with the fork handlers
+static pthread_key_t cache_key;
+static pthread_once_t process_once = PTHREAD_ONCE_INIT;
+
+// Incremented by mm_init, the caches filled and the arenas assigned
+// before are dropped
+static unsigned long heap_epoch = 0;
+
+#ifdef MM_STATS
+// The caches of the running threads, and the counters of the threads which
+// exited since mm_init, under arenas_lock
+static cache_t *caches = NULL;
+static mm_stats_t exited_stats;
+#endif
+#else
+#ifdef MM_STATS
+// The counters since mm_init
+static mm_stats_t heap_stats;
+#endif
+#endif /* def THREAD_SAFE */
 
 /* Function prototypes for internal helper routines */
 
 bool mm_checkheap(int lineno);
 
+static void *heap_malloc(size_t size);
+static void heap_free(void *bp);
+static void *heap_realloc(void *ptr, size_t size);
+static void *heap_place(size_t asize);
+static void *heap_memalign(size_t align, size_t size);
+static arena_t *arena_create(int region);
+
+#ifdef THREAD_SAFE
+static void arena_assign(void);
+static void *arena_alloc(size_t align, size_t size);
+static arena_t *arena_of(block_t *block);
+static void arena_lock(void);
+static void arena_unlock(void);
+static void arena_remote_free(arena_t *owner, block_t *block);
+static cache_t *cache_get(void);
+static void cache_refill(cache_t *c, unsigned class, size_t size);
+static void cache_flush(cache_t *c, unsigned class, unsigned keep);
+static void cache_release(void *arg);
+static void process_init(void);
+static void fork_prepare(void);
+static void fork_release(void);
+#endif
+
+static void count(unsigned stat, size_t n);
+static void shape_arena(mm_shape_t *shape);
+static void stats_clear(mm_stats_t *stats);
+static void stats_add(mm_stats_t *sum, const mm_stats_t *stats);
+
 static block_t *extend_heap(size_t size);
+static size_t get_chunksize(void);
+static void heap_trim(block_t *block);
+static void release_block(block_t *block, block_t *freed, size_t size);
+static block_t *find_last_free(void);
 static block_t *find_fit(size_t asize);
+
+static void *huge_malloc(size_t size);
+static void huge_free(block_t *block);
+static void *huge_realloc(void *ptr, size_t size);
+static bool is_huge(void *bp);
 static block_t *coalesce_block(block_t *block);
 static void split_block(block_t *block, size_t asize);
 
+static void *slab_malloc(size_t size);
+static void slab_free(run_t *run, void *bp);
+static run_t *slab_run(void *bp);
+static run_t *run_create(unsigned class);
+static void run_push(run_t *run);
+static void run_remove(run_t *run);
+static char *run_slot(run_t *run, unsigned slot);
+static bool is_slab_size(size_t size);
+static unsigned get_slab_class(size_t size);
+static size_t get_slab_size(unsigned class);
+static unsigned get_run_slots(unsigned class);
+
+static unsigned map_lookup(void *bp);
+static bool map_set(run_t *run, unsigned entry);
+static map_node_t *map_node_create(unsigned level);
+static map_node_t *map_child(map_node_t *node, size_t page);
+static size_t get_map_pages(unsigned level);
+
+static void fast_push(block_t *block);
+static block_t *fast_pop(size_t asize);
+static void fast_flush(void);
+static block_t *fast_next(block_t *block);
+static unsigned get_fast_class(size_t size);
+
 static size_t max(size_t x, size_t y);
 static size_t round_up(size_t size, size_t n);
+static bool too_large(size_t size);
 static word_t pack(size_t size, bool alloc, bool prev_alloc, bool prev_min);
+static size_t get_headroom(size_t asize);
 
 static size_t extract_size(word_t header);
 static size_t get_size(block_t *block);
@@ -227,6 +594,7 @@ static bool get_prev_min(block_t *block);
 
 static void write_header(block_t *block, size_t size, bool alloc,
                          bool prev_alloc, bool prev_min);
+static void write_prev_flags(block_t *block, bool prev_alloc, bool prev_min);
 static void write_footer(block_t *block, size_t size, bool alloc);
 
 static block_t *payload_to_header(void *bp);
@@ -241,11 +609,27 @@ static void free_add(block_t *block);
 static void free_remove(block_t *block);
 static block_t *free_next(block_t *block);
 static block_t *free_prev(block_t *block);
-static block_t *free_prev_mini(block_t *block);
 static void set_free_next(block_t *block, block_t *block_next);
 static void set_free_prev(block_t *block, block_t *block_prev);
 static bool free_empty(unsigned class);
 
+static void tree_insert(unsigned class, block_t *block);
+static void tree_remove(unsigned class, block_t *block);
+static block_t *tree_fit(unsigned class, size_t asize);
+static void tree_splay(unsigned class, block_t *block);
+static void tree_rotate_left(unsigned class, block_t *block);
+static void tree_rotate_right(unsigned class, block_t *block);
+static void tree_replace(unsigned class, block_t *block, block_t *block_new);
+static block_t *tree_min(block_t *block);
+static block_t *tree_next(block_t *block);
+static bool tree_less(block_t *x, block_t *y);
+static block_t *tree_left(block_t *block);
+static block_t *tree_right(block_t *block);
+static block_t *tree_parent(block_t *block);
+static void set_tree_left(block_t *block, block_t *block_left);
+static void set_tree_right(block_t *block, block_t *block_right);
+static void set_tree_parent(block_t *block, block_t *block_parent);
+
 static bool is_in_range(void *ptr);
 static bool is_aligned(void *ptr);
 
@@ -258,6 +642,10 @@ static bool check_alloc(block_t *block);
 static bool check_prev_next_connection(block_t *block, block_t *block_prev);
 static bool check_consecutive_free(block_t *block, block_t *block_prev);
 static bool check_free_link(block_t *block);
+static bool check_tree(unsigned class, long *free_counts);
+static bool check_run(run_t *run);
+static bool check_map(map_node_t *node, size_t page, long *run_counts);
+static bool check_slab(void);
 
 /*
  * Init the heap by extending 4096 bytes.
@@ -266,17 +654,60 @@ static bool check_free_link(block_t *block);
  * false otherwise.
  */
 bool mm_init(void) {
-  int i, len = sizeof(free_start) / sizeof(block_t *);
-  // Create the initial empty heap
-  word_t *start = (word_t *)(mem_sbrk(2 * wsize));
+#ifdef THREAD_SAFE
+  // The arenas and the blocks held by the thread caches belonged to the
+  // previous heap
+  heap_epoch++;
+  num_arenas = 0;
+  arena_next = 0;
+#ifdef MM_STATS
+  stats_clear(&exited_stats);
+#endif
+#else
+#ifdef MM_STATS
+  stats_clear(&heap_stats);
+#endif
+#endif
+  if (arena_create(0) == NULL)
+    return false;
+#ifdef THREAD_SAFE
+  arenas[num_arenas++] = arena;
+#endif
+  return true;
+}
+
+/*
+ * Create an empty arena at the beginning of the memlib <region>, and make
+ * it the current one.
+ *
+ * returns the arena, or NULL if the region runs out of memory.
+ */
+static arena_t *arena_create(int region) {
+  unsigned i;
+  size_t arena_size = round_up(sizeof(arena_t), dsize);
+  size_t table_size = (seg_classes + fast_classes) * sizeof(block_t *);
+  // Create the initial empty heap, with the arena and the free list and
+  // fast bin tables in front of it
+  char *base =
+      (char *)(mem_region_sbrk(region, arena_size + table_size + 2 * wsize));
 
   /*
    * Runs out of memory for extending the heap
    */
-  if (start == (void *)-1) {
-    return false;
+  if (base == (void *)-1) {
+    return NULL;
   }
 
+  arena = (arena_t *)base;
+  arena->region = region;
+  arena->free_start = (block_t **)(base + arena_size);
+  arena->fast_start = arena->free_start + seg_classes;
+#ifdef THREAD_SAFE
+  pthread_mutex_init(&arena->lock, NULL);
+  arena->remote = NULL;
+#endif
+  word_t *start = (word_t *)(base + arena_size + table_size);
+
   /*
    * Prologue and epologue have same strucuter as
    * header and footer. However, their allocated
@@ -291,59 +722,125 @@ bool mm_init(void) {
   start[1] = pack(0, true, true, false); // Heap epilogue (block header)
 
   // Heap starts with first "block header", currently the epilogue
-  heap_start = (block_t *)&(start[1]);
+  arena->heap_start = (block_t *)&(start[1]);
 
   // Initialize the free list
-  for (i = 0; i < len; i++)
-    free_start[i] = NULL;
+  for (i = 0; i < seg_classes; i++)
+    arena->free_start[i] = NULL;
+  arena->free_map = 0;
+  for (i = 0; i < fast_classes; i++)
+    arena->fast_start[i] = NULL;
+  arena->fast_bytes = 0;
+
+  for (i = 0; i < SLAB_CLASSES; i++)
+    arena->runs[i] = NULL;
+  arena->page_map = NULL;
 
   // Extend the empty heap with a free block of chunksize bytes
   if (extend_heap(chunksize) == NULL) {
-    return false;
+    return NULL;
   }
 
-  return true;
+  return arena;
 }
 
 /*
  * Malloc <size> bytes on heap
  * Returns the pointer points to the allocated start
  */
-void *malloc(size_t size) {
+static void *heap_malloc(size_t size) {
   dbg_requires(mm_checkheap(__LINE__));
 
-  size_t asize;      // Adjusted block size
-  size_t extendsize; // Amount to extend heap if no fit is found
-  block_t *block;
+  size_t asize; // Adjusted block size
   void *bp = NULL;
 
-  if (heap_start == NULL) // Initialize heap if it isn't initialized
+  if (arena == NULL) // Initialize heap if it isn't initialized
   {
     mm_init();
   }
 
+#ifndef DRIVER
+  // Programs expect a pointer they can free, even for no bytes
+  if (size == 0)
+    size = 1;
+#endif
+
   if (size == 0) // Ignore spurious request
   {
     dbg_ensures(mm_checkheap(__LINE__));
     return bp;
   }
+  if (too_large(size))
+    return NULL;
+  count(MM_STAT_MALLOC, 1);
+
+  // Huge sizes are not placed on the heap at all
+  if (size >= huge_threshold) {
+    bp = huge_malloc(size);
+    dbg_ensures(mm_checkheap(__LINE__));
+    return bp;
+  }
+
+  // Tiny sizes are served by the slab runs, unless they are out of memory
+  if (is_slab_size(size)) {
+    bp = slab_malloc(size);
+    if (bp != NULL) {
+      count(MM_STAT_SLAB_MALLOC, 1);
+      dbg_ensures(mm_checkheap(__LINE__));
+      return bp;
+    }
+  }
 
   // Adjust block size to include overhead and to meet alignment requirements
   asize = round_up(size + wsize, dsize);
   if (asize < min_block_size)
     asize = min_block_size;
 
+  bp = heap_place(asize);
+
+  dbg_ensures(mm_checkheap(__LINE__));
+  return bp;
+}
+
+/*
+ * Allocate a heap block of <asize> bytes, an adjusted size, from the fast
+ * bins, the free lists or new heap space.
+ * Returns its payload, or NULL if the heap runs out of memory.
+ */
+static void *heap_place(size_t asize) {
+  size_t extendsize; // Amount to extend heap if no fit is found
+  block_t *block;
+
+  // Small sizes are first served by the fast bins
+  if (asize <= fast_max) {
+    block = fast_pop(asize);
+    if (block != NULL) {
+      count(MM_STAT_FAST_HIT, 1);
+      return header_to_payload(block);
+    }
+  }
+
   // Search the free list for a fit
   block = find_fit(asize);
 
+  // Coalesce the blocks held by the fast bins before growing the heap
+  if (block == NULL && arena->fast_bytes > 0) {
+    fast_flush();
+    block = find_fit(asize);
+  }
+
   // If no fit is found, request more memory, and then and place the block
   if (block == NULL) {
-    // Always request at least chunksize
-    extendsize = max(asize, chunksize);
+    // Always request at least a chunk, the last block is coalesced with the
+    // new space if it is free, so only the missing bytes are requested
+    extendsize = max(asize, get_chunksize());
+    block = find_last_free();
+    if (block != NULL)
+      extendsize -= get_size(block);
     block = extend_heap(extendsize);
     if (block == NULL) // extend_heap returns an error
     {
-      return bp;
+      return NULL;
     }
   }
 
@@ -361,24 +858,37 @@ void *malloc(size_t size) {
   // Try to split the block if too large
   split_block(block, asize);
 
-  bp = header_to_payload(block);
-
-  dbg_ensures(mm_checkheap(__LINE__));
-  return bp;
+  return header_to_payload(block);
 }
 
 /*
  * Frees the pointer <bp> previously allocated by malloc
  * If <bp> is freed originally, nothing will be done
  */
-void free(void *bp) {
-  block_t *block;
+static void heap_free(void *bp) {
+  block_t *block, *block_free;
+  run_t *run;
   size_t size;
 
   dbg_requires(mm_checkheap(__LINE__));
 
   if (bp == NULL)
     return;
+  count(MM_STAT_FREE, 1);
+
+  if (is_huge(bp)) {
+    huge_free(payload_to_header(bp));
+    dbg_ensures(mm_checkheap(__LINE__));
+    return;
+  }
+
+  // Slots go back to their run
+  run = slab_run(bp);
+  if (run != NULL) {
+    slab_free(run, bp);
+    dbg_ensures(mm_checkheap(__LINE__));
+    return;
+  }
 
   block = payload_to_header(bp);
 
@@ -390,12 +900,30 @@ void free(void *bp) {
   // The block should be marked as allocated
   dbg_assert(get_alloc(block));
 
+  // Small blocks are kept by the fast bins without coalescing
+  if (size <= fast_max) {
+    fast_push(block);
+    if (arena->fast_bytes > fast_limit)
+      fast_flush();
+    dbg_ensures(mm_checkheap(__LINE__));
+    return;
+  }
+
   // Mark the block as free
   write_header(block, size, false, get_prev_alloc(block), get_prev_min(block));
   write_footer(block, size, false);
 
   // Try to coalesce the block with its neighbors
-  block = coalesce_block(block);
+  block_free = coalesce_block(block);
+
+  if (size >= release_min && get_size(block_free) >= release_threshold)
+    release_block(block_free, block, size);
+  block = block_free;
+
+  // The end of the heap is given back once the last free block is too large
+  if (get_size(block) >= 2 * trim_threshold &&
+      get_size(find_next(block)) == 0)
+    heap_trim(block);
 
   dbg_ensures(mm_checkheap(__LINE__));
 }
@@ -403,21 +931,67 @@ void free(void *bp) {
 /*
  * Reallocate the <ptr> to the new <size>
  * Returns the pointer points to the new start
+ *
+ * The block grows in place whenever possible, in this order:
+ * 1. absorb the next free block;
+ * 2. if the block is the last one, extend the heap by the missing bytes;
+ * 3. absorb the previous free block (and the next one), moving the
+ *    payload down with memmove.
+ * Otherwise, a new block is malloced and the payload is copied.
+ * A slot of a slab run is kept as long as the new size fits in it.
+ * Huge blocks are resized by memlib, which moves their pages if needed.
+ *
+ * A block which has been grown is marked by the grow bit. If it has to
+ * move again, it is over-allocated by a factor (see
+ * realloc_headroom_shift), and it keeps this headroom when it is resized
+ * in place, so that the next growth is likely to be served without
+ * copying. Only the slack exceeding the headroom is returned to the free
+ * list.
  */
-void *realloc(void *ptr, size_t size) {
+static void *heap_realloc(void *ptr, size_t size) {
   void *newptr;
-  block_t *block, *block_next;
-  bool next_alloc;
-  size_t asize, block_size;
+  block_t *block, *block_next, *block_prev;
+  run_t *run;
+  bool next_alloc, grown, was_grown;
+  size_t asize, block_size, next_size, prev_size, target, headroom;
 
   // If ptr is NULL, then equivalent to malloc
   if (ptr == NULL) {
-    return malloc(size);
+    return heap_malloc(size);
   }
   // If size == 0, free memory and return NULL
   if (size == 0) {
-    free(ptr);
+    heap_free(ptr);
+    return NULL;
+  }
+  if (too_large(size))
     return NULL;
+  count(MM_STAT_REALLOC, 1);
+
+  if (is_huge(ptr))
+    return huge_realloc(ptr, size);
+
+  run = slab_run(ptr);
+  if (run != NULL) {
+    block_size = get_slab_size(run->class);
+    if (size <= block_size)
+      return ptr;
+    newptr = heap_malloc(size);
+    if (newptr == NULL)
+      return NULL;
+    memcpy(newptr, ptr, block_size);
+    slab_free(run, ptr);
+    return newptr;
+  }
+
+  // A block growing past the threshold moves to a mapped area
+  if (size >= huge_threshold) {
+    newptr = huge_malloc(size);
+    if (newptr == NULL)
+      return NULL;
+    memcpy(newptr, ptr, get_payload_size(payload_to_header(ptr)));
+    heap_free(ptr);
+    return newptr;
   }
 
   newptr = NULL;
@@ -431,82 +1005,765 @@ void *realloc(void *ptr, size_t size) {
     asize = min_block_size;
 
   block_size = get_size(block);
-  if (!next_alloc) {
-    // Sum up the size with the next free block if exists
+  // Record the growth history of the block
+  was_grown = block->header & grow_mask;
+  grown = was_grown || asize > block_size;
+  // Sum up the size with the next/prev free blocks if exist
+  next_size = next_alloc ? 0 : get_size(block_next);
+  block_prev = get_prev_alloc(block) ? NULL : find_prev(block);
+  prev_size = block_prev ? get_size(block_prev) : 0;
+
+  if (block_size + next_size >= asize) {
+    // The current block is large enough to be reallocated
+    if (!next_alloc)
+      // Coalesce with the next free block
+      free_remove(block_next);
+    block_size += next_size;
+    count(MM_STAT_REALLOC_NEXT, 1);
+  } else if (get_size(next_alloc ? block_next : find_next(block_next)) == 0) {
+    // The block (with its free neighbor) is the last one before the
+    // epilogue, grow the heap by the missing bytes only. The new space
+    // is coalesced with the next free block if exists.
+    block_next = extend_heap(asize - block_size - next_size);
+    if (block_next == NULL)
+      // no more space
+      return NULL;
+    free_remove(block_next);
     block_size += get_size(block_next);
-  }
-  if (block_size < asize) {
+    count(MM_STAT_REALLOC_EXTEND, 1);
+  } else if (prev_size + block_size + next_size >= asize) {
+    // Absorb the previous free block, then move the payload down to it
+    free_remove(block_prev);
+    if (!next_alloc)
+      free_remove(block_next);
+    memmove(block_prev->payload, ptr, get_payload_size(block));
+    block_size += prev_size + next_size;
+    block = block_prev;
+    count(MM_STAT_REALLOC_PREV, 1);
+  } else {
     // The current block pointed by ptr cannot satisfy the new size
-    // malloc the new one
-    newptr = malloc(size);
+    // malloc the new one, with headroom if it has been grown before
+    headroom = was_grown ? get_headroom(asize) : 0;
+    if (headroom > SIZE_MAX - size)
+      headroom = 0;
+    newptr = heap_malloc(size + headroom);
     if (newptr == NULL)
       // no more space
       return NULL;
     // Copy the content
     memcpy(newptr, ptr, get_payload_size(block));
-    free(ptr);
-  } else {
-    // The current block is large enough to be reallocated
-    if (!next_alloc)
-      // Coalesce with the next free block
-      free_remove(block_next);
-    // Update the size
-    write_header(block, block_size, true, get_prev_alloc(block),
-                 get_prev_min(block));
-    // Split the block if too large
-    split_block(block, asize);
-    newptr = block->payload;
+    heap_free(ptr);
+    count(MM_STAT_REALLOC_MOVE, 1);
+    // Slots have no header to mark, the word before one is its neighbor's
+    if (!is_huge(newptr) && slab_run(newptr) == NULL)
+      payload_to_header(newptr)->header |= grow_mask;
+    return newptr;
   }
+
+  // Update the size
+  write_header(block, block_size, true, get_prev_alloc(block),
+               get_prev_min(block));
+  // Split the block if too large, a block grown before keeps its headroom
+  target = was_grown ? asize + get_headroom(asize) : asize;
+  split_block(block, target < block_size ? target : block_size);
+  if (grown)
+    block->header |= grow_mask;
+  newptr = block->payload;
   return newptr;
 }
 
 /*
- * Malloc <elements * size> bytes, with all set to 0
+ * Malloc <size> bytes whose payload is aligned to <align>, a power of two
+ * larger than dsize. The block is over-allocated by the largest possible
+ * gap, then the free space before and after the aligned block is returned
+ * to the heap. It is always a heap block, whatever its size, as slots and
+ * huge blocks have payloads at fixed offsets.
  */
-void *calloc(size_t elements, size_t size) {
+static void *heap_memalign(size_t align, size_t size) {
+  block_t *block, *block_next;
+  size_t asize, block_size, gap;
   void *bp;
-  size_t asize = elements * size;
+  mem m;
 
-  if (asize / elements != size) {
-    // Multiplication overflowed
+  asize = round_up(size + wsize, dsize);
+  if (asize < min_block_size)
+    asize = min_block_size;
+  // Payloads are aligned to dsize, so the gap is a multiple of dsize, and
+  // a block of its size can be placed in it. The gap is smaller than align.
+  bp = heap_place(asize + align);
+  if (bp == NULL)
     return NULL;
-  }
+  block = payload_to_header(bp);
+  block_size = get_size(block);
 
-  bp = malloc(asize);
-  if (bp == NULL) {
-    return NULL;
+  m.ptr = bp;
+  gap = (align - (m.addr & (align - 1))) & (align - 1);
+  if (gap > 0) {
+    // The aligned block starts after the gap, which becomes free
+    block_next = (block_t *)((char *)block + gap);
+    write_header(block_next, block_size - gap, true, false,
+                 gap == min_block_size);
+    write_header(block, gap, false, get_prev_alloc(block),
+                 get_prev_min(block));
+    write_footer(block, gap, false);
+    coalesce_block(block);
+    block = block_next;
+    block_size -= gap;
   }
 
-  // Initialize all bits to 0
-  memset(bp, 0, asize);
-
-  return bp;
+  if (block_size - asize >= min_block_size) {
+    // The free space after the aligned block may be coalesced with the
+    // next block, the remainder of heap_malloc
+    write_header(block, asize, true, get_prev_alloc(block),
+                 get_prev_min(block));
+    block_next = find_next(block);
+    write_header(block_next, block_size - asize, false, true,
+                 asize == min_block_size);
+    write_footer(block_next, block_size - asize, false);
+    coalesce_block(block_next);
+  } else {
+    write_prev_flags(find_next(block), true, block_size == min_block_size);
+  }
+  return header_to_payload(block);
 }
 
-/******** The remaining content below are helper and debug routines ********/
+#ifdef THREAD_SAFE
 
 /*
- * Extend the heap if the current one is not big enough
+ * The thread-safe build. Every thread is assigned to an arena, and the
+ * heap routines above run on the arena of the calling thread under its
+ * lock. Threads are spread round-robin over up to MAX_ARENAS arenas, each
+ * one in its own memlib region, so the contention drops as threads are
+ * added. Once the region of an arena is exhausted, its threads allocate
+ * from the other arenas, which still have room.
+ *
+ * In front of its arena, every thread caches the small blocks (up to
+ * fast_max bytes) and the slots it frees, and serves its small mallocs from
+ * them without taking the lock. An empty bin is refilled with cache_batch
+ * blocks, and a full bin returns half of its blocks, under one lock each.
+ *
+ * A block freed by a thread of another arena is pushed onto the lock-free
+ * remote queue of its owner, which returns it to its heap the next time
+ * the lock is taken. The owner of a block is found by its address, as the
+ * arenas live in disjoint regions.
+ *
+ * The headers of allocated blocks are never written without the lock of
+ * their arena, as the heap may update their prev flags concurrently.
  */
-static block_t *extend_heap(size_t size) {
-  void *bp;
 
-  // Allocate an even number of words to maintain alignment
-  size = round_up(size, dsize);
-  if ((bp = mem_sbrk(size)) == (void *)-1) {
+/*
+ * Malloc <size> bytes, small sizes are served by the thread cache
+ */
+void *malloc(size_t size) {
+  cache_t *c = cache_get();
+  block_t *block;
+  unsigned class;
+  size_t asize;
+
+  if (too_large(size))
     return NULL;
-  }
+  asize = round_up(size + wsize, dsize);
+  if (size == 0 || asize > fast_max)
+    return arena_alloc(dsize, size);
 
-  /*
-   * The new un-allocated block's start is pointed by bp now
-   */
+  if (is_slab_size(size)) {
+    // The slab classes have their bins after the fast bins
+    class = fast_classes + get_slab_class(size);
+    size = get_slab_size(get_slab_class(size));
+  } else {
+    class = get_fast_class(asize);
+    size = asize - wsize;
+  }
+  if (c->bins[class] == NULL)
+    cache_refill(c, class, size);
 
-  // Initialize free block header/footer
-  block_t *block = payload_to_header(bp);
-  write_header(block, size, false, get_prev_alloc(block), get_prev_min(block));
-  write_footer(block, size, false);
+  block = c->bins[class];
+  if (block == NULL)
+    return NULL;
+  c->bins[class] = fast_next(block);
+  c->counts[class]--;
+  return header_to_payload(block);
+}
 
-  // Create new epilogue header
+/*
+ * Free <bp>, small blocks are kept by the thread cache, large blocks of
+ * other arenas are sent back to their owner, and huge blocks are unmapped
+ */
+void free(void *bp) {
+  cache_t *c;
+  arena_t *owner;
+  block_t *block;
+  node_t node;
+  unsigned class;
+  size_t size;
+
+  if (bp == NULL)
+    return;
+
+  // Huge blocks belong to no arena
+  if (is_huge(bp)) {
+    huge_free(payload_to_header(bp));
+    return;
+  }
+
+  c = cache_get();
+  block = payload_to_header(bp);
+  class = map_lookup(bp);
+  if (class != 0) {
+    // The page map gives the slab class of the slot
+    class = fast_classes + class - 1;
+  } else {
+    // The prev flags may be updated concurrently under the lock
+    size = extract_size(__atomic_load_n(&block->header, __ATOMIC_RELAXED));
+    if (size > fast_max) {
+      owner = arena_of(block);
+      if (owner != arena) {
+        arena_remote_free(owner, block);
+        return;
+      }
+      arena_lock();
+      heap_free(bp);
+      arena_unlock();
+      return;
+    }
+    class = get_fast_class(size);
+  }
+
+  node.ptr = block->payload;
+  node.link->next = c->bins[class];
+  c->bins[class] = block;
+  if (++c->counts[class] > cache_max)
+    cache_flush(c, class, cache_max / 2);
+}
+
+/*
+ * Reallocate <ptr> to <size> bytes in the arena owning it
+ */
+void *realloc(void *ptr, size_t size) {
+  void *newptr;
+  arena_t *self;
+  run_t *run;
+  size_t copy = 0;
+
+  if (ptr == NULL)
+    return malloc(size);
+  if (size == 0) {
+    free(ptr);
+    return NULL;
+  }
+  cache_get();
+  self = arena;
+  // A huge block shrinking below the threshold moves to the caller's arena
+  if (!is_huge(ptr))
+    arena = arena_of(payload_to_header(ptr));
+  arena_lock();
+  newptr = heap_realloc(ptr, size);
+  if (newptr == NULL && !is_huge(ptr)) {
+    run = slab_run(ptr);
+    copy = run ? get_slab_size(run->class)
+               : get_payload_size(payload_to_header(ptr));
+  }
+  arena_unlock();
+  arena = self;
+
+  // The region of the owner is exhausted, move the block to another arena
+  if (newptr == NULL && copy > 0 && !too_large(size)) {
+    newptr = arena_alloc(dsize, size);
+    if (newptr != NULL) {
+      memcpy(newptr, ptr, copy < size ? copy : size);
+      free(ptr);
+    }
+  }
+  return newptr;
+}
+
+/*
+ * Assign the calling thread to the next arena round-robin, the arena is
+ * created if it does not exist yet. The heap is initialized by the first
+ * thread.
+ */
+static void arena_assign(void) {
+  unsigned long i;
+  int region;
+
+  pthread_mutex_lock(&arenas_lock);
+  if (num_arenas == 0)
+    mm_init();
+  i = arena_next++ % MAX_ARENAS;
+  arena = NULL;
+  if (i >= (unsigned long)num_arenas) {
+    // Carving a region changes the limit of the memlib heap (region 0)
+    pthread_mutex_lock(&arenas[0]->lock);
+    region = mem_region_create();
+    pthread_mutex_unlock(&arenas[0]->lock);
+    if (region >= 0 && arena_create(region) != NULL) {
+      arenas[num_arenas] = arena;
+      __atomic_store_n(&num_arenas, num_arenas + 1, __ATOMIC_RELEASE);
+    } else {
+      arena = NULL;
+    }
+  }
+  if (arena == NULL)
+    arena = arenas[i % num_arenas];
+  pthread_mutex_unlock(&arenas_lock);
+}
+
+/*
+ * Malloc <size> bytes aligned to <align> from the arena of the calling
+ * thread. Once its region is exhausted, the other arenas are tried in turn
+ * while the heap has room in theirs.
+ */
+static void *arena_alloc(size_t align, size_t size) {
+  arena_t *self = arena;
+  int i, n = __atomic_load_n(&num_arenas, __ATOMIC_ACQUIRE);
+  void *bp;
+
+  arena_lock();
+  bp = align <= dsize ? heap_malloc(size) : heap_memalign(align, size);
+  arena_unlock();
+  for (i = 0; bp == NULL && i < n; i++) {
+    if (arenas[i] == self)
+      continue;
+    arena = arenas[i];
+    arena_lock();
+    bp = align <= dsize ? heap_malloc(size) : heap_memalign(align, size);
+    arena_unlock();
+  }
+  arena = self;
+  return bp;
+}
+
+/*
+ * Returns the arena owning <block>, the one starting the closest below it
+ */
+static arena_t *arena_of(block_t *block) {
+  int i, n = __atomic_load_n(&num_arenas, __ATOMIC_ACQUIRE);
+  arena_t *owner = arenas[0];
+
+  for (i = 1; i < n; i++) {
+    if ((char *)arenas[i] <= (char *)block && arenas[i] > owner)
+      owner = arenas[i];
+  }
+  return owner;
+}
+
+/*
+ * Lock the arena of the calling thread, and return the blocks of its
+ * remote queue to its heap
+ */
+static void arena_lock(void) {
+  block_t *block, *block_next;
+
+  pthread_mutex_lock(&arena->lock);
+  block = __atomic_exchange_n(&arena->remote, NULL, __ATOMIC_ACQUIRE);
+  while (block) {
+    block_next = fast_next(block);
+    heap_free(header_to_payload(block));
+    block = block_next;
+  }
+}
+
+/*
+ * Unlock the arena of the calling thread
+ */
+static void arena_unlock(void) { pthread_mutex_unlock(&arena->lock); }
+
+/*
+ * Push the allocated <block> onto the remote queue of its <owner> arena
+ */
+static void arena_remote_free(arena_t *owner, block_t *block) {
+  node_t node;
+  block_t *head = __atomic_load_n(&owner->remote, __ATOMIC_RELAXED);
+
+  count(MM_STAT_REMOTE_FREE, 1);
+  node.ptr = block->payload;
+  do {
+    node.link->next = head;
+  } while (!__atomic_compare_exchange_n(&owner->remote, &head, block, true,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/*
+ * Returns the cache of the calling thread. The cache is emptied and the
+ * thread is assigned to an arena again if the heap has been reinitialized
+ * since it was used.
+ */
+static cache_t *cache_get(void) {
+  unsigned class;
+
+  if (arena == NULL || cache.epoch != heap_epoch) {
+    for (class = 0; class < CACHE_BINS; class ++) {
+      cache.bins[class] = NULL;
+      cache.counts[class] = 0;
+    }
+#ifdef MM_STATS
+    stats_clear(&cache.stats);
+#endif
+    arena_assign();
+    cache.epoch = heap_epoch;
+  }
+  if (!cache.registered) {
+    // Arm the destructor which flushes the cache when the thread exits
+    pthread_once(&process_once, process_init);
+    pthread_setspecific(cache_key, &cache);
+    cache.registered = true;
+#ifdef MM_STATS
+    pthread_mutex_lock(&arenas_lock);
+    cache.next = caches;
+    caches = &cache;
+    pthread_mutex_unlock(&arenas_lock);
+#endif
+  }
+  return &cache;
+}
+
+/*
+ * Refill the empty bin <class> of <c> with cache_batch blocks for <size>
+ * bytes from the arena
+ */
+static void cache_refill(cache_t *c, unsigned class, size_t size) {
+  unsigned i;
+  block_t *block;
+  node_t node;
+
+  count(MM_STAT_CACHE_REFILL, 1);
+  arena_lock();
+  for (i = 0; i < cache_batch; i++) {
+    node.ptr = heap_malloc(size);
+    if (node.ptr == NULL)
+      break;
+    block = payload_to_header(node.ptr);
+    node.link->next = c->bins[class];
+    c->bins[class] = block;
+    c->counts[class]++;
+  }
+  arena_unlock();
+
+  // The region of the arena is exhausted, take one block from another
+  if (c->counts[class] == 0 && (node.ptr = arena_alloc(dsize, size))) {
+    block = payload_to_header(node.ptr);
+    node.link->next = NULL;
+    c->bins[class] = block;
+    c->counts[class] = 1;
+  }
+}
+
+/*
+ * Return the blocks of the bin <class> of <c> to their arenas, until
+ * <keep> blocks are left
+ */
+static void cache_flush(cache_t *c, unsigned class, unsigned keep) {
+  block_t *block;
+  arena_t *owner;
+
+  count(MM_STAT_CACHE_FLUSH, 1);
+  arena_lock();
+  while (c->counts[class] > keep) {
+    block = c->bins[class];
+    c->bins[class] = fast_next(block);
+    c->counts[class]--;
+    owner = arena_of(block);
+    if (owner == arena)
+      heap_free(header_to_payload(block));
+    else
+      arena_remote_free(owner, block);
+  }
+  arena_unlock();
+}
+
+/*
+ * The destructor of cache_key, the cache of an exiting thread is returned
+ * to the heap
+ */
+static void cache_release(void *arg) {
+  cache_t *c = arg;
+  unsigned class;
+#ifdef MM_STATS
+  cache_t **link;
+#endif
+
+  c->registered = false;
+#ifdef MM_STATS
+  // The counters of the thread outlive it
+  pthread_mutex_lock(&arenas_lock);
+  for (link = &caches; *link != c; link = &(*link)->next)
+    ;
+  *link = c->next;
+  if (c->epoch == heap_epoch)
+    stats_add(&exited_stats, &c->stats);
+  pthread_mutex_unlock(&arenas_lock);
+#endif
+  if (c->epoch != heap_epoch || arena == NULL)
+    return;
+  for (class = 0; class < CACHE_BINS; class ++)
+    cache_flush(c, class, 0);
+}
+
+/*
+ * Create cache_key and register the fork handlers, once per process
+ */
+static void process_init(void) {
+  pthread_key_create(&cache_key, cache_release);
+  pthread_atfork(fork_prepare, fork_release, fork_release);
+}
+
+/*
+ * Take every lock of the heap before fork, so that the child does not
+ * inherit a lock held by a thread which does not exist there. The blocks
+ * cached by the other threads are lost to the child.
+ */
+static void fork_prepare(void) {
+  int i;
+
+  pthread_mutex_lock(&arenas_lock);
+  for (i = 0; i < num_arenas; i++)
+    pthread_mutex_lock(&arenas[i]->lock);
+  pthread_mutex_lock(&huge_lock);
+}
+
+/*
+ * Release the locks taken by fork_prepare, in the parent and the child
+ */
+static void fork_release(void) {
+  int i;
+
+  pthread_mutex_unlock(&huge_lock);
+  for (i = num_arenas - 1; i >= 0; i--)
+    pthread_mutex_unlock(&arenas[i]->lock);
+  pthread_mutex_unlock(&arenas_lock);
+}
+
+#else
+
+/*
+ * Malloc <size> bytes on heap
+ */
+void *malloc(size_t size) { return heap_malloc(size); }
+
+/*
+ * Frees the pointer <bp> previously allocated by malloc
+ */
+void free(void *bp) { heap_free(bp); }
+
+/*
+ * Reallocate the <ptr> to the new <size>
+ */
+void *realloc(void *ptr, size_t size) { return heap_realloc(ptr, size); }
+
+#endif /* def THREAD_SAFE */
+
+/*
+ * Malloc <elements * size> bytes, with all set to 0
+ */
+void *calloc(size_t elements, size_t size) {
+  void *bp;
+  size_t asize = elements * size;
+
+  if (elements != 0 && asize / elements != size) {
+    // Multiplication overflowed
+#ifndef DRIVER
+    errno = ENOMEM;
+#endif
+    return NULL;
+  }
+
+  bp = malloc(asize);
+  if (bp == NULL) {
+    return NULL;
+  }
+
+  // Initialize all bits to 0
+  memset(bp, 0, asize);
+
+  return bp;
+}
+
+#ifndef DRIVER
+
+/*
+ * The rest of the malloc interface, for the shared library (libmm.so)
+ * which replaces the allocator of real programs.
+ */
+
+/*
+ * Malloc <size> bytes aligned to <align>, a power of two. Every payload is
+ * aligned to dsize, larger alignments are carved from the heap by
+ * heap_memalign.
+ */
+static void *aligned_malloc(size_t align, size_t size) {
+  void *bp;
+
+  if (align <= dsize)
+    return malloc(size);
+  if (size > SIZE_MAX / 2 - align) {
+    errno = ENOMEM;
+    return NULL;
+  }
+#ifdef THREAD_SAFE
+  cache_get();
+  bp = arena_alloc(align, size);
+#else
+  if (arena == NULL)
+    mm_init();
+  bp = heap_memalign(align, size);
+#endif
+  // Out of memory, whichever step of heap_memalign failed
+  if (bp == NULL)
+    errno = ENOMEM;
+  return bp;
+}
+
+/*
+ * Returns true if <n> is a power of two
+ */
+static bool is_power_of_two(size_t n) { return n != 0 && (n & (n - 1)) == 0; }
+
+/*
+ * Store in <memptr> a block of <size> bytes aligned to <align>, a power of
+ * two multiple of the pointer size. Returns 0, EINVAL or ENOMEM.
+ */
+int posix_memalign(void **memptr, size_t align, size_t size) {
+  void *bp;
+
+  if (!is_power_of_two(align) || align % sizeof(void *) != 0)
+    return EINVAL;
+  bp = aligned_malloc(align, size);
+  if (bp == NULL)
+    return ENOMEM;
+  *memptr = bp;
+  return 0;
+}
+
+/*
+ * Malloc <size> bytes aligned to <align>, a power of two (C11)
+ */
+void *aligned_alloc(size_t align, size_t size) {
+  if (!is_power_of_two(align)) {
+    errno = EINVAL;
+    return NULL;
+  }
+  return aligned_malloc(align, size);
+}
+
+/*
+ * Malloc <size> bytes aligned to <align>, rounded up to a power of two
+ */
+void *memalign(size_t align, size_t size) {
+  size_t n = dsize;
+
+  while (n < align && n <= SIZE_MAX / 2)
+    n *= 2;
+  if (n < align) {
+    errno = EINVAL;
+    return NULL;
+  }
+  return aligned_malloc(n, size);
+}
+
+/*
+ * Malloc <size> bytes aligned to a page
+ */
+void *valloc(size_t size) { return aligned_malloc(mem_pagesize(), size); }
+
+/*
+ * Malloc <size> bytes rounded up to whole pages, aligned to a page
+ */
+void *pvalloc(size_t size) {
+  size_t page = mem_pagesize();
+
+  if (size > SIZE_MAX - page) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  return aligned_malloc(page, round_up(size, page));
+}
+
+/*
+ * Returns the number of bytes usable in the payload <bp>, at least the
+ * size it was requested with
+ */
+size_t malloc_usable_size(void *bp) {
+  block_t *block;
+  run_t *run;
+
+  if (bp == NULL)
+    return 0;
+  block = payload_to_header(bp);
+  if (is_huge(bp))
+    return get_size(block) - dsize;
+#ifdef THREAD_SAFE
+  cache_get();
+#endif
+  run = slab_run(bp);
+  if (run != NULL)
+    return get_slab_size(run->class);
+#ifdef THREAD_SAFE
+  // The prev flags may be updated concurrently under the lock
+  return extract_size(__atomic_load_n(&block->header, __ATOMIC_RELAXED)) -
+         wsize;
+#else
+  return get_payload_size(block);
+#endif
+}
+
+#endif /* ndef DRIVER */
+
+/*
+ * Fill <stats> with the counters of every thread since mm_init. The
+ * counters of the running threads are read without synchronization, they
+ * may be slightly behind.
+ *
+ * returns false, with zero counters, if the allocator is built without
+ * -DMM_STATS.
+ */
+bool mm_stats(mm_stats_t *stats) {
+  stats_clear(stats);
+#ifdef MM_STATS
+#ifdef THREAD_SAFE
+  cache_t *c;
+
+  pthread_mutex_lock(&arenas_lock);
+  stats_add(stats, &exited_stats);
+  for (c = caches; c != NULL; c = c->next) {
+    if (c->epoch == heap_epoch)
+      stats_add(stats, &c->stats);
+  }
+  pthread_mutex_unlock(&arenas_lock);
+#else
+  stats_add(stats, &heap_stats);
+#endif
+  return true;
+#else
+  return false;
+#endif
+}
+
+/******** The remaining content below are helper and debug routines ********/
+
+/*
+ * Extend the heap if the current one is not big enough
+ */
+static block_t *extend_heap(size_t size) {
+  void *bp;
+
+  // Allocate an even number of words to maintain alignment
+  size = round_up(size, dsize);
+  if ((bp = mem_region_sbrk(arena->region, size)) == (void *)-1) {
+    return NULL;
+  }
+  count(MM_STAT_EXTEND, 1);
+  count(MM_STAT_EXTEND_BYTES, size);
+
+  /*
+   * The new un-allocated block's start is pointed by bp now
+   */
+
+  // Initialize free block header/footer
+  block_t *block = payload_to_header(bp);
+  write_header(block, size, false, get_prev_alloc(block), get_prev_min(block));
+  write_footer(block, size, false);
+
+  // Create new epilogue header
   block_t *block_next = find_next(block);
   // prev_alloc and prev_min flags should be marked as false
   // since the fresh extended heap is not used and its size
@@ -519,6 +1776,180 @@ static block_t *extend_heap(size_t size) {
   return block;
 }
 
+/*
+ * The amount of the heap to be extended, which grows geometrically with the
+ * heap size, from chunksize up to chunk_max
+ */
+static size_t get_chunksize(void) {
+  size_t size = round_up(mem_region_size(arena->region) >> chunk_shift, dsize);
+  if (size < chunksize)
+    return chunksize;
+  if (size > chunk_max)
+    return chunk_max;
+  return size;
+}
+
+/*
+ * Shrink the free <block>, the last one of the heap, and lower the break,
+ * if it is more than trim_threshold bytes past the space it keeps
+ */
+static void heap_trim(block_t *block) {
+  size_t size = get_size(block);
+  size_t keep = max(get_chunksize(), trim_threshold);
+
+  if (size < keep + trim_threshold)
+    return;
+  count(MM_STAT_TRIM, 1);
+
+  // The block changes class
+  free_remove(block);
+  write_header(block, keep, false, get_prev_alloc(block), get_prev_min(block));
+  write_footer(block, keep, false);
+  free_add(block);
+
+  // The new epilogue follows the block, the previous one goes with the pages
+  write_header(find_next(block), 0, true, false, false);
+  mem_region_sbrk(arena->region, -(intptr_t)(size - keep));
+}
+
+/*
+ * Release the pages of the free <block> overlapped by the <freed> range of
+ * <size> bytes coalesced into it, except for the header, tree links and
+ * footer of the block, which stay valid
+ */
+static void release_block(block_t *block, block_t *freed, size_t size) {
+  size_t page = mem_pagesize();
+  char *start = block->payload + sizeof(tree_link_t);
+  char *end = (char *)header_to_footer(block);
+
+  // The pages straddling the freed range are free as well, memlib only
+  // releases the whole pages inside the range
+  if ((char *)freed - (page - 1) > start)
+    start = (char *)freed - (page - 1);
+  if ((char *)freed + size + (page - 1) < end)
+    end = (char *)freed + size + (page - 1);
+  mem_release(start, (size_t)(end - start));
+  count(MM_STAT_RELEASE, 1);
+}
+
+/*
+ * Malloc <size> bytes in a memlib mapped area of their own. The header of
+ * the huge block records the size of the area.
+ * Returns NULL if memlib runs out of mapped space.
+ */
+static void *huge_malloc(size_t size) {
+  size_t asize;
+  char *base;
+  block_t *block;
+
+  // The size of the area would wrap around
+  if (size > SIZE_MAX - dsize - huge_align) {
+#ifndef DRIVER
+    errno = ENOMEM;
+#endif
+    return NULL;
+  }
+  asize = round_up(size + dsize, huge_align);
+
+#ifdef THREAD_SAFE
+  pthread_mutex_lock(&huge_lock);
+#endif
+  base = mem_map(asize);
+#ifdef THREAD_SAFE
+  pthread_mutex_unlock(&huge_lock);
+#endif
+  if (base == (void *)-1)
+    return NULL;
+
+  block = (block_t *)(base + wsize);
+  write_header(block, asize, true, true, false);
+  count(MM_STAT_HUGE_MAP, 1);
+  return header_to_payload(block);
+}
+
+/*
+ * Unmap the area of the huge <block>
+ */
+static void huge_free(block_t *block) {
+#ifdef THREAD_SAFE
+  pthread_mutex_lock(&huge_lock);
+#endif
+  mem_unmap((char *)block - wsize, get_size(block));
+#ifdef THREAD_SAFE
+  pthread_mutex_unlock(&huge_lock);
+#endif
+}
+
+/*
+ * Resize the huge block of <ptr> to <size> bytes. Its area is remapped
+ * without copying, and a block shrinking below the threshold goes back to
+ * the heap.
+ */
+static void *huge_realloc(void *ptr, size_t size) {
+  block_t *block = payload_to_header(ptr);
+  size_t asize;
+  char *base;
+  void *newptr;
+
+  if (size < huge_threshold) {
+    newptr = heap_malloc(size);
+    if (newptr == NULL)
+      return NULL;
+    memcpy(newptr, ptr, size);
+    huge_free(block);
+    return newptr;
+  }
+
+  // The size of the area would wrap around
+  if (size > SIZE_MAX - dsize - huge_align) {
+#ifndef DRIVER
+    errno = ENOMEM;
+#endif
+    return NULL;
+  }
+  asize = round_up(size + dsize, huge_align);
+
+#ifdef THREAD_SAFE
+  pthread_mutex_lock(&huge_lock);
+#endif
+  base = mem_remap((char *)block - wsize, get_size(block), asize);
+#ifdef THREAD_SAFE
+  pthread_mutex_unlock(&huge_lock);
+#endif
+  if (base == (void *)-1)
+    return NULL;
+
+  block = (block_t *)(base + wsize);
+  write_header(block, asize, true, true, false);
+  count(MM_STAT_HUGE_REMAP, 1);
+  return header_to_payload(block);
+}
+
+/*
+ * Returns true if <bp> is the payload of a huge block. Only the payloads
+ * at dsize past a huge_align boundary are looked up by memlib.
+ */
+static bool is_huge(void *bp) {
+  mem m;
+
+  m.ptr = bp;
+  return (m.addr & (huge_align - 1)) == dsize && mem_is_mapped(bp);
+}
+
+/*
+ * Returns the last block before the epilogue if it is free, NULL otherwise
+ */
+static block_t *find_last_free(void) {
+  block_t *epilogue =
+      (block_t *)((char *)mem_region_hi(arena->region) + 1 - wsize);
+  if (get_prev_alloc(epilogue))
+    return NULL;
+  if (get_prev_min(epilogue))
+    return (block_t *)((char *)epilogue - min_block_size);
+  return (block_t *)((char *)epilogue -
+                     extract_size(*find_prev_footer(epilogue)));
+}
+
 /*
  * Merge free blocks if adjacents are both free
  */
@@ -542,6 +1973,7 @@ static block_t *coalesce_block(block_t *block) {
 
   if (prev_alloc && next_alloc) // Case 1
   {
+    count(MM_STAT_COALESCE_NONE, 1);
     // Only the current block will be marked with free
     // Add it to the free list
     free_add(block);
@@ -549,6 +1981,7 @@ static block_t *coalesce_block(block_t *block) {
 
   else if (prev_alloc && !next_alloc) // Case 2
   {
+    count(MM_STAT_COALESCE_NEXT, 1);
     // Merge the next block with the current one
     // 1. Remove next from the free list
     // 2. Update the size of the current block
@@ -563,6 +1996,7 @@ static block_t *coalesce_block(block_t *block) {
 
   else if (!prev_alloc && next_alloc) // Case 3
   {
+    count(MM_STAT_COALESCE_PREV, 1);
     // Merge the previous block with the current one
     // 1. Remove prev from the free list
     // 2. Update the size of the previous block
@@ -579,6 +2013,7 @@ static block_t *coalesce_block(block_t *block) {
 
   else // Case 4
   {
+    count(MM_STAT_COALESCE_BOTH, 1);
     // Merge both the previous one and the next one with the current one
     // 1. Remove prev from the free list
     // 2. Remove next from the free list
@@ -599,8 +2034,7 @@ static block_t *coalesce_block(block_t *block) {
   // Free blocks are coalesced, determine if the size is 16 and set
   // prev_min flag in the next block
   block_next = find_next(block);
-  write_header(block_next, get_size(block_next), get_alloc(block_next), false,
-               get_size(block) == min_block_size);
+  write_prev_flags(block_next, false, get_size(block) == min_block_size);
 
   dbg_ensures(!get_alloc(block));
 
@@ -618,6 +2052,7 @@ static void split_block(block_t *block, size_t asize) {
   block_t *block_next;
 
   if ((block_size - asize) >= min_block_size) {
+    count(MM_STAT_SPLIT, 1);
     // Write the new size to the block
     write_header(block, asize, true, get_prev_alloc(block),
                  get_prev_min(block));
@@ -635,16 +2070,14 @@ static void split_block(block_t *block, size_t asize) {
     // splited. Its prev_min flag should also be set if the splited part is
     // mini size.
     block_next = find_next(block_next);
-    write_header(block_next, get_size(block_next), get_alloc(block_next), false,
-                 block_size - asize == min_block_size);
+    write_prev_flags(block_next, false, block_size - asize == min_block_size);
   } else {
     /*
      * The block size is just the mini size.
      * Sets the next block prev_min flag to true
      */
     block_next = find_next(block);
-    write_header(block_next, get_size(block_next), get_alloc(block_next), true,
-                 true);
+    write_prev_flags(block_next, true, true);
   }
   dbg_ensures(get_alloc(block));
 }
@@ -654,16 +2087,29 @@ static void split_block(block_t *block, size_t asize) {
  */
 static block_t *find_fit(size_t asize) {
   unsigned class;
-  unsigned classes = sizeof(free_start) / sizeof(block_t *);
   block_t *block;
   size_t size;
-  unsigned count = 0;
+  unsigned fits = 0;
+  size_t examined = 0;
   block_t *slot = NULL;
-  // Iterate through all free classes to find available ones
-  for (class = get_class(asize); class < classes && !slot; class ++) {
-    block = free_start[class];
+  // Only the non-empty classes which are large enough are visited
+  word_t classes = arena->free_map & (~(word_t)0 << get_class(asize));
+  count(MM_STAT_FIT_SEARCH, 1);
+  // Iterate through the available classes to find the fit
+  while (classes && !slot) {
+    class = __builtin_ctzl(classes);
+    count(MM_STAT_FIT_CLASS, 1);
+    if (class >= tree_class) {
+      // The tree returns the best fit directly, only the first class
+      // can miss since all blocks in the larger classes fit
+      slot = tree_fit(class, asize);
+      classes &= classes - 1;
+      continue;
+    }
+    block = arena->free_start[class];
     while (block) {
       size = get_size(block);
+      examined++;
       // Check if the block can be allocated
       if (asize <= size) {
         // The block can be allocated
@@ -672,28 +2118,311 @@ static block_t *find_fit(size_t asize) {
           // Assign that to the return val
           slot = block;
         }
-        count++;
+        fits++;
       }
-      // Check if the current max best fit search has reached
-      if (count >= max_search)
-        return slot;
+      // Check if the current max best fit search has reached, a fit has
+      // been found then, so the search ends
+      if (fits >= max_search)
+        break;
       // Jump to the next block in the free list
       block = free_next(block);
     }
+    // Drop the visited class from the candidates
+    classes &= classes - 1;
   }
+  count(MM_STAT_FIT_BLOCK, examined);
+  if (slot == NULL)
+    count(MM_STAT_FIT_MISS, 1);
   return slot;
 }
 
+/*
+ * Push the freed small <block> into its fast bin. The block keeps
+ * its allocated flag, therefore its neighbors never coalesce with it.
+ */
+static void fast_push(block_t *block) {
+  dbg_requires(get_alloc(block));
+  node_t node;
+  size_t size = get_size(block);
+  unsigned class = get_fast_class(size);
+
+  // The growth history does not survive the reuse of the block
+  block->header &= ~grow_mask;
+  node.ptr = block->payload;
+  node.link->next = arena->fast_start[class];
+  arena->fast_start[class] = block;
+  arena->fast_bytes += size;
+}
+
+/*
+ * Pop a block of exactly <asize> bytes from its fast bin.
+ * Returns NULL if the bin is empty.
+ */
+static block_t *fast_pop(size_t asize) {
+  unsigned class = get_fast_class(asize);
+  block_t *block = arena->fast_start[class];
+
+  if (block != NULL) {
+    arena->fast_start[class] = fast_next(block);
+    arena->fast_bytes -= asize;
+  }
+  return block;
+}
+
+/*
+ * Empty all fast bins: every block is marked as free and coalesced
+ * with its neighbors into the segregated list.
+ */
+static void fast_flush(void) {
+  unsigned class;
+  block_t *block, *block_next;
+  size_t size;
+
+  count(MM_STAT_FAST_FLUSH, 1);
+
+  for (class = 0; class < fast_classes; class ++) {
+    block = arena->fast_start[class];
+    while (block) {
+      block_next = fast_next(block);
+      size = get_size(block);
+      write_header(block, size, false, get_prev_alloc(block),
+                   get_prev_min(block));
+      write_footer(block, size, false);
+      coalesce_block(block);
+      block = block_next;
+    }
+    arena->fast_start[class] = NULL;
+  }
+  arena->fast_bytes = 0;
+}
+
+/*
+ * Malloc a slot for <size> bytes from a run of its slab class.
+ * Returns NULL if there is no free slot and no run can be created.
+ */
+static void *slab_malloc(size_t size) {
+  unsigned class = get_slab_class(size);
+  run_t *run = arena->runs[class];
+  unsigned i = 0;
+  word_t bits;
+
+  if (run == NULL) {
+    run = run_create(class);
+    if (run == NULL)
+      return NULL;
+  }
+
+  // Take the first free slot
+  while (run->free_bits[i] == 0)
+    i++;
+  bits = run->free_bits[i];
+  run->free_bits[i] = bits & (bits - 1);
+
+  // A full run leaves the list of its class until a slot is freed
+  if (--run->free_count == 0)
+    run_remove(run);
+  return run_slot(run, i * 64 + __builtin_ctzl(bits));
+}
+
+/*
+ * Return the slot <bp> to its <run>. An empty run goes back to the heap.
+ */
+static void slab_free(run_t *run, void *bp) {
+  size_t offset = (char *)bp - run_slot(run, 0);
+  unsigned slot = offset / get_slab_size(run->class);
+  word_t bit = (word_t)1 << (slot % 64);
+
+  // The slot is already free
+  if (run->free_bits[slot / 64] & bit)
+    return;
+  run->free_bits[slot / 64] |= bit;
+
+  if (run->free_count++ == 0) {
+    run_push(run);
+  } else if (run->free_count == get_run_slots(run->class)) {
+    run_remove(run);
+    map_set(run, 0);
+    heap_free(run);
+  }
+}
+
+/*
+ * Returns the run holding the slot <bp>, or NULL if <bp> is not a slot
+ */
+static run_t *slab_run(void *bp) {
+  mem m;
+
+  if (map_lookup(bp) == 0)
+    return NULL;
+  m.ptr = bp;
+  m.addr &= ~(long)(run_size - 1);
+  return (run_t *)m.ptr;
+}
+
+/*
+ * Create a run of <class> with all its slots free on the heap, and add it
+ * to the list of the class. Returns NULL if the heap runs out of memory.
+ */
+static run_t *run_create(unsigned class) {
+  run_t *run;
+  unsigned i, slots = get_run_slots(class);
+
+  run = heap_memalign(run_size, run_size - wsize);
+  if (run == NULL)
+    return NULL;
+  count(MM_STAT_RUN_CREATE, 1);
+  if (!map_set(run, class + 1)) {
+    heap_free(run);
+    return NULL;
+  }
+
+  run->class = class;
+  run->free_count = slots;
+  for (i = 0; i < RUN_WORDS; i++) {
+    if (slots >= (i + 1) * 64)
+      run->free_bits[i] = ~(word_t)0;
+    else if (slots > i * 64)
+      run->free_bits[i] = ((word_t)1 << (slots - i * 64)) - 1;
+    else
+      run->free_bits[i] = 0;
+  }
+  run_push(run);
+  return run;
+}
+
+/*
+ * Add the <run> to the front of the list of its class
+ */
+static void run_push(run_t *run) {
+  run_t *run_next = arena->runs[run->class];
+
+  run->next = run_next;
+  run->prev = NULL;
+  if (run_next != NULL)
+    run_next->prev = run;
+  arena->runs[run->class] = run;
+}
+
+/*
+ * Remove the <run> from the list of its class
+ */
+static void run_remove(run_t *run) {
+  if (run->prev != NULL)
+    run->prev->next = run->next;
+  else
+    arena->runs[run->class] = run->next;
+  if (run->next != NULL)
+    run->next->prev = run->prev;
+}
+
+/*
+ * Returns the page map entry of the page of <bp> in the arena owning it:
+ * the slab class of its run plus one, or 0 if the page holds no run
+ */
+static unsigned map_lookup(void *bp) {
+#ifdef THREAD_SAFE
+  // The maps of other arenas are read without their lock, the nodes are
+  // published once initialized
+  arena_t *owner = arena_of(payload_to_header(bp));
+  map_node_t *node = __atomic_load_n(&owner->page_map, __ATOMIC_ACQUIRE);
+#else
+  arena_t *owner = arena;
+  map_node_t *node = owner->page_map;
+#endif
+  size_t page = ((char *)bp - (char *)owner) / run_size;
+
+  if (node == NULL || (char *)bp < (char *)owner ||
+      page >= get_map_pages(node->level))
+    return 0;
+  while (node != NULL && node->level > 0)
+    node = map_child(node, page);
+  if (node == NULL)
+    return 0;
+#ifdef THREAD_SAFE
+  return __atomic_load_n(&node->classes[page & ((1 << map_leaf_shift) - 1)],
+                         __ATOMIC_RELAXED);
+#else
+  return node->classes[page & ((1 << map_leaf_shift) - 1)];
+#endif
+}
+
+/*
+ * Set the page map <entry> of the page of <run>, the missing nodes are
+ * created on the way. Returns false if the heap runs out of memory.
+ */
+static bool map_set(run_t *run, unsigned entry) {
+  size_t page = ((char *)run - (char *)arena) / run_size;
+  map_node_t *node = arena->page_map;
+  map_node_t *child;
+  unsigned i;
+
+  // Grow the tree at the root until it covers the page
+  while (node == NULL || page >= get_map_pages(node->level)) {
+    child = node;
+    node = map_node_create(child == NULL ? 0 : child->level + 1);
+    if (node == NULL)
+      return false;
+    if (child != NULL)
+      node->children[0] = child;
+#ifdef THREAD_SAFE
+    __atomic_store_n(&arena->page_map, node, __ATOMIC_RELEASE);
+#else
+    arena->page_map = node;
+#endif
+  }
+
+  while (node->level > 0) {
+    child = map_child(node, page);
+    if (child == NULL) {
+      child = map_node_create(node->level - 1);
+      if (child == NULL)
+        return false;
+      i = (page / get_map_pages(node->level - 1)) &
+          ((1 << map_inner_shift) - 1);
+#ifdef THREAD_SAFE
+      __atomic_store_n(&node->children[i], child, __ATOMIC_RELEASE);
+#else
+      node->children[i] = child;
+#endif
+    }
+    node = child;
+  }
+
+#ifdef THREAD_SAFE
+  __atomic_store_n(&node->classes[page & ((1 << map_leaf_shift) - 1)], entry,
+                   __ATOMIC_RELAXED);
+#else
+  node->classes[page & ((1 << map_leaf_shift) - 1)] = entry;
+#endif
+  return true;
+}
+
+/*
+ * Allocate an empty page map node of <level> on the heap.
+ * Returns NULL if the heap runs out of memory.
+ */
+static map_node_t *map_node_create(unsigned level) {
+  size_t size = level > 0 ? sizeof(map_node_t *) << map_inner_shift
+                          : (size_t)1 << map_leaf_shift;
+  map_node_t *node = heap_malloc(sizeof(map_node_t) + size);
+
+  if (node == NULL)
+    return NULL;
+  memset(node, 0, sizeof(map_node_t) + size);
+  node->level = level;
+  return node;
+}
+
 /*
  * Heap Consistency Checker
  */
 bool mm_checkheap(int line) {
-  word_t *prologue = find_prev_footer(heap_start);
+  word_t *prologue = find_prev_footer(arena->heap_start);
   word_t *epilogue;
-  block_t *block = heap_start;
+  block_t *block = arena->heap_start;
   block_t *block_prev = NULL;
   long free_counts = 0;
-  unsigned i, len = sizeof(free_start) / sizeof(block_t *);
+  unsigned i;
 
   // Prologue should be allocated, and marked the start of the heap
   if (!check_prologue_epilogue(prologue))
@@ -725,6 +2454,10 @@ bool mm_checkheap(int line) {
     // Check if prev alloc flag is set correctly
     if (block_prev && get_alloc(block_prev) != get_prev_alloc(block))
       return false;
+    // Only free mini blocks use the mini bit (it is the grow bit otherwise)
+    if (!get_alloc(block) && (bool)(block->header & mini_mask) !=
+                                 (get_size(block) == min_block_size))
+      return false;
     // Count free blocks
     if (!get_alloc(block))
       free_counts++;
@@ -737,10 +2470,23 @@ bool mm_checkheap(int line) {
   if (!check_prologue_epilogue(epilogue))
     return false;
 
+  // The free list and fast bin tables should sit right before the prologue
+  if ((char *)prologue != (char *)(arena->fast_start + fast_classes))
+    return false;
+
   // Check if there is a circle in the free list
-  for (i = 0; i < len; i++) {
+  for (i = 0; i < seg_classes; i++) {
+    // The bitmap should agree with the list head
+    if (free_empty(i) == (bool)((arena->free_map >> i) & 1))
+      return false;
+    // The large classes are checked by walking the tree in order
+    if (i >= tree_class) {
+      if (!check_tree(i, &free_counts))
+        return false;
+      continue;
+    }
     // Iterate through the segregated list
-    block = free_start[i];
+    block = arena->free_start[i];
     while (block) {
       free_counts--;
       // Check the boundary
@@ -756,13 +2502,115 @@ bool mm_checkheap(int line) {
       if (get_alloc(block))
         return false;
 
-      block = free_next(block);
+      block = free_next(block);
+    }
+  }
+  // Check if there are some free blocks not added into the free list
+  if (free_counts > 0)
+    return false;
+
+  // Check the fast bins, their blocks keep the allocated flag
+  size_t fast_counts = 0;
+  for (i = 0; i < fast_classes; i++) {
+    block = arena->fast_start[i];
+    while (block) {
+      if (!is_in_range(block) || !get_alloc(block) ||
+          (block->header & grow_mask))
+        return false;
+      // Check if the block belongs to the right bin
+      if (get_fast_class(get_size(block)) != i)
+        return false;
+      fast_counts += get_size(block);
+      // The bins cannot hold more bytes than accounted for
+      if (fast_counts > arena->fast_bytes)
+        return false;
+      block = fast_next(block);
+    }
+  }
+  if (fast_counts != arena->fast_bytes)
+    return false;
+
+  // Check the slab runs
+  return check_slab();
+}
+
+/*
+ * Fill <shape> with the blocks of every arena, for profiling the
+ * fragmentation of the heap. The blocks cached by the threads count as
+ * allocated.
+ *
+ * returns false if the heap is not initialized.
+ */
+bool mm_heap_shape(mm_shape_t *shape) {
+  memset(shape, 0, sizeof(*shape));
+#ifdef THREAD_SAFE
+  arena_t *self = arena;
+  int i;
+
+  pthread_mutex_lock(&arenas_lock);
+  for (i = 0; i < num_arenas; i++) {
+    arena = arenas[i];
+    pthread_mutex_lock(&arena->lock);
+    shape_arena(shape);
+    pthread_mutex_unlock(&arena->lock);
+  }
+  pthread_mutex_unlock(&arenas_lock);
+  arena = self;
+  return i > 0;
+#else
+  if (arena == NULL)
+    return false;
+  shape_arena(shape);
+  return true;
+#endif
+}
+
+/*
+ * Add the blocks of the current arena to <shape>: its heap is walked as by
+ * mm_checkheap, then the blocks of its fast bins move from the allocated to
+ * the fast counts.
+ */
+static void shape_arena(mm_shape_t *shape) {
+  block_t *block = arena->heap_start;
+  run_t *run;
+  size_t size;
+  unsigned i, class;
+
+  while ((size = get_size(block)) > 0) {
+    shape->heap_bytes += size;
+    if (get_alloc(block)) {
+      shape->alloc_blocks++;
+      shape->alloc_bytes += size;
+      shape->header_bytes += wsize;
+      // The payload of a run starts with its header, and its page is mapped
+      if (map_lookup(block->payload) != 0) {
+        run = (run_t *)block->payload;
+        shape->header_bytes += sizeof(run_t);
+        shape->slot_free_bytes += run->free_count * get_slab_size(run->class);
+      }
+    } else {
+      class = get_block_class(block);
+      shape->free_blocks++;
+      shape->free_bytes += size;
+      shape->largest_free = max(shape->largest_free, size);
+      if (class < MM_CLASSES) {
+        shape->class_blocks[class]++;
+        shape->class_bytes[class] += size;
+      }
+    }
+    block = find_next(block);
+  }
+
+  for (i = 0; i < fast_classes; i++) {
+    for (block = arena->fast_start[i]; block; block = fast_next(block)) {
+      size = get_size(block);
+      shape->alloc_blocks--;
+      shape->alloc_bytes -= size;
+      shape->header_bytes -= wsize;
+      shape->fast_blocks++;
+      shape->fast_bytes += size;
     }
   }
-  // Check if there are some free blocks not added into the free list
-  if (free_counts > 0)
-    return false;
-  return true;
 }
 
 /*
@@ -794,6 +2642,38 @@ bool mm_checkheap(int line) {
  *****************************************************************************
  */
 
+/*
+ * count: adds n to the counter stat of the calling thread, if the allocator
+ *        is built with -DMM_STATS, and does nothing otherwise.
+ */
+static void count(unsigned stat, size_t n) {
+#ifdef MM_STATS
+#ifdef THREAD_SAFE
+  cache.stats.counts[stat] += n;
+#else
+  heap_stats.counts[stat] += n;
+#endif
+#endif
+}
+
+/*
+ * stats_clear: sets every counter of stats to 0.
+ */
+static void stats_clear(mm_stats_t *stats) {
+  unsigned i;
+  for (i = 0; i < MM_STAT_COUNT; i++)
+    stats->counts[i] = 0;
+}
+
+/*
+ * stats_add: adds the counters of stats to those of sum.
+ */
+static void stats_add(mm_stats_t *sum, const mm_stats_t *stats) {
+  unsigned i;
+  for (i = 0; i < MM_STAT_COUNT; i++)
+    sum->counts[i] += stats->counts[i];
+}
+
 /*
  * max: returns x if x > y, and y otherwise.
  */
@@ -806,6 +2686,20 @@ static size_t round_up(size_t size, size_t n) {
   return n * ((size + (n - 1)) / n);
 }
 
+/*
+ * too_large: returns true if <size> bytes cannot be served, as adding the
+ *            header and rounding up would wrap around. The request fails
+ *            with ENOMEM outside the driver.
+ */
+static bool too_large(size_t size) {
+  if (size <= SIZE_MAX - 2 * dsize)
+    return false;
+#ifndef DRIVER
+  errno = ENOMEM;
+#endif
+  return true;
+}
+
 /*
  * pack: returns a header reflecting a specified size and its alloc status.
  *       If the block is allocated, the lowest bit is set to 1, and 0 otherwise.
@@ -820,9 +2714,13 @@ static word_t pack(size_t size, bool alloc, bool prev_alloc, bool prev_min) {
 
 /*
  * extract_size: returns the size of a given header value based on the header
- *               specification above.
+ *               specification above. A free mini block header stores a
+ *               pointer in place of the size, which is always 16.
  */
-static size_t extract_size(word_t word) { return (word & size_mask); }
+static size_t extract_size(word_t word) {
+  return (word & (mini_mask | alloc_mask)) == mini_mask ? min_block_size
+                                                         : (word & size_mask);
+}
 
 /*
  * get_size: returns the size of a given block by clearing the lowest 4 bits
@@ -889,6 +2787,31 @@ static void write_header(block_t *block, size_t size, bool alloc,
   block->header = pack(size, alloc, prev_alloc, prev_min);
 }
 
+/*
+ * write_prev_flags: updates the prev_alloc and prev_min flags of a block
+ *                   header, keeping the rest of the header unchanged.
+ */
+static void write_prev_flags(block_t *block, bool prev_alloc, bool prev_min) {
+  dbg_requires(block != NULL);
+  word_t header = block->header & ~(prev_alloc_mask | prev_min_mask);
+  header = prev_alloc ? header | prev_alloc_mask : header;
+  header = prev_min ? header | prev_min_mask : header;
+#ifdef THREAD_SAFE
+  // The owner of the allocated block may read its size without the lock
+  __atomic_store_n(&block->header, header, __ATOMIC_RELAXED);
+#else
+  block->header = header;
+#endif
+}
+
+/*
+ * get_headroom: returns the extra bytes a grown block of <asize> bytes
+ *               may keep beyond its size.
+ */
+static size_t get_headroom(size_t asize) {
+  return round_up(asize >> realloc_headroom_shift, dsize);
+}
+
 /*
  * write_footer: given a block and its size and allocation status,
  *               writes an appropriate value to the block footer by first
@@ -992,7 +2915,13 @@ static void free_add(block_t *block) {
     return;
 
   class = get_block_class(block);
-  block_next = free_start[class];
+  if (class >= tree_class) {
+    // Large blocks are indexed by the tree of their class
+    tree_insert(class, block);
+    arena->free_map |= (word_t)1 << class;
+    return;
+  }
+  block_next = arena->free_start[class];
   size = get_size(block);
 
   // Connect the new block with the free list head
@@ -1001,8 +2930,9 @@ static void free_add(block_t *block) {
   set_free_next(block_prev, block);
   set_free_prev(block, block_prev);
 
-  // Reset the head of the list
-  free_start[class] = block;
+  // Reset the head of the list, the class is not empty anymore
+  arena->free_start[class] = block;
+  arena->free_map |= (word_t)1 << class;
 }
 
 /*
@@ -1017,15 +2947,23 @@ static void free_remove(block_t *block) {
     return;
 
   class = get_block_class(block);
-  block_next = free_next(block);
-  block_prev = free_prev(block);
+  if (class >= tree_class) {
+    tree_remove(class, block);
+  } else {
+    block_next = free_next(block);
+    block_prev = free_prev(block);
+
+    // Disconnect and Reconnect free pointers
+    set_free_prev(block_next, block_prev);
+    set_free_next(block_prev, block_next);
 
-  // Disconnect and Reconnect free pointers
-  set_free_prev(block_next, block_prev);
-  set_free_next(block_prev, block_next);
+    if (block == arena->free_start[class])
+      arena->free_start[class] = block_next;
+  }
 
-  if (block == free_start[class])
-    free_start[class] = block_next;
+  // Clear the class in the bitmap once its list becomes empty
+  if (free_empty(class))
+    arena->free_map &= ~((word_t)1 << class);
 }
 
 /*********************************************************************/
@@ -1049,8 +2987,9 @@ static block_t *free_prev(block_t *block) {
   if (!block || get_alloc(block))
     return NULL;
   if (get_size(block) <= min_block_size) {
-    // Switch to tiny version
-    return free_prev_mini(block);
+    // The mini block keeps the previous free payload in its header
+    node.ptr = (char *)(block->header & size_mask);
+    return node.ptr ? payload_to_header(node.ptr) : NULL;
   } else {
     node.ptr = block->payload;
     return node.link->prev;
@@ -1074,47 +3013,358 @@ static void set_free_next(block_t *block, block_t *block_next) {
  */
 static void set_free_prev(block_t *block, block_t *block_prev) {
   node_t node;
-  // The mini block cannot hold the previous free pointer
-  if (!block || get_size(block) <= min_block_size)
+  if (!block)
+    return;
+  if (get_size(block) <= min_block_size) {
+    // The mini block cannot hold the previous free pointer in its payload,
+    // the (aligned) payload address is stored in the header with the flags
+    node.ptr = block_prev ? block_prev->payload : NULL;
+    block->header = (word_t)node.ptr | mini_mask | (block->header & flag_mask);
     return;
+  }
   node.ptr = block->payload;
   node.link->prev = block_prev;
 }
 
+/*********************************************************************/
+
 /*
- * Mini free blocks do not have the previous free pointer.
- * This function iterate through the free list to find
- * the previous free block corresponds to the current one
+ * The large classes are splay trees ordered by (size, address), adapted
+ * from the splay tree used by the driver (stree.c). The root of the tree
+ * is stored in arena->free_start[class].
  */
-static block_t *free_prev_mini(block_t *block) {
-  unsigned class;
-  block_t *itr;
-  block_t *block_prev = NULL;
-  // Only mini free blocks are allowed to use this function
-  if (!block || get_alloc(block) || get_size(block) > min_block_size)
-    return NULL;
-  class = get_block_class(block);
-  itr = free_start[class];
+
+/*
+ * Insert the free <block> into the tree of <class>, and splay it to the root
+ */
+static void tree_insert(unsigned class, block_t *block) {
+  block_t *itr = arena->free_start[class];
+  block_t *parent = NULL;
+
+  // Find the leaf position of the block
+  while (itr) {
+    parent = itr;
+    itr = tree_less(block, itr) ? tree_left(itr) : tree_right(itr);
+  }
+
+  set_tree_left(block, NULL);
+  set_tree_right(block, NULL);
+  set_tree_parent(block, parent);
+  if (!parent)
+    arena->free_start[class] = block;
+  else if (tree_less(block, parent))
+    set_tree_left(parent, block);
+  else
+    set_tree_right(parent, block);
+  tree_splay(class, block);
+}
+
+/*
+ * Remove the <block> from the tree of <class>
+ */
+static void tree_remove(unsigned class, block_t *block) {
+  block_t *left, *right, *succ;
+
+  // Bring the block to the root, then join its two subtrees
+  tree_splay(class, block);
+  left = tree_left(block);
+  right = tree_right(block);
+  if (!left) {
+    tree_replace(class, block, right);
+  } else if (!right) {
+    tree_replace(class, block, left);
+  } else {
+    // The successor takes the place of the removed block
+    succ = tree_min(right);
+    if (tree_parent(succ) != block) {
+      tree_replace(class, succ, tree_right(succ));
+      set_tree_right(succ, right);
+      set_tree_parent(right, succ);
+    }
+    tree_replace(class, block, succ);
+    set_tree_left(succ, left);
+    set_tree_parent(left, succ);
+  }
+}
+
+/*
+ * Find the smallest block in the tree of <class> whose size is greater or
+ * equal to <asize>. Returns NULL if none of them fits.
+ */
+static block_t *tree_fit(unsigned class, size_t asize) {
+  block_t *itr = arena->free_start[class];
+  block_t *last = NULL;
+  block_t *slot = NULL;
+  size_t visited = 0;
+
   while (itr) {
-    if (itr == block)
-      return block_prev;
-    block_prev = itr;
-    itr = free_next(itr);
+    last = itr;
+    visited++;
+    if (get_size(itr) >= asize) {
+      // Fits, but a smaller one may be on the left
+      slot = itr;
+      itr = tree_left(itr);
+    } else {
+      itr = tree_right(itr);
+    }
+  }
+  count(MM_STAT_FIT_NODE, visited);
+  // Splay the visited path, so that the tree stays balanced on average
+  if (slot)
+    tree_splay(class, slot);
+  else if (last)
+    tree_splay(class, last);
+  return slot;
+}
+
+/*
+ * Move the <block> to the root of the tree of <class> by rotations
+ */
+static void tree_splay(unsigned class, block_t *block) {
+  block_t *parent, *grand;
+
+  while ((parent = tree_parent(block)) != NULL) {
+    grand = tree_parent(parent);
+    if (!grand) {
+      // Zig
+      if (tree_left(parent) == block)
+        tree_rotate_right(class, parent);
+      else
+        tree_rotate_left(class, parent);
+    } else if (tree_left(parent) == block && tree_left(grand) == parent) {
+      // Zig-zig
+      tree_rotate_right(class, grand);
+      tree_rotate_right(class, parent);
+    } else if (tree_right(parent) == block && tree_right(grand) == parent) {
+      // Zig-zig
+      tree_rotate_left(class, grand);
+      tree_rotate_left(class, parent);
+    } else if (tree_left(parent) == block) {
+      // Zig-zag
+      tree_rotate_right(class, parent);
+      tree_rotate_left(class, grand);
+    } else {
+      // Zig-zag
+      tree_rotate_left(class, parent);
+      tree_rotate_right(class, grand);
+    }
+  }
+}
+
+/*
+ * Rotate the right child of <block> up to its place
+ */
+static void tree_rotate_left(unsigned class, block_t *block) {
+  block_t *child = tree_right(block);
+
+  set_tree_right(block, tree_left(child));
+  if (tree_left(child))
+    set_tree_parent(tree_left(child), block);
+  tree_replace(class, block, child);
+  set_tree_left(child, block);
+  set_tree_parent(block, child);
+}
+
+/*
+ * Rotate the left child of <block> up to its place
+ */
+static void tree_rotate_right(unsigned class, block_t *block) {
+  block_t *child = tree_left(block);
+
+  set_tree_left(block, tree_right(child));
+  if (tree_right(child))
+    set_tree_parent(tree_right(child), block);
+  tree_replace(class, block, child);
+  set_tree_right(child, block);
+  set_tree_parent(block, child);
+}
+
+/*
+ * Make <block_new> take the place of <block> under the parent of <block>
+ */
+static void tree_replace(unsigned class, block_t *block, block_t *block_new) {
+  block_t *parent = tree_parent(block);
+
+  if (!parent)
+    arena->free_start[class] = block_new;
+  else if (tree_left(parent) == block)
+    set_tree_left(parent, block_new);
+  else
+    set_tree_right(parent, block_new);
+  if (block_new)
+    set_tree_parent(block_new, parent);
+}
+
+/*
+ * Get the smallest block in the subtree of <block>
+ */
+static block_t *tree_min(block_t *block) {
+  while (tree_left(block))
+    block = tree_left(block);
+  return block;
+}
+
+/*
+ * Get the in-order successor of <block>, NULL for the largest block
+ */
+static block_t *tree_next(block_t *block) {
+  block_t *parent;
+
+  if (tree_right(block))
+    return tree_min(tree_right(block));
+  parent = tree_parent(block);
+  while (parent && tree_right(parent) == block) {
+    block = parent;
+    parent = tree_parent(block);
   }
-  return NULL;
+  return parent;
+}
+
+/*
+ * The order of the tree: by size first, then by address
+ */
+static bool tree_less(block_t *x, block_t *y) {
+  size_t x_size = get_size(x);
+  size_t y_size = get_size(y);
+  return x_size < y_size || (x_size == y_size && x < y);
+}
+
+/*
+ * Get the left child of the tree node
+ */
+static block_t *tree_left(block_t *block) {
+  node_t node;
+  node.ptr = block->payload;
+  return node.tree->left;
+}
+
+/*
+ * Get the right child of the tree node
+ */
+static block_t *tree_right(block_t *block) {
+  node_t node;
+  node.ptr = block->payload;
+  return node.tree->right;
+}
+
+/*
+ * Get the parent of the tree node
+ */
+static block_t *tree_parent(block_t *block) {
+  node_t node;
+  node.ptr = block->payload;
+  return node.tree->parent;
+}
+
+/*
+ * Sets the left child of the tree node
+ */
+static void set_tree_left(block_t *block, block_t *block_left) {
+  node_t node;
+  node.ptr = block->payload;
+  node.tree->left = block_left;
+}
+
+/*
+ * Sets the right child of the tree node
+ */
+static void set_tree_right(block_t *block, block_t *block_right) {
+  node_t node;
+  node.ptr = block->payload;
+  node.tree->right = block_right;
+}
+
+/*
+ * Sets the parent of the tree node
+ */
+static void set_tree_parent(block_t *block, block_t *block_parent) {
+  node_t node;
+  node.ptr = block->payload;
+  node.tree->parent = block_parent;
+}
+
+/*********************************************************************/
+
+/*
+ * Returns the address of the slot <slot> of the <run>, the slots start
+ * right after the (aligned) run header
+ */
+static char *run_slot(run_t *run, unsigned slot) {
+  return (char *)run + round_up(sizeof(run_t), dsize) +
+         slot * get_slab_size(run->class);
+}
+
+/*
+ * Check if a request of <size> bytes is served by the slab runs: a tiny size
+ * for which the block header would cost a whole dsize
+ */
+static bool is_slab_size(size_t size) {
+  return size <= slab_max &&
+         round_up(size, dsize) < round_up(size + wsize, dsize);
+}
+
+/*
+ * Get the slab class of a request of <size> bytes, one class per 16 bytes
+ */
+static unsigned get_slab_class(size_t size) {
+  return size <= dsize ? 0 : (size - 1) / dsize;
+}
+
+/*
+ * Get the slot size of the slab <class>
+ */
+static size_t get_slab_size(unsigned class) { return (class + 1) * dsize; }
+
+/*
+ * Get the number of slots in a run of the slab <class>
+ */
+static unsigned get_run_slots(unsigned class) {
+  return (run_size - wsize - round_up(sizeof(run_t), dsize)) /
+         get_slab_size(class);
+}
+
+/*
+ * Get the child of the inner page map <node> on the way to <page>
+ */
+static map_node_t *map_child(map_node_t *node, size_t page) {
+  unsigned i =
+      (page / get_map_pages(node->level - 1)) & ((1 << map_inner_shift) - 1);
+#ifdef THREAD_SAFE
+  return __atomic_load_n(&node->children[i], __ATOMIC_ACQUIRE);
+#else
+  return node->children[i];
+#endif
+}
+
+/*
+ * Get the number of pages covered by a page map node of <level>
+ */
+static size_t get_map_pages(unsigned level) {
+  return (size_t)1 << (map_leaf_shift + level * map_inner_shift);
+}
+
+/*
+ * Get the next block in the same fast bin
+ */
+static block_t *fast_next(block_t *block) {
+  node_t node;
+  node.ptr = block->payload;
+  return node.link->next;
 }
 
 /*
  * Check whether the free list <class> is empty
  */
-static bool free_empty(unsigned class) { return free_start[class] == NULL; }
+static bool free_empty(unsigned class) {
+  return arena->free_start[class] == NULL;
+}
 
 /*
  * Check if the <ptr> is in the valid heap range
  */
 static bool is_in_range(void *ptr) {
-  void *lo = mem_heap_lo();
-  void *hi = mem_heap_hi();
+  void *lo = mem_region_lo(arena->region);
+  void *hi = mem_region_hi(arena->region);
   return lo <= ptr && ptr <= hi;
 }
 
@@ -1131,7 +3381,7 @@ static bool is_aligned(void *ptr) {
  * Get the block class in the segregated list based on its size
  */
 static unsigned get_block_class(block_t *block) {
-  unsigned size;
+  size_t size;
   if (!block || get_alloc(block))
     return -1;
   size = get_size(block);
@@ -1140,21 +3390,27 @@ static unsigned get_block_class(block_t *block) {
 
 /*
  * Get the class in the segregated list based on the size
+ *
+ * class 0: [0, 16]; class 1: [17, 32]; ... class 7: [113, 128];
+ * class 8: [129, 256]; class 9: [257, 512]; ... and the last class
+ * holds everything larger. No loop is needed: the power-of-two
+ * classes are found from the position of the highest set bit.
  */
 static unsigned get_class(size_t size) {
   unsigned class;
-  size_t len = sizeof(free_start) / sizeof(block_t *);
   if (size <= min_block_size)
     return 0;
-  class = 1;
-  // class 1: [17, 32]; class 2: [33, 64]; class 3: [65, 128] ...
-  while (size > min_block_size && class < len) {
-    class ++;
-    size >>= 1;
-  }
-  return class >= len ? len - 1 : class;
+  if (size <= seg_exact_max)
+    return (size - 1) / dsize;
+  class = 64 - __builtin_clzl(size - 1);
+  return class >= seg_classes ? seg_classes - 1 : class;
 }
 
+/*
+ * Get the fast bin of a block size, one bin per 16 bytes
+ */
+static unsigned get_fast_class(size_t size) { return size / dsize - 1; }
+
 /*
  * Check if the prologue and epilogue are valid
  * by looking at their allocated flag, size, and
@@ -1247,7 +3503,8 @@ static bool check_consecutive_free(block_t *block, block_t *block_prev) {
 static bool check_free_link(block_t *block) {
   block_t *prev_free;
   block_t *next_free;
-  if (!get_alloc(block)) {
+  // The links of the tree classes are checked by check_tree
+  if (!get_alloc(block) && get_block_class(block) < tree_class) {
     prev_free = free_prev(block);
     next_free = free_next(block);
     if (prev_free != NULL && free_next(prev_free) != block)
@@ -1257,3 +3514,137 @@ static bool check_free_link(block_t *block) {
   }
   return true;
 }
+
+/*
+ * Check the tree of <class> by walking it in order: the blocks should
+ * belong to the class, be sorted, and the parent links should match.
+ * Each visited block decreases <free_counts>.
+ *
+ * true: pass
+ * false: fail
+ */
+static bool check_tree(unsigned class, long *free_counts) {
+  block_t *root = arena->free_start[class];
+  block_t *block, *block_prev = NULL;
+
+  if (!root)
+    return true;
+  if (tree_parent(root) != NULL)
+    return false;
+  for (block = tree_min(root); block; block = tree_next(block)) {
+    (*free_counts)--;
+    // Check the boundary, and if there is a circle in the tree
+    if (!is_in_range(block) || *free_counts < 0)
+      return false;
+    if (get_alloc(block) || get_block_class(block) != class)
+      return false;
+    // The children should point back to the block
+    if (tree_left(block) && tree_parent(tree_left(block)) != block)
+      return false;
+    if (tree_right(block) && tree_parent(tree_right(block)) != block)
+      return false;
+    // The blocks are visited in strictly increasing order
+    if (block_prev && !tree_less(block_prev, block))
+      return false;
+    block_prev = block;
+  }
+  return true;
+}
+
+/*
+ * Check the <run> header: an allocated block of run_size bytes, a valid
+ * class, and a bitmap of its slots which agrees with the free count
+ *
+ * true: pass
+ * false: fail
+ */
+static bool check_run(run_t *run) {
+  block_t *block = payload_to_header(run);
+  unsigned i, count = 0;
+  unsigned slots;
+  mem m;
+
+  m.ptr = run;
+  if (!is_in_range(run) || (m.addr & (run_size - 1)) != 0)
+    return false;
+  if (!get_alloc(block) || get_size(block) != run_size)
+    return false;
+  if (run->class >= SLAB_CLASSES)
+    return false;
+  slots = get_run_slots(run->class);
+  for (i = 0; i < RUN_WORDS; i++)
+    count += __builtin_popcountl(run->free_bits[i]);
+  // No bit is set past the last slot
+  if (slots < RUN_WORDS * 64 &&
+      (run->free_bits[slots / 64] >> (slots % 64)) != 0)
+    return false;
+  return count == run->free_count && count <= slots;
+}
+
+/*
+ * Check the page map subtree of <node>, whose first page is <page>: the
+ * levels decrease by one, and every entry is the payload of a valid run of
+ * its class. The runs with free slots are counted in <run_counts>.
+ *
+ * true: pass
+ * false: fail
+ */
+static bool check_map(map_node_t *node, size_t page, long *run_counts) {
+  unsigned i;
+  map_node_t *child;
+  run_t *run;
+
+  if (!is_in_range(node))
+    return false;
+  if (node->level > 0) {
+    for (i = 0; i < (1u << map_inner_shift); i++) {
+      child = node->children[i];
+      if (child == NULL)
+        continue;
+      if (child->level != node->level - 1 ||
+          !check_map(child, page + i * get_map_pages(child->level),
+                     run_counts))
+        return false;
+    }
+    return true;
+  }
+  for (i = 0; i < (1u << map_leaf_shift); i++) {
+    if (node->classes[i] == 0)
+      continue;
+    run = (run_t *)((char *)arena + (page + i) * run_size);
+    if (!check_run(run) || run->class != node->classes[i] - 1u)
+      return false;
+    if (run->free_count > 0)
+      (*run_counts)++;
+  }
+  return true;
+}
+
+/*
+ * Check the slab runs: every run of the page map is valid, and the runs
+ * with free slots are exactly the ones on the lists of their class
+ *
+ * true: pass
+ * false: fail
+ */
+static bool check_slab(void) {
+  run_t *run, *run_prev;
+  long run_counts = 0;
+  unsigned i;
+
+  if (arena->page_map != NULL &&
+      !check_map(arena->page_map, 0, &run_counts))
+    return false;
+
+  for (i = 0; i < SLAB_CLASSES; i++) {
+    run_prev = NULL;
+    for (run = arena->runs[i]; run; run = run->next) {
+      // The list should be linked both ways, and hold no full run
+      if (slab_run(run) != run || !check_run(run) || run->class != i ||
+          run->prev != run_prev || run->free_count == 0 || --run_counts < 0)
+        return false;
+      run_prev = run;
+    }
+  }
+  return run_counts == 0;
+}
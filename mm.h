@@ -17,9 +17,94 @@ extern void free (void *ptr);
 extern void *realloc(void *ptr, size_t size);
 extern void *calloc (size_t nmemb, size_t size);
 
+/* the rest of the malloc interface, for libmm.so */
+extern int posix_memalign(void **memptr, size_t alignment, size_t size);
+extern void *aligned_alloc(size_t alignment, size_t size);
+extern void *memalign(size_t alignment, size_t size);
+extern void *valloc(size_t size);
+extern void *pvalloc(size_t size);
+extern size_t malloc_usable_size(void *ptr);
+
 #endif
 
 extern bool mm_init(void);
 
 /* This is for debugging.  Returns false if error encountered */
 extern bool mm_checkheap(int lineno);
+
+/*
+ * The counters of mm_stats.  Each one counts how often a path of the
+ * allocator was taken since mm_init, summed over all threads.
+ */
+enum {
+    MM_STAT_MALLOC,         /* heap mallocs, including the internal ones */
+    MM_STAT_FREE,           /* heap frees */
+    MM_STAT_REALLOC,        /* heap reallocs */
+    MM_STAT_FAST_HIT,       /* mallocs served by a fast bin */
+    MM_STAT_FAST_FLUSH,     /* fast bins flushed into the free lists */
+    MM_STAT_SLAB_MALLOC,    /* mallocs served by a slot of a slab run */
+    MM_STAT_RUN_CREATE,     /* slab runs carved from the heap */
+    MM_STAT_FIT_SEARCH,     /* free list searches */
+    MM_STAT_FIT_MISS,       /* ... which found no fit */
+    MM_STAT_FIT_CLASS,      /* classes visited by the searches */
+    MM_STAT_FIT_BLOCK,      /* list blocks examined by the searches */
+    MM_STAT_FIT_NODE,       /* tree nodes visited by the searches */
+    MM_STAT_SPLIT,          /* blocks split after placement */
+    MM_STAT_COALESCE_NONE,  /* frees with both neighbors allocated */
+    MM_STAT_COALESCE_NEXT,  /* ... merged with the next block only */
+    MM_STAT_COALESCE_PREV,  /* ... merged with the previous block only */
+    MM_STAT_COALESCE_BOTH,  /* ... merged with both neighbors */
+    MM_STAT_EXTEND,         /* heap extensions */
+    MM_STAT_EXTEND_BYTES,   /* bytes added by the extensions */
+    MM_STAT_TRIM,           /* heap shrinks */
+    MM_STAT_RELEASE,        /* free blocks whose pages were released */
+    MM_STAT_HUGE_MAP,       /* huge blocks mapped */
+    MM_STAT_HUGE_REMAP,     /* huge blocks resized by remapping */
+    MM_STAT_REALLOC_NEXT,   /* reallocs in place, with the next free block */
+    MM_STAT_REALLOC_EXTEND, /* ... by extending the heap */
+    MM_STAT_REALLOC_PREV,   /* ... moving down into the previous block */
+    MM_STAT_REALLOC_MOVE,   /* reallocs copying to a new block */
+    MM_STAT_CACHE_REFILL,   /* thread cache bins refilled */
+    MM_STAT_CACHE_FLUSH,    /* thread cache bins flushed */
+    MM_STAT_REMOTE_FREE,    /* blocks sent back to the arena of another thread */
+    MM_STAT_COUNT
+};
+
+typedef struct {
+    unsigned long counts[MM_STAT_COUNT];
+} mm_stats_t;
+
+/*
+ * Fill *stats with the counters.  Returns false, with every counter 0,
+ * unless the allocator is built with -DMM_STATS.
+ */
+extern bool mm_stats(mm_stats_t *stats);
+
+/* The number of segregated free list classes, mm.c is built with this many */
+#define MM_CLASSES 32
+
+/*
+ * The shape of the heap, as walked by mm_heap_shape.  The blocks held by
+ * the fast bins are free for the program but stay allocated in the heap,
+ * so they are counted apart from both.
+ */
+typedef struct {
+    unsigned long heap_bytes;       /* bytes of blocks in the heap */
+    unsigned long alloc_blocks;     /* allocated blocks, slab runs included */
+    unsigned long alloc_bytes;
+    unsigned long header_bytes;     /* headers of the allocated blocks and runs */
+    unsigned long slot_free_bytes;  /* free slots in the slab runs */
+    unsigned long fast_blocks;      /* blocks held by the fast bins */
+    unsigned long fast_bytes;
+    unsigned long free_blocks;      /* free blocks, in the free lists */
+    unsigned long free_bytes;
+    unsigned long largest_free;     /* size of the largest free block */
+    unsigned long class_blocks[MM_CLASSES]; /* free blocks of each class */
+    unsigned long class_bytes[MM_CLASSES];
+} mm_shape_t;
+
+/*
+ * Walk the heap and fill *shape.  Huge blocks, which have memory areas
+ * of their own, are left out.  Returns false if the heap is not set up.
+ */
+extern bool mm_heap_shape(mm_shape_t *shape);
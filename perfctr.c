@@ -0,0 +1,122 @@
+/*
+ * perfctr.c - Hardware performance counters of the calling process, see
+ * perfctr.h
+ */
+#include <linux/perf_event.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "perfctr.h"
+
+#define CACHE_READ_MISS(cache)                                          \
+    ((cache) | (PERF_COUNT_HW_CACHE_OP_READ << 8) |                     \
+     (PERF_COUNT_HW_CACHE_RESULT_MISS << 16))
+
+const char *perfctr_names[PERFCTR_EVENTS] = {
+    [PERFCTR_CYCLES] = "cycles",
+    [PERFCTR_INSTRUCTIONS] = "instrs",
+    [PERFCTR_BRANCH_MISSES] = "br-miss",
+    [PERFCTR_L1D_MISSES] = "l1d-miss",
+    [PERFCTR_LLC_MISSES] = "llc-miss",
+    [PERFCTR_DTLB_MISSES] = "dtlb-miss",
+    [PERFCTR_PAGE_FAULTS] = "faults",
+};
+
+/* Type and config of each event for perf_event_open */
+static const struct {
+    uint32_t type;
+    uint64_t config;
+} events[PERFCTR_EVENTS] = {
+    [PERFCTR_CYCLES] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    [PERFCTR_INSTRUCTIONS] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    [PERFCTR_BRANCH_MISSES] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+    [PERFCTR_L1D_MISSES] = {PERF_TYPE_HW_CACHE,
+                            CACHE_READ_MISS(PERF_COUNT_HW_CACHE_L1D)},
+    [PERFCTR_LLC_MISSES] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+    [PERFCTR_DTLB_MISSES] = {PERF_TYPE_HW_CACHE,
+                             CACHE_READ_MISS(PERF_COUNT_HW_CACHE_DTLB)},
+    [PERFCTR_PAGE_FAULTS] = {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS},
+};
+
+/* What read returns with the read_format of perfctr_open */
+struct reading {
+    uint64_t value;
+    uint64_t time_enabled;
+    uint64_t time_running;
+};
+
+bool perfctr_open(perfctr_t *pc)
+{
+    struct perf_event_attr attr;
+    bool any = false;
+    int i;
+
+    for (i = 0; i < PERFCTR_EVENTS; i++) {
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = events[i].type;
+        attr.config = events[i].config;
+        attr.disabled = 1;
+        /* Allowed to unprivileged users with perf_event_paranoid <= 2 */
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED |
+                           PERF_FORMAT_TOTAL_TIME_RUNNING;
+        pc->fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        if (pc->fds[i] >= 0) {
+            any = true;
+        }
+    }
+    return any;
+}
+
+void perfctr_start(perfctr_t *pc)
+{
+    int i;
+
+    for (i = 0; i < PERFCTR_EVENTS; i++) {
+        if (pc->fds[i] >= 0) {
+            ioctl(pc->fds[i], PERF_EVENT_IOC_RESET, 0);
+            ioctl(pc->fds[i], PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+}
+
+void perfctr_stop(perfctr_t *pc, double values[PERFCTR_EVENTS])
+{
+    struct reading r;
+    int i;
+
+    for (i = 0; i < PERFCTR_EVENTS; i++) {
+        if (pc->fds[i] >= 0) {
+            ioctl(pc->fds[i], PERF_EVENT_IOC_DISABLE, 0);
+        }
+    }
+    for (i = 0; i < PERFCTR_EVENTS; i++) {
+        values[i] = -1;
+        if (pc->fds[i] < 0 || read(pc->fds[i], &r, sizeof(r)) != sizeof(r)) {
+            continue;
+        }
+        /* Not scheduled at all: the count is unknown, not zero */
+        if (r.time_running == 0) {
+            values[i] = r.time_enabled == 0 ? 0 : -1;
+        } else {
+            values[i] = (double)r.value * r.time_enabled / r.time_running;
+        }
+    }
+}
+
+void perfctr_close(perfctr_t *pc)
+{
+    int i;
+
+    for (i = 0; i < PERFCTR_EVENTS; i++) {
+        if (pc->fds[i] >= 0) {
+            close(pc->fds[i]);
+            pc->fds[i] = -1;
+        }
+    }
+}
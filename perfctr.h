@@ -0,0 +1,53 @@
+/*
+ * perfctr.h - Hardware performance counters of the calling process
+ *
+ * Counts, through the Linux perf_event_open system call, the events of
+ * the memory system and the pipeline that an allocator is judged on, in
+ * user space only.  Each event is opened on its own, so that a machine
+ * or a kernel which lacks some of them (virtual machines often lack all
+ * the hardware ones) still counts the others.  When the kernel time-
+ * shares the counters among more events than it has, the counts are
+ * scaled up by the fraction of the time each event was counted.
+ */
+#ifndef __PERFCTR_H_
+#define __PERFCTR_H_
+
+#include <stdbool.h>
+
+/* The events counted, in the order of the values read */
+enum {
+    PERFCTR_CYCLES,
+    PERFCTR_INSTRUCTIONS,
+    PERFCTR_BRANCH_MISSES,
+    PERFCTR_L1D_MISSES,     /* L1 data cache read misses */
+    PERFCTR_LLC_MISSES,     /* last level cache misses */
+    PERFCTR_DTLB_MISSES,    /* data TLB read misses */
+    PERFCTR_PAGE_FAULTS,
+    PERFCTR_EVENTS
+};
+
+/* Short names of the events, for column headers */
+extern const char *perfctr_names[PERFCTR_EVENTS];
+
+typedef struct {
+    int fds[PERFCTR_EVENTS];    /* -1 if the event cannot be counted */
+} perfctr_t;
+
+/*
+ * Open the counters of the calling process, stopped; return false if
+ * none of the events can be counted
+ */
+bool perfctr_open(perfctr_t *pc);
+
+/* Zero the counters and start them */
+void perfctr_start(perfctr_t *pc);
+
+/*
+ * Stop the counters and store the count of each event in values, or -1
+ * for an event which was not counted
+ */
+void perfctr_stop(perfctr_t *pc, double values[PERFCTR_EVENTS]);
+
+void perfctr_close(perfctr_t *pc);
+
+#endif /* __PERFCTR_H_ */
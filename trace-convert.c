@@ -0,0 +1,67 @@
+/*
+ * trace-convert.c - Convert traces between the text and binary formats
+ *
+ * Reads a text (.rep) or binary (.bin) trace, or a capture log written
+ * by libtracer.so, and writes it in the binary format, or in the text
+ * format with -t.  Binary traces are mapped by mdriver instead of being
+ * parsed, see trace.h.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+static void usage(char *prog)
+{
+    fprintf(stderr, "Usage: %s [-ht] <infile> <outfile>\n", prog);
+    fprintf(stderr, "Options\n");
+    fprintf(stderr, "\t-t         Write a text trace instead of a binary one.\n");
+    fprintf(stderr, "\t-h         Print this message.\n");
+}
+
+int main(int argc, char *argv[])
+{
+    trace_file_t file;
+    bool text = false;
+    bool ok;
+    FILE *out;
+    int c;
+
+    while ((c = getopt(argc, argv, "ht")) != EOF) {
+        switch (c) {
+        case 't':
+            text = true;
+            break;
+        case 'h':
+            usage(argv[0]);
+            exit(0);
+        default:
+            usage(argv[0]);
+            exit(1);
+        }
+    }
+    if (argc - optind != 2) {
+        usage(argv[0]);
+        exit(1);
+    }
+
+    if (!trace_load(argv[optind], &file)) {
+        exit(1);
+    }
+    if ((out = fopen(argv[optind + 1], "w")) == NULL) {
+        perror(argv[optind + 1]);
+        exit(1);
+    }
+    ok = text ? trace_write_text(out, &file) : trace_write_bin(out, &file);
+    if (fclose(out) != 0) {
+        ok = false;
+    }
+    if (!ok) {
+        fprintf(stderr, "%s: write failed\n", argv[optind + 1]);
+        exit(1);
+    }
+    trace_unload(&file);
+    return 0;
+}
@@ -0,0 +1,613 @@
+/*
+ * trace-gen.c - Generate synthetic traces from a spec
+ *
+ * Every request allocates a block, reallocates a live one, or frees the
+ * live block whose lifetime has run out.  The size and the lifetime of a
+ * block are drawn from the distributions of the spec, a text file with
+ * one setting per line ('#' starts a comment):
+ *
+ *     ops 1000000                  number of requests
+ *     seed 1                       seed of the random generator
+ *     weight 1                     weight written in the header
+ *     size powerlaw 16 4096 1.5    size distribution, see below
+ *     lifetime exponential 2000    lifetime distribution, in requests
+ *     realloc 0.05                 probability that a request reallocates
+ *     realloc-growth 1.5           new size / old size, 0 to draw the size
+ *
+ * The distributions are
+ *
+ *     constant <v>
+ *     uniform <min> <max>
+ *     powerlaw <min> <max> <alpha>   density proportional to x^-alpha
+ *     exponential <mean>
+ *     bimodal <v1> <v2> <p1>         v1 with probability p1, else v2
+ *     histogram <v>:<weight> ...     an empirical histogram
+ *
+ * Blocks still live when the remaining requests are as many as them are
+ * freed in the order of their deaths, so the heap is empty at the end.
+ * The requests are streamed to the output, after a first pass with the
+ * same seed which computes the header, so traces of 10^8 requests only
+ * need memory for their live blocks.
+ */
+#include <errno.h>
+#include <inttypes.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+#define MAXLINE 65536           /* max length of a spec line */
+
+/* Kinds of distribution */
+typedef enum {
+    DIST_CONSTANT,
+    DIST_UNIFORM,
+    DIST_POWERLAW,
+    DIST_EXPONENTIAL,
+    DIST_BIMODAL,
+    DIST_HISTOGRAM
+} dist_kind_t;
+
+/* A distribution of sizes or lifetimes */
+typedef struct {
+    dist_kind_t kind;
+    double a, b, c;             /* parameters, in the order of the spec */
+    size_t count;               /* values of a histogram */
+    double *values;
+    double *cumulative;         /* running sums of the weights */
+} dist_t;
+
+/* The settings of a spec */
+typedef struct {
+    uint64_t ops;
+    uint64_t seed;
+    uint32_t weight;
+    dist_t size;
+    dist_t lifetime;
+    double realloc_prob;
+    double realloc_growth;
+} spec_t;
+
+/* A live block */
+typedef struct {
+    int32_t index;
+    uint64_t size;
+    uint64_t death;             /* request which frees it */
+    size_t heap_pos;            /* position in the heap of deaths */
+} block_t;
+
+/*
+ * The state of a generation.  live holds the live blocks, in no order,
+ * and heap their positions in live, as a min-heap on the death.
+ */
+typedef struct {
+    uint64_t rng;
+    block_t *live;
+    size_t *heap;
+    size_t num_live;
+    size_t max_live;
+    uint32_t num_ids;
+    uint64_t live_bytes;
+    uint64_t peak_bytes;
+} gen_t;
+
+/*
+ * random_next - Return the next number of a splitmix64 sequence, the
+ *     same on every machine for a given seed
+ */
+static uint64_t random_next(gen_t *gen)
+{
+    uint64_t z = (gen->rng += 0x9e3779b97f4a7c15ULL);
+
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+/*
+ * random_unit - Return a uniform number in [0, 1)
+ */
+static double random_unit(gen_t *gen)
+{
+    return (random_next(gen) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/*
+ * dist_sample - Draw a value from a distribution, at least 1
+ */
+static uint64_t dist_sample(gen_t *gen, const dist_t *dist)
+{
+    double u = random_unit(gen);
+    double x = dist->a;
+
+    switch (dist->kind) {
+    case DIST_CONSTANT:
+        break;
+    case DIST_UNIFORM:
+        x = dist->a + u * (dist->b - dist->a + 1);
+        break;
+    case DIST_POWERLAW:
+        if (fabs(dist->c - 1.0) < 1e-9) {
+            x = dist->a * pow(dist->b / dist->a, u);
+        } else {
+            /* Inverse of the cumulative distribution on [a, b] */
+            double e = 1.0 - dist->c;
+            double lo = pow(dist->a, e), hi = pow(dist->b, e);
+            x = pow(lo + u * (hi - lo), 1.0 / e);
+        }
+        break;
+    case DIST_EXPONENTIAL:
+        x = -dist->a * log(1.0 - u);
+        break;
+    case DIST_BIMODAL:
+        x = u < dist->c ? dist->a : dist->b;
+        break;
+    case DIST_HISTOGRAM: {
+        double target = u * dist->cumulative[dist->count - 1];
+        size_t lo = 0, hi = dist->count - 1;
+
+        while (lo < hi) {
+            size_t mid = (lo + hi) / 2;
+            if (dist->cumulative[mid] > target) {
+                hi = mid;
+            } else {
+                lo = mid + 1;
+            }
+        }
+        x = dist->values[lo];
+        break;
+    }
+    }
+    return x < 1.0 ? 1 : (uint64_t)x;
+}
+
+/*
+ * spec_error - Report an error at line lineno of a spec and exit
+ */
+static void spec_error(const char *filename, int lineno, const char *msg)
+{
+    fprintf(stderr, "%s:%d: %s\n", filename, lineno, msg);
+    exit(1);
+}
+
+/*
+ * parse_number - Parse the next token as a non-negative number
+ */
+static double parse_number(const char *filename, int lineno)
+{
+    char *token = strtok(NULL, " \t\n");
+    char *end;
+    double x;
+
+    if (token == NULL) {
+        spec_error(filename, lineno, "missing number");
+    }
+    x = strtod(token, &end);
+    if (*end != '\0' || !(x >= 0) || isinf(x)) {
+        spec_error(filename, lineno, "bad number");
+    }
+    return x;
+}
+
+/*
+ * parse_dist - Parse the rest of a size or lifetime line
+ */
+static void parse_dist(const char *filename, int lineno, dist_t *dist)
+{
+    char *kind = strtok(NULL, " \t\n");
+    char *token;
+
+    memset(dist, 0, sizeof(*dist));
+    if (kind == NULL) {
+        spec_error(filename, lineno, "missing distribution");
+    } else if (strcmp(kind, "constant") == 0) {
+        dist->kind = DIST_CONSTANT;
+        dist->a = parse_number(filename, lineno);
+    } else if (strcmp(kind, "uniform") == 0) {
+        dist->kind = DIST_UNIFORM;
+        dist->a = parse_number(filename, lineno);
+        dist->b = parse_number(filename, lineno);
+    } else if (strcmp(kind, "powerlaw") == 0) {
+        dist->kind = DIST_POWERLAW;
+        dist->a = parse_number(filename, lineno);
+        dist->b = parse_number(filename, lineno);
+        dist->c = parse_number(filename, lineno);
+        if (dist->a < 1) {
+            spec_error(filename, lineno, "powerlaw minimum must be >= 1");
+        }
+    } else if (strcmp(kind, "exponential") == 0) {
+        dist->kind = DIST_EXPONENTIAL;
+        dist->a = parse_number(filename, lineno);
+    } else if (strcmp(kind, "bimodal") == 0) {
+        dist->kind = DIST_BIMODAL;
+        dist->a = parse_number(filename, lineno);
+        dist->b = parse_number(filename, lineno);
+        dist->c = parse_number(filename, lineno);
+        if (dist->c > 1) {
+            spec_error(filename, lineno, "bimodal probability must be <= 1");
+        }
+    } else if (strcmp(kind, "histogram") == 0) {
+        dist->kind = DIST_HISTOGRAM;
+        while ((token = strtok(NULL, " \t\n")) != NULL) {
+            double value, weight;
+            char *end;
+
+            value = strtod(token, &end);
+            if (*end != ':' || !(value >= 0)) {
+                spec_error(filename, lineno, "bad histogram bucket");
+            }
+            weight = strtod(end + 1, &end);
+            if (*end != '\0' || !(weight >= 0)) {
+                spec_error(filename, lineno, "bad histogram weight");
+            }
+            dist->values = realloc(dist->values,
+                                   (dist->count + 1) * sizeof(double));
+            dist->cumulative = realloc(dist->cumulative,
+                                       (dist->count + 1) * sizeof(double));
+            if (dist->values == NULL || dist->cumulative == NULL) {
+                spec_error(filename, lineno, "out of memory");
+            }
+            dist->values[dist->count] = value;
+            dist->cumulative[dist->count] = weight
+                + (dist->count > 0 ? dist->cumulative[dist->count - 1] : 0);
+            dist->count++;
+        }
+        if (dist->count == 0 || dist->cumulative[dist->count - 1] <= 0) {
+            spec_error(filename, lineno, "empty histogram");
+        }
+        return;
+    } else {
+        spec_error(filename, lineno, "unknown distribution");
+    }
+    if (dist->kind != DIST_CONSTANT && dist->kind != DIST_EXPONENTIAL
+        && dist->kind != DIST_BIMODAL && dist->b < dist->a) {
+        spec_error(filename, lineno, "maximum below minimum");
+    }
+    if (strtok(NULL, " \t\n") != NULL) {
+        spec_error(filename, lineno, "extra parameters");
+    }
+}
+
+/*
+ * read_spec - Read a spec file
+ */
+static void read_spec(const char *filename, spec_t *spec)
+{
+    static char line[MAXLINE];
+    bool has_size = false, has_lifetime = false;
+    int lineno = 0;
+    FILE *in;
+
+    memset(spec, 0, sizeof(*spec));
+    spec->seed = 1;
+    spec->weight = 1;
+    if ((in = fopen(filename, "r")) == NULL) {
+        fprintf(stderr, "%s: %s\n", filename, strerror(errno));
+        exit(1);
+    }
+    while (fgets(line, sizeof(line), in) != NULL) {
+        char *key, *comment;
+
+        lineno++;
+        if ((comment = strchr(line, '#')) != NULL) {
+            *comment = '\0';
+        }
+        if ((key = strtok(line, " \t\n")) == NULL) {
+            continue;
+        }
+        if (strcmp(key, "size") == 0) {
+            parse_dist(filename, lineno, &spec->size);
+            has_size = true;
+            continue;
+        }
+        if (strcmp(key, "lifetime") == 0) {
+            parse_dist(filename, lineno, &spec->lifetime);
+            has_lifetime = true;
+            continue;
+        }
+        if (strcmp(key, "ops") == 0) {
+            spec->ops = parse_number(filename, lineno);
+        } else if (strcmp(key, "seed") == 0) {
+            spec->seed = parse_number(filename, lineno);
+        } else if (strcmp(key, "weight") == 0) {
+            spec->weight = parse_number(filename, lineno);
+        } else if (strcmp(key, "realloc") == 0) {
+            spec->realloc_prob = parse_number(filename, lineno);
+        } else if (strcmp(key, "realloc-growth") == 0) {
+            spec->realloc_growth = parse_number(filename, lineno);
+        } else {
+            spec_error(filename, lineno, "unknown setting");
+        }
+        if (strtok(NULL, " \t\n") != NULL) {
+            spec_error(filename, lineno, "extra parameters");
+        }
+    }
+    fclose(in);
+    if (!has_size || !has_lifetime) {
+        spec_error(filename, lineno, "size and lifetime must be given");
+    }
+}
+
+/*
+ * heap_swap - Exchange two entries of the heap of deaths
+ */
+static void heap_swap(gen_t *gen, size_t i, size_t j)
+{
+    size_t tmp = gen->heap[i];
+
+    gen->heap[i] = gen->heap[j];
+    gen->heap[j] = tmp;
+    gen->live[gen->heap[i]].heap_pos = i;
+    gen->live[gen->heap[j]].heap_pos = j;
+}
+
+/*
+ * heap_death - Return the death of the block at heap entry i
+ */
+static uint64_t heap_death(const gen_t *gen, size_t i)
+{
+    return gen->live[gen->heap[i]].death;
+}
+
+/*
+ * heap_up - Move heap entry i up to its place
+ */
+static void heap_up(gen_t *gen, size_t i)
+{
+    while (i > 0 && heap_death(gen, (i - 1) / 2) > heap_death(gen, i)) {
+        heap_swap(gen, i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+}
+
+/*
+ * heap_down - Move heap entry i down to its place
+ */
+static void heap_down(gen_t *gen, size_t i)
+{
+    for (;;) {
+        size_t child = 2 * i + 1;
+
+        if (child >= gen->num_live) {
+            return;
+        }
+        if (child + 1 < gen->num_live
+            && heap_death(gen, child + 1) < heap_death(gen, child)) {
+            child++;
+        }
+        if (heap_death(gen, i) <= heap_death(gen, child)) {
+            return;
+        }
+        heap_swap(gen, i, child);
+        i = child;
+    }
+}
+
+/*
+ * emit - Write a request, unless this is the first pass
+ */
+static void emit(FILE *out, bool text, uint32_t type, int32_t index,
+                 uint64_t size)
+{
+    traceop_t op;
+
+    if (out == NULL) {
+        return;
+    }
+    if (text) {
+        switch (type) {
+        case ALLOC:
+            fprintf(out, "a %d %" PRIu64 "\n", index, size);
+            break;
+        case REALLOC:
+            fprintf(out, "r %d %" PRIu64 "\n", index, size);
+            break;
+        case FREE:
+            fprintf(out, "f %d\n", index);
+            break;
+        }
+        return;
+    }
+    op.type = type;
+    op.index = index;
+    op.size = size;
+    fwrite(&op, sizeof(op), 1, out);
+}
+
+/*
+ * gen_alloc - Allocate a new block
+ */
+static void gen_alloc(gen_t *gen, const spec_t *spec, uint64_t now,
+                      FILE *out, bool text)
+{
+    block_t *block;
+
+    if (gen->num_live == gen->max_live) {
+        gen->max_live = gen->max_live ? 2 * gen->max_live : 1024;
+        gen->live = realloc(gen->live, gen->max_live * sizeof(block_t));
+        gen->heap = realloc(gen->heap, gen->max_live * sizeof(size_t));
+        if (gen->live == NULL || gen->heap == NULL) {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+        }
+    }
+    block = &gen->live[gen->num_live];
+    block->index = gen->num_ids++;
+    block->size = dist_sample(gen, &spec->size);
+    block->death = now + dist_sample(gen, &spec->lifetime);
+    block->heap_pos = gen->num_live;
+    gen->heap[gen->num_live] = gen->num_live;
+    gen->num_live++;
+    heap_up(gen, block->heap_pos);
+
+    gen->live_bytes += block->size;
+    if (gen->live_bytes > gen->peak_bytes) {
+        gen->peak_bytes = gen->live_bytes;
+    }
+    emit(out, text, ALLOC, block->index, block->size);
+}
+
+/*
+ * gen_realloc - Resize a live block picked at random
+ */
+static void gen_realloc(gen_t *gen, const spec_t *spec, FILE *out, bool text)
+{
+    block_t *block = &gen->live[random_next(gen) % gen->num_live];
+    uint64_t size;
+
+    if (spec->realloc_growth > 0) {
+        size = (uint64_t)(block->size * spec->realloc_growth);
+        size = size < 1 ? 1 : size;
+    } else {
+        size = dist_sample(gen, &spec->size);
+    }
+    gen->live_bytes += size - block->size;
+    if (gen->live_bytes > gen->peak_bytes) {
+        gen->peak_bytes = gen->live_bytes;
+    }
+    block->size = size;
+    emit(out, text, REALLOC, block->index, size);
+}
+
+/*
+ * gen_free - Free the block which dies first
+ */
+static void gen_free(gen_t *gen, FILE *out, bool text)
+{
+    size_t pos = gen->heap[0];
+    size_t last = gen->num_live - 1;
+
+    emit(out, text, FREE, gen->live[pos].index, 0);
+    gen->live_bytes -= gen->live[pos].size;
+
+    /* Remove the top of the heap */
+    heap_swap(gen, 0, last);
+    gen->num_live--;
+    heap_down(gen, 0);
+
+    /* Move the last live block into the hole */
+    if (pos != last) {
+        gen->live[pos] = gen->live[last];
+        gen->heap[gen->live[pos].heap_pos] = pos;
+    }
+}
+
+/*
+ * generate - Generate the requests of a spec, and write them to out
+ *     unless it is NULL.  Fills in the header.
+ */
+static void generate(const spec_t *spec, FILE *out, bool text,
+                     trace_header_t *header)
+{
+    gen_t gen;
+    uint64_t now;
+
+    memset(&gen, 0, sizeof(gen));
+    gen.rng = spec->seed;
+    for (now = 0; now < spec->ops; now++) {
+        uint64_t remaining = spec->ops - now;
+
+        if (gen.num_live > 0
+            && (gen.num_live >= remaining || heap_death(&gen, 0) <= now)) {
+            gen_free(&gen, out, text);
+        } else if (gen.num_live > 0
+                   && random_unit(&gen) < spec->realloc_prob) {
+            gen_realloc(&gen, spec, out, text);
+        } else {
+            gen_alloc(&gen, spec, now, out, text);
+        }
+    }
+    free(gen.live);
+    free(gen.heap);
+
+    memset(header, 0, sizeof(*header));
+    header->magic = TRACE_MAGIC;
+    header->weight = spec->weight;
+    header->num_ids = gen.num_ids;
+    header->num_ops = spec->ops;
+    header->data_bytes = gen.peak_bytes;
+}
+
+static void usage(char *prog)
+{
+    fprintf(stderr, "Usage: %s [-hb] [-n <ops>] [-s <seed>] <spec> <outfile>\n",
+            prog);
+    fprintf(stderr, "Options\n");
+    fprintf(stderr, "\t-b         Write a binary trace instead of a text one.\n");
+    fprintf(stderr, "\t-n <ops>   Generate <ops> requests, overriding the spec.\n");
+    fprintf(stderr, "\t-s <seed>  Use <seed>, overriding the spec.\n");
+    fprintf(stderr, "\t-h         Print this message.\n");
+}
+
+int main(int argc, char *argv[])
+{
+    trace_header_t header;
+    spec_t spec;
+    bool text = true;
+    char *ops = NULL, *seed = NULL;
+    FILE *out;
+    int c;
+
+    while ((c = getopt(argc, argv, "hbn:s:")) != EOF) {
+        switch (c) {
+        case 'b':
+            text = false;
+            break;
+        case 'n':
+            ops = optarg;
+            break;
+        case 's':
+            seed = optarg;
+            break;
+        case 'h':
+            usage(argv[0]);
+            exit(0);
+        default:
+            usage(argv[0]);
+            exit(1);
+        }
+    }
+    if (argc - optind != 2) {
+        usage(argv[0]);
+        exit(1);
+    }
+
+    read_spec(argv[optind], &spec);
+    if (ops != NULL) {
+        spec.ops = strtoull(ops, NULL, 0);
+    }
+    if (seed != NULL) {
+        spec.seed = strtoull(seed, NULL, 0);
+    }
+    if (spec.ops == 0 || spec.ops > INT32_MAX) {
+        fprintf(stderr, "%s: the number of requests must be between 1 and %d\n",
+                argv[optind], INT32_MAX);
+        exit(1);
+    }
+
+    /* The first pass only computes the header */
+    generate(&spec, NULL, text, &header);
+    if ((out = fopen(argv[optind + 1], "w")) == NULL) {
+        perror(argv[optind + 1]);
+        exit(1);
+    }
+    if (text) {
+        fprintf(out, "%" PRIu32 "\n%" PRIu32 "\n%" PRIu32 "\n%" PRIu64 "\n",
+                header.weight, header.num_ids, header.num_ops,
+                header.data_bytes);
+    } else {
+        fwrite(&header, sizeof(header), 1, out);
+    }
+    generate(&spec, out, text, &header);
+    if (ferror(out) || fclose(out) != 0) {
+        fprintf(stderr, "%s: write failed\n", argv[optind + 1]);
+        exit(1);
+    }
+    fprintf(stderr, "%s: %" PRIu32 " requests, %" PRIu32 " ids, "
+            "peak %" PRIu64 " bytes\n", argv[optind + 1], header.num_ops,
+            header.num_ids, header.data_bytes);
+    return 0;
+}
@@ -0,0 +1,806 @@
+/*
+ * trace.c - Reading and writing allocator trace files
+ *
+ * Text traces are parsed into a malloc'd array of operations.  Binary
+ * traces are mapped read-only, and the operations are used directly
+ * from the mapping, so loading one costs a few system calls regardless
+ * of its length.  Capture logs are sorted and replayed against a table
+ * of the live blocks, which gives the blocks their ids.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+_Static_assert(sizeof(traceop_t) == 16, "traceop_t must be packed");
+_Static_assert(sizeof(trace_header_t) == 32, "trace_header_t must be packed");
+_Static_assert(sizeof(capture_event_t) == 32, "capture_event_t must be packed");
+
+/* A live block of a capture log, in an open addressing hash table */
+typedef struct {
+    uint64_t addr;          /* 0 for an empty entry */
+    uint64_t size;
+    int32_t index;
+} capture_block_t;
+
+/* The state of a capture log being turned into a trace */
+typedef struct {
+    trace_file_t *file;
+    capture_block_t *blocks;
+    size_t mask;            /* number of entries - 1, a power of two */
+    size_t count;           /* live blocks */
+    uint64_t live_bytes;
+} capture_t;
+
+static bool load_text(const char *filename, FILE *in, trace_file_t *file);
+static bool load_bin(const char *filename, int fd, trace_file_t *file);
+static bool load_capture(const char *filename, int fd, trace_file_t *file);
+
+/*
+ * trace_load - Load a text or binary trace, or a capture log
+ */
+bool trace_load(const char *filename, trace_file_t *file)
+{
+    uint64_t magic = 0;
+    bool ok;
+    int fd;
+
+    memset(file, 0, sizeof(*file));
+    if ((fd = open(filename, O_RDONLY)) < 0) {
+        fprintf(stderr, "%s: %s\n", filename, strerror(errno));
+        return false;
+    }
+    if (pread(fd, &magic, sizeof(magic), 0) == sizeof(magic)
+        && magic == TRACE_MAGIC) {
+        ok = load_bin(filename, fd, file);
+        close(fd);
+    } else if (magic == CAPTURE_MAGIC) {
+        ok = load_capture(filename, fd, file);
+        close(fd);
+    } else {
+        FILE *in = fdopen(fd, "r");
+        if (in == NULL) {
+            fprintf(stderr, "%s: %s\n", filename, strerror(errno));
+            close(fd);
+            return false;
+        }
+        ok = load_text(filename, in, file);
+        fclose(in);
+    }
+    if (!ok) {
+        trace_unload(file);
+    }
+    return ok;
+}
+
+/*
+ * trace_unload - Release the operations of a loaded trace
+ */
+void trace_unload(trace_file_t *file)
+{
+    if (file->map_length > 0) {
+        /* The mapping starts with the header */
+        munmap((char *)file->ops - sizeof(trace_header_t), file->map_length);
+    } else {
+        free(file->ops);
+    }
+    file->ops = NULL;
+    file->map_length = 0;
+}
+
+/*
+ * valid_op - Check that op has a known type and refers to an id within
+ *     the header's count, or to -1 for a free of NULL
+ */
+static bool valid_op(const traceop_t *op, const trace_header_t *header)
+{
+    return op->type <= REALLOC && op->index < (int)header->num_ids
+        && op->index >= (op->type == FREE ? -1 : 0);
+}
+
+/*
+ * load_bin - Map a binary trace and check that it is consistent
+ */
+static bool load_bin(const char *filename, int fd, trace_file_t *file)
+{
+    struct stat st;
+    void *addr;
+    uint32_t i;
+
+    if (fstat(fd, &st) < 0) {
+        fprintf(stderr, "%s: %s\n", filename, strerror(errno));
+        return false;
+    }
+    if ((size_t)st.st_size < sizeof(trace_header_t)) {
+        fprintf(stderr, "%s: truncated header\n", filename);
+        return false;
+    }
+    addr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (addr == MAP_FAILED) {
+        fprintf(stderr, "%s: %s\n", filename, strerror(errno));
+        return false;
+    }
+    memcpy(&file->header, addr, sizeof(trace_header_t));
+    file->ops = (traceop_t *)((char *)addr + sizeof(trace_header_t));
+    file->map_length = st.st_size;
+
+    /* The ops are used in place, so the mapping must hold all of them */
+    if ((size_t)st.st_size != sizeof(trace_header_t)
+        + (size_t)file->header.num_ops * sizeof(traceop_t)) {
+        fprintf(stderr, "%s: expected %u operations in %zu bytes\n",
+                filename, file->header.num_ops, (size_t)st.st_size);
+        munmap(addr, st.st_size);
+        file->ops = NULL;
+        file->map_length = 0;
+        return false;
+    }
+
+    /* The driver indexes its blocks with the ops without checking them */
+    for (i = 0; i < file->header.num_ops; i++) {
+        if (!valid_op(&file->ops[i], &file->header)) {
+            fprintf(stderr, "%s: bad operation %zu\n", filename, (size_t)i);
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * read_text_header - Parse the four header lines of a text trace
+ */
+static bool read_text_header(const char *filename, FILE *in,
+                             trace_header_t *header)
+{
+    memset(header, 0, sizeof(*header));
+    header->magic = TRACE_MAGIC;
+    if (fscanf(in, "%" SCNu32 " %" SCNu32 " %" SCNu32 " %" SCNu64,
+               &header->weight, &header->num_ids,
+               &header->num_ops, &header->data_bytes) != 4) {
+        fprintf(stderr, "%s: malformed header\n", filename);
+        return false;
+    }
+    return true;
+}
+
+/*
+ * read_text_op - Parse request line op_index of a text trace
+ */
+static bool read_text_op(const char *filename, FILE *in, uint32_t op_index,
+                         traceop_t *op)
+{
+    char type[2];
+    int index;
+    size_t size = 0;
+    int fields;
+
+    if (fscanf(in, " %1s", type) != 1) {
+        fprintf(stderr, "%s: trace ends at operation %u\n",
+                filename, op_index);
+        return false;
+    }
+    switch (type[0]) {
+    case 'a':
+        fields = fscanf(in, "%d %zu", &index, &size);
+        op->type = ALLOC;
+        break;
+    case 'r':
+        fields = fscanf(in, "%d %zu", &index, &size);
+        op->type = REALLOC;
+        break;
+    case 'f':
+        fields = fscanf(in, "%d", &index) + 1;
+        op->type = FREE;
+        break;
+    default:
+        fprintf(stderr, "%s: bogus type character (%c) in operation %u\n",
+                filename, type[0], op_index);
+        return false;
+    }
+    if (fields != 2) {
+        fprintf(stderr, "%s: malformed operation %u\n", filename, op_index);
+        return false;
+    }
+    op->index = index;
+    op->size = size;
+    return true;
+}
+
+/*
+ * load_text - Parse a text trace into a malloc'd array of operations
+ */
+static bool load_text(const char *filename, FILE *in, trace_file_t *file)
+{
+    trace_header_t *header = &file->header;
+    int max_index = 0;
+    uint32_t op_index;
+
+    if (!read_text_header(filename, in, header)) {
+        return false;
+    }
+
+    /* We'll store each request line in the trace in this array */
+    if ((file->ops = malloc(header->num_ops * sizeof(traceop_t))) == NULL) {
+        fprintf(stderr, "%s: out of memory\n", filename);
+        return false;
+    }
+
+    /* read every request line in the trace file */
+    for (op_index = 0; op_index < header->num_ops; op_index++) {
+        traceop_t *op = &file->ops[op_index];
+
+        if (!read_text_op(filename, in, op_index, op)) {
+            return false;
+        }
+        if (op->type != FREE) {
+            max_index = (op->index > max_index) ? op->index : max_index;
+        }
+    }
+    if (max_index != (int)header->num_ids - 1) {
+        fprintf(stderr, "%s: expected %u ids, found %d\n",
+                filename, header->num_ids, max_index + 1);
+        return false;
+    }
+    return true;
+}
+
+/*
+ * capture_home - Return the first entry probed for the block at addr
+ */
+static size_t capture_home(const capture_t *cap, uint64_t addr)
+{
+    return (size_t)(((addr >> 4) * 0x9e3779b97f4a7c15ULL) >> 32) & cap->mask;
+}
+
+/*
+ * capture_find - Return the entry of the live block at addr, or of the
+ *     empty slot where it would be inserted
+ */
+static capture_block_t *capture_find(capture_t *cap, uint64_t addr)
+{
+    size_t i = capture_home(cap, addr);
+
+    while (cap->blocks[i].addr != 0 && cap->blocks[i].addr != addr) {
+        i = (i + 1) & cap->mask;
+    }
+    return &cap->blocks[i];
+}
+
+/*
+ * capture_insert - Record a live block, doubling the table once it is
+ *     half full
+ */
+static bool capture_insert(capture_t *cap, uint64_t addr, int32_t index,
+                           uint64_t size)
+{
+    capture_block_t *block;
+
+    if (2 * (cap->count + 1) > cap->mask + 1) {
+        capture_block_t *old = cap->blocks;
+        size_t i, old_size = cap->mask + 1;
+
+        if ((cap->blocks = calloc(2 * old_size, sizeof(*old))) == NULL) {
+            cap->blocks = old;
+            return false;
+        }
+        cap->mask = 2 * old_size - 1;
+        for (i = 0; i < old_size; i++) {
+            if (old[i].addr != 0) {
+                *capture_find(cap, old[i].addr) = old[i];
+            }
+        }
+        free(old);
+    }
+    block = capture_find(cap, addr);
+    block->addr = addr;
+    block->index = index;
+    block->size = size;
+    cap->count++;
+    cap->live_bytes += size;
+    if (cap->live_bytes > cap->file->header.data_bytes) {
+        cap->file->header.data_bytes = cap->live_bytes;
+    }
+    return true;
+}
+
+/*
+ * capture_remove - Forget the live block, shifting back the
+ *     entries of its probe sequence that follow it
+ */
+static void capture_remove(capture_t *cap, capture_block_t *block)
+{
+    size_t hole = block - cap->blocks;
+    size_t i = hole;
+
+    cap->count--;
+    cap->live_bytes -= block->size;
+    for (;;) {
+        size_t home;
+
+        i = (i + 1) & cap->mask;
+        if (cap->blocks[i].addr == 0) {
+            break;
+        }
+        home = capture_home(cap, cap->blocks[i].addr);
+        /* Move the entry if its home is not between the hole and it */
+        if (((i - home) & cap->mask) >= ((i - hole) & cap->mask)) {
+            cap->blocks[hole] = cap->blocks[i];
+            hole = i;
+        }
+    }
+    cap->blocks[hole].addr = 0;
+}
+
+/*
+ * capture_op - Append a request to the trace being built
+ */
+static void capture_op(capture_t *cap, uint32_t type, int32_t index,
+                       uint64_t size)
+{
+    traceop_t *op = &cap->file->ops[cap->file->header.num_ops++];
+
+    op->type = type;
+    op->index = index;
+    op->size = size;
+}
+
+/*
+ * capture_free - Free the live block at addr, if there is one
+ */
+static void capture_free(capture_t *cap, uint64_t addr)
+{
+    capture_block_t *block = capture_find(cap, addr);
+
+    if (block->addr != 0) {
+        capture_op(cap, FREE, block->index, 0);
+        capture_remove(cap, block);
+    }
+}
+
+/*
+ * capture_alloc - Give a new id to the block allocated at addr.  A block
+ *     still live there was freed by a request ordered after this one.
+ */
+static bool capture_alloc(capture_t *cap, uint64_t addr, uint64_t size)
+{
+    int32_t index = cap->file->header.num_ids;
+
+    capture_free(cap, addr);
+    if (!capture_insert(cap, addr, index, size)) {
+        return false;
+    }
+    cap->file->header.num_ids++;
+    capture_op(cap, ALLOC, index, size);
+    return true;
+}
+
+/*
+ * capture_realloc - Move the id of the block at old_addr to addr
+ */
+static bool capture_realloc(capture_t *cap, uint64_t old_addr,
+                            uint64_t addr, uint64_t size)
+{
+    capture_block_t *block = capture_find(cap, old_addr);
+    int32_t index;
+
+    if (block->addr == 0) {
+        /* realloc(NULL), or a block allocated before the capture */
+        return addr == 0 || size == 0 || capture_alloc(cap, addr, size);
+    }
+    if (size == 0) {
+        capture_free(cap, old_addr);
+        return true;
+    }
+    index = block->index;
+    capture_remove(cap, block);
+    capture_free(cap, addr);
+    capture_op(cap, REALLOC, index, size);
+    return capture_insert(cap, addr, index, size);
+}
+
+/*
+ * capture_realloc_begin - Release the block at old_addr for a realloc
+ *     which moved it.  Its id is kept aside, under addr with the low bit
+ *     set, until the END of the realloc gives it the block at addr.
+ */
+static bool capture_realloc_begin(capture_t *cap, uint64_t old_addr,
+                                  uint64_t addr, uint64_t size)
+{
+    capture_block_t *block = capture_find(cap, old_addr);
+    int32_t index;
+
+    if (size == 0) {
+        capture_free(cap, old_addr);
+        return true;
+    }
+    if (block->addr == 0) {
+        /* A block allocated before the capture */
+        index = cap->file->header.num_ids++;
+        capture_op(cap, ALLOC, index, size);
+    } else {
+        index = block->index;
+        capture_remove(cap, block);
+        capture_op(cap, REALLOC, index, size);
+    }
+    return capture_insert(cap, addr | 1, index, size);
+}
+
+/*
+ * capture_realloc_end - Give the block at addr to the id kept aside by
+ *     capture_realloc_begin
+ */
+static bool capture_realloc_end(capture_t *cap, uint64_t addr)
+{
+    capture_block_t *block = capture_find(cap, addr | 1);
+    int32_t index;
+    uint64_t size;
+
+    if (block->addr == 0) {
+        /* The BEGIN is missing from a log cut short */
+        return true;
+    }
+    index = block->index;
+    size = block->size;
+    capture_remove(cap, block);
+    capture_free(cap, addr);
+    return capture_insert(cap, addr, index, size);
+}
+
+/*
+ * compare_events - Order captured requests by sequence number
+ */
+static int compare_events(const void *a, const void *b)
+{
+    uint64_t x = ((const capture_event_t *)a)->seq_type >> 8;
+    uint64_t y = ((const capture_event_t *)b)->seq_type >> 8;
+
+    return (x > y) - (x < y);
+}
+
+/*
+ * load_capture - Turn a capture log into a trace.  The requests are
+ *     sorted by sequence number, every allocated block gets a new id,
+ *     and data_bytes is the peak of the live bytes.  Requests on blocks
+ *     allocated before the capture started, failed and zero-byte
+ *     allocations are left out, as mdriver cannot replay them.
+ */
+static bool load_capture(const char *filename, int fd, trace_file_t *file)
+{
+    capture_t cap = { .file = file, .mask = 1023 };
+    capture_event_t *events;
+    struct stat st;
+    size_t i, num_events;
+    bool ok = true;
+    void *addr;
+
+    if (fstat(fd, &st) < 0) {
+        fprintf(stderr, "%s: %s\n", filename, strerror(errno));
+        return false;
+    }
+    /* A log cut short by a crash ends with a partial record */
+    num_events = ((size_t)st.st_size - sizeof(uint64_t))
+        / sizeof(capture_event_t);
+    if (num_events > INT32_MAX / 2) {
+        fprintf(stderr, "%s: too many requests (%zu)\n",
+                filename, num_events);
+        return false;
+    }
+
+    file->header.magic = TRACE_MAGIC;
+    file->header.weight = 1;
+    if ((file->ops = malloc((2 * num_events + 1) * sizeof(traceop_t)))
+        == NULL
+        || (cap.blocks = calloc(cap.mask + 1, sizeof(capture_block_t)))
+           == NULL) {
+        fprintf(stderr, "%s: out of memory\n", filename);
+        return false;
+    }
+    if (num_events == 0) {
+        free(cap.blocks);
+        return true;
+    }
+
+    /* Sorted in a private copy of the mapping */
+    addr = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (addr == MAP_FAILED) {
+        fprintf(stderr, "%s: %s\n", filename, strerror(errno));
+        free(cap.blocks);
+        return false;
+    }
+    events = (capture_event_t *)((char *)addr + sizeof(uint64_t));
+    qsort(events, num_events, sizeof(capture_event_t), compare_events);
+
+    /* Each request appends at most two operations */
+    for (i = 0; ok && i < num_events; i++) {
+        const capture_event_t *e = &events[i];
+
+        switch (e->seq_type & 0xff) {
+        case CAPTURE_ALLOC:
+            if (e->addr != 0 && e->size != 0) {
+                ok = capture_alloc(&cap, e->addr, e->size);
+            }
+            break;
+        case CAPTURE_FREE:
+            capture_free(&cap, e->addr);
+            break;
+        case CAPTURE_REALLOC:
+            if (e->addr != 0 || e->size == 0) {
+                ok = capture_realloc(&cap, e->old_addr, e->addr, e->size);
+            }
+            break;
+        case CAPTURE_REALLOC_BEGIN:
+            ok = capture_realloc_begin(&cap, e->old_addr, e->addr, e->size);
+            break;
+        case CAPTURE_REALLOC_END:
+            ok = capture_realloc_end(&cap, e->addr);
+            break;
+        default:
+            fprintf(stderr, "%s: bogus request type %u\n", filename,
+                    (unsigned)(e->seq_type & 0xff));
+            munmap(addr, st.st_size);
+            free(cap.blocks);
+            return false;
+        }
+    }
+    munmap(addr, st.st_size);
+    free(cap.blocks);
+    if (!ok) {
+        fprintf(stderr, "%s: out of memory\n", filename);
+    }
+    return ok;
+}
+
+/*
+ * trace_write_bin - Write a loaded trace in the binary format
+ */
+bool trace_write_bin(FILE *out, const trace_file_t *file)
+{
+    trace_header_t header = file->header;
+
+    header.magic = TRACE_MAGIC;
+    header.reserved = 0;
+    return fwrite(&header, sizeof(header), 1, out) == 1
+        && fwrite(file->ops, sizeof(traceop_t), header.num_ops, out)
+           == header.num_ops;
+}
+
+/*
+ * trace_write_text - Write a loaded trace in the text format
+ */
+bool trace_write_text(FILE *out, const trace_file_t *file)
+{
+    const trace_header_t *header = &file->header;
+    uint32_t i;
+
+    fprintf(out, "%" PRIu32 "\n%" PRIu32 "\n%" PRIu32 "\n%" PRIu64 "\n",
+            header->weight, header->num_ids, header->num_ops,
+            header->data_bytes);
+    for (i = 0; i < header->num_ops; i++) {
+        const traceop_t *op = &file->ops[i];
+        switch (op->type) {
+        case ALLOC:
+            fprintf(out, "a %d %" PRIu64 "\n", op->index, op->size);
+            break;
+        case REALLOC:
+            fprintf(out, "r %d %" PRIu64 "\n", op->index, op->size);
+            break;
+        case FREE:
+            fprintf(out, "f %d\n", op->index);
+            break;
+        }
+    }
+    return !ferror(out);
+}
+
+/*
+ * trace_stream_open - Open a trace for streaming and read its header
+ */
+bool trace_stream_open(const char *filename, trace_stream_t *stream,
+                       size_t chunk_ops)
+{
+    uint64_t magic = 0;
+
+    memset(stream, 0, sizeof(*stream));
+    stream->chunk_ops = chunk_ops;
+    stream->held = -1;
+    if ((stream->in = fopen(filename, "r")) == NULL) {
+        fprintf(stderr, "%s: %s\n", filename, strerror(errno));
+        return false;
+    }
+    if (fread(&magic, sizeof(magic), 1, stream->in) == 1
+        && magic == TRACE_MAGIC) {
+        stream->binary = true;
+        rewind(stream->in);
+        if (fread(&stream->header, sizeof(trace_header_t), 1,
+                  stream->in) != 1) {
+            fprintf(stderr, "%s: truncated header\n", filename);
+            fclose(stream->in);
+            return false;
+        }
+    } else {
+        rewind(stream->in);
+        if (!read_text_header(filename, stream->in, &stream->header)) {
+            fclose(stream->in);
+            return false;
+        }
+    }
+    stream->ops_offset = ftell(stream->in);
+    pthread_mutex_init(&stream->lock, NULL);
+    pthread_cond_init(&stream->cond, NULL);
+    stream->filename = strdup(filename);
+    stream->buffers[0] = malloc(chunk_ops * sizeof(traceop_t));
+    stream->buffers[1] = malloc(chunk_ops * sizeof(traceop_t));
+    if (stream->filename == NULL || stream->buffers[0] == NULL
+        || stream->buffers[1] == NULL) {
+        fprintf(stderr, "%s: out of memory\n", filename);
+        trace_stream_close(stream);
+        return false;
+    }
+    return true;
+}
+
+/*
+ * fill_buffer - Read the next chunk of requests into ops, and check that
+ *     they refer to ids within the header's count.  Returns the number
+ *     read, 0 at the end of the trace or if it is malformed.
+ */
+static size_t fill_buffer(trace_stream_t *stream, traceop_t *ops)
+{
+    const trace_header_t *header = &stream->header;
+    size_t count = header->num_ops - stream->ops_read;
+    size_t i;
+
+    if (count > stream->chunk_ops) {
+        count = stream->chunk_ops;
+    }
+    if (stream->binary) {
+        if (fread(ops, sizeof(traceop_t), count, stream->in) != count) {
+            fprintf(stderr, "%s: trace ends before operation %u\n",
+                    stream->filename, header->num_ops);
+            stream->failed = true;
+            return 0;
+        }
+    } else {
+        for (i = 0; i < count; i++) {
+            if (!read_text_op(stream->filename, stream->in,
+                              stream->ops_read + i, &ops[i])) {
+                stream->failed = true;
+                return 0;
+            }
+        }
+    }
+    for (i = 0; i < count; i++) {
+        if (!valid_op(&ops[i], header)) {
+            fprintf(stderr, "%s: bad operation %zu\n",
+                    stream->filename, stream->ops_read + i);
+            stream->failed = true;
+            return 0;
+        }
+    }
+    stream->ops_read += count;
+    return count;
+}
+
+/*
+ * stream_reader - Fill the two buffers in turn, waiting for the caller
+ *     to release each one before refilling it
+ */
+static void *stream_reader(void *arg)
+{
+    trace_stream_t *stream = arg;
+    int b = 0;
+    size_t count;
+
+    do {
+        pthread_mutex_lock(&stream->lock);
+        while (stream->full[b] && !stream->stop) {
+            pthread_cond_wait(&stream->cond, &stream->lock);
+        }
+        if (stream->stop) {
+            pthread_mutex_unlock(&stream->lock);
+            return NULL;
+        }
+        pthread_mutex_unlock(&stream->lock);
+
+        /* Read without the lock, while the caller replays the other buffer */
+        count = fill_buffer(stream, stream->buffers[b]);
+
+        pthread_mutex_lock(&stream->lock);
+        stream->counts[b] = count;
+        stream->full[b] = true;
+        pthread_cond_broadcast(&stream->cond);
+        pthread_mutex_unlock(&stream->lock);
+        b ^= 1;
+    } while (count > 0);
+    return NULL;
+}
+
+/*
+ * stop_reader - Make the reader thread exit, and wait for it
+ */
+static void stop_reader(trace_stream_t *stream)
+{
+    if (!stream->running) {
+        return;
+    }
+    pthread_mutex_lock(&stream->lock);
+    stream->stop = true;
+    pthread_cond_broadcast(&stream->cond);
+    pthread_mutex_unlock(&stream->lock);
+    pthread_join(stream->reader, NULL);
+    stream->running = false;
+}
+
+/*
+ * trace_stream_rewind - Restart the reader thread from the first request
+ */
+void trace_stream_rewind(trace_stream_t *stream)
+{
+    stop_reader(stream);
+    fseek(stream->in, stream->ops_offset, SEEK_SET);
+    stream->ops_read = 0;
+    stream->full[0] = stream->full[1] = false;
+    stream->next = 0;
+    stream->held = -1;
+    stream->failed = false;
+    stream->stop = false;
+    if (pthread_create(&stream->reader, NULL, stream_reader, stream) != 0) {
+        fprintf(stderr, "%s: cannot start the reader thread\n",
+                stream->filename);
+        stream->failed = true;
+        stream->counts[0] = 0;
+        stream->full[0] = true;
+        return;
+    }
+    stream->running = true;
+}
+
+/*
+ * trace_stream_next - Release the chunk being replayed and hand out the
+ *     next one, waiting for the reader if it is not full yet
+ */
+size_t trace_stream_next(trace_stream_t *stream, const traceop_t **ops)
+{
+    size_t count;
+
+    pthread_mutex_lock(&stream->lock);
+    if (stream->held >= 0) {
+        stream->full[stream->held] = false;
+        stream->held = -1;
+        pthread_cond_broadcast(&stream->cond);
+    }
+    while (!stream->full[stream->next]) {
+        pthread_cond_wait(&stream->cond, &stream->lock);
+    }
+
+    /* The empty buffer at the end stays full, so that it is seen again */
+    count = stream->counts[stream->next];
+    if (count > 0) {
+        *ops = stream->buffers[stream->next];
+        stream->held = stream->next;
+        stream->next ^= 1;
+    }
+    pthread_mutex_unlock(&stream->lock);
+    return count;
+}
+
+/*
+ * trace_stream_close - Stop the reader thread and release the buffers
+ */
+void trace_stream_close(trace_stream_t *stream)
+{
+    stop_reader(stream);
+    pthread_mutex_destroy(&stream->lock);
+    pthread_cond_destroy(&stream->cond);
+    free(stream->buffers[0]);
+    free(stream->buffers[1]);
+    free(stream->filename);
+    fclose(stream->in);
+    memset(stream, 0, sizeof(*stream));
+}
@@ -0,0 +1,135 @@
+/*
+ * trace.h - Reading and writing allocator trace files
+ *
+ * A trace is stored either as text (.rep, see traces/README) or in a
+ * binary format (.bin) that mdriver maps and uses in place, without
+ * a parse step: a trace_header_t followed by num_ops traceop_t records,
+ * in the byte order of the machine that wrote it.  trace-convert
+ * translates between the two.
+ *
+ * Traces too long to hold in memory can be streamed instead: a reader
+ * thread fills one buffer of requests while the caller replays the
+ * other, so only two chunks are in memory at any time.
+ *
+ * libtracer.so records the requests of a running program in a capture
+ * log, which trace_load turns into a trace.
+ */
+#ifndef __TRACE_H_
+#define __TRACE_H_
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/* First eight bytes of a binary trace: "mmtrace1" in memory order */
+#define TRACE_MAGIC 0x3165636172746d6dULL
+
+/* Type of a trace operation */
+enum { ALLOC, FREE, REALLOC };
+
+/* Characterizes a single trace operation (allocator request) */
+typedef struct {
+    uint32_t type;    /* type of request */
+    int32_t index;    /* index for free() to use later */
+    uint64_t size;    /* byte size of alloc/realloc request */
+} traceop_t;
+
+/* Header of a binary trace, followed by num_ops traceop_t records */
+typedef struct {
+    uint64_t magic;         /* TRACE_MAGIC */
+    uint32_t weight;        /* weight for this trace */
+    uint32_t num_ids;       /* number of alloc/realloc ids */
+    uint32_t num_ops;       /* number of distinct requests */
+    uint32_t reserved;      /* always zero */
+    uint64_t data_bytes;    /* peak number of data bytes allocated */
+} trace_header_t;
+
+/* First eight bytes of a capture log written by libtracer.so: "mmcaptr1" */
+#define CAPTURE_MAGIC 0x3172747061636d6dULL
+
+/*
+ * Type of a captured request, in the low byte of seq_type.  A realloc
+ * which moved the block is recorded as a BEGIN, when old_addr is
+ * released, and an END, when addr is obtained.
+ */
+enum { CAPTURE_ALLOC, CAPTURE_FREE, CAPTURE_REALLOC,
+       CAPTURE_REALLOC_BEGIN, CAPTURE_REALLOC_END };
+
+/*
+ * A request recorded by libtracer.so.  A capture log is CAPTURE_MAGIC
+ * followed by these records, grouped by thread; the sequence numbers
+ * give the order in which the program made the requests.
+ */
+typedef struct {
+    uint64_t seq_type;      /* sequence number << 8 | type */
+    uint64_t addr;          /* block returned, or freed */
+    uint64_t old_addr;      /* block passed to realloc */
+    uint64_t size;          /* bytes requested */
+} capture_event_t;
+
+/* A trace in memory; ops is mapped from a binary trace or malloc'd */
+typedef struct {
+    trace_header_t header;
+    traceop_t *ops;
+    size_t map_length;      /* length of the mapping, or 0 if malloc'd */
+} trace_file_t;
+
+/*
+ * Load a text or binary trace, or a capture log turned into a trace,
+ * telling them apart by the magic number.  Prints a message to stderr
+ * and returns false if the file cannot be read or is malformed.
+ */
+bool trace_load(const char *filename, trace_file_t *file);
+
+/* Release the operations of a loaded trace */
+void trace_unload(trace_file_t *file);
+
+/* Write a loaded trace in the binary or text format */
+bool trace_write_bin(FILE *out, const trace_file_t *file);
+bool trace_write_text(FILE *out, const trace_file_t *file);
+
+/* A trace read in chunks of chunk_ops requests by a reader thread */
+typedef struct {
+    trace_header_t header;
+    char *filename;
+    FILE *in;
+    bool binary;            /* records rather than text lines */
+    long ops_offset;        /* file offset of the first request */
+    size_t chunk_ops;       /* capacity of each buffer */
+    traceop_t *buffers[2];
+    size_t counts[2];       /* requests in each full buffer, 0 at the end */
+    bool full[2];           /* set by the reader, cleared by the caller */
+    int next;               /* buffer handed out by the next call */
+    int held;               /* buffer the caller is replaying, or -1 */
+    uint32_t ops_read;      /* requests read since the last rewind */
+    bool failed;            /* set if the trace is malformed */
+    bool running;           /* the reader thread has been started */
+    bool stop;              /* asks the reader thread to exit */
+    pthread_t reader;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} trace_stream_t;
+
+/*
+ * Open a text or binary trace for streaming and read its header.
+ * Returns false, with a message on stderr, if the file cannot be read.
+ */
+bool trace_stream_open(const char *filename, trace_stream_t *stream,
+                       size_t chunk_ops);
+
+/* Start reading the requests from the first one; needed before next */
+void trace_stream_rewind(trace_stream_t *stream);
+
+/*
+ * Hand out the next chunk of requests in *ops, valid until the following
+ * call, and return its length.  Returns 0 at the end of the trace, or
+ * if it is malformed, in which case failed is set.
+ */
+size_t trace_stream_next(trace_stream_t *stream, const traceop_t **ops);
+
+/* Stop the reader thread and release the buffers */
+void trace_stream_close(trace_stream_t *stream);
+
+#endif /* __TRACE_H_ */
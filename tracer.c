@@ -0,0 +1,519 @@
+/*
+ * tracer.c - Record the allocator requests of a running program
+ *
+ * Built as libtracer.so and preloaded into a program, it wraps malloc,
+ * free, realloc, calloc and the aligned allocation functions of the C
+ * library, and logs every request they serve:
+ *
+ *     unix> MM_TRACE=/tmp/prog LD_PRELOAD=./libtracer.so prog args
+ *
+ * writes /tmp/prog.<pid> (mmtrace.<pid> by default), a capture log that
+ * trace-convert turns into a .rep trace.  Each process, including the
+ * programs it executes, writes its own log; forked children which do
+ * not exec are not traced.
+ *
+ * Recording a request costs one atomic increment and a store into a
+ * ring owned by the calling thread.  A background thread drains the
+ * rings into the log, so the program never waits for the disk unless
+ * a ring fills up.  The requests of a thread are written in batches, and
+ * the sequence number of each request restores the global order when
+ * the log is turned into a trace.
+ *
+ * A request is numbered before it releases a block and after it obtains
+ * one, so that another thread reusing the block is ordered after it.  A
+ * realloc which moves the block does both: it is recorded in two
+ * halves, numbered before and after the call.
+ */
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+/* Number of requests in the ring of a thread, a power of two */
+#define RING_EVENTS (1 << 16)
+
+/* Bytes served to dlsym before the C library functions are found */
+#define BOOTSTRAP_BYTES 8192
+
+/* Pause of the writer thread when the rings are empty, in nanoseconds */
+#define WRITER_PAUSE 1000000
+
+/* The requests of one thread, waiting to be written */
+typedef struct ring {
+    capture_event_t events[RING_EVENTS];
+    uint64_t head __attribute__((aligned(64)));   /* next request stored */
+    uint64_t tail __attribute__((aligned(64)));   /* next request written */
+    struct ring *next;          /* in the list of all the rings */
+    bool idle;                  /* its thread exited, it can be reused */
+} ring_t;
+
+/* The C library functions */
+static void *(*real_malloc)(size_t);
+static void (*real_free)(void *);
+static void *(*real_realloc)(void *, size_t);
+static void *(*real_calloc)(size_t, size_t);
+static int (*real_posix_memalign)(void **, size_t, size_t);
+static void *(*real_aligned_alloc)(size_t, size_t);
+static void *(*real_memalign)(size_t, size_t);
+static void *(*real_valloc)(size_t);
+static void *(*real_pvalloc)(size_t);
+
+/* Memory handed out while dlsym looks the functions up */
+static char bootstrap[BOOTSTRAP_BYTES] __attribute__((aligned(16)));
+static size_t bootstrap_used = 0;
+static bool resolving = false;
+
+/* The log, and whether requests are recorded */
+static int log_fd = -1;
+static bool enabled = false;
+
+/* Every ring ever created, new ones are pushed at the head */
+static ring_t *rings = NULL;
+
+/* Sequence number of the next request */
+static uint64_t next_seq = 0;
+
+static pthread_t writer;
+static bool writer_stop = false;
+static pthread_key_t ring_key;
+
+/* The ring of the calling thread, and set while the tracer allocates */
+static __thread ring_t *my_ring = NULL;
+static __thread bool in_tracer = false;
+
+/* Set once the ring of the calling thread was handed back at its exit */
+static __thread bool ring_done = false;
+
+static void resolve(void);
+
+/*
+ * bootstrap_alloc - Serve a request made by dlsym from the static buffer
+ */
+static void *bootstrap_alloc(size_t size)
+{
+    void *p;
+
+    size = (size + 15) & ~(size_t)15;
+    if (size > BOOTSTRAP_BYTES - bootstrap_used) {
+        return NULL;
+    }
+    p = bootstrap + bootstrap_used;
+    bootstrap_used += size;
+    return p;
+}
+
+/*
+ * is_bootstrap - Return true if p was served by bootstrap_alloc
+ */
+static bool is_bootstrap(void *p)
+{
+    return (char *)p >= bootstrap && (char *)p < bootstrap + BOOTSTRAP_BYTES;
+}
+
+/*
+ * ring_release - Let another thread reuse the ring of an exiting thread
+ */
+static void ring_release(void *arg)
+{
+    ring_t *ring = arg;
+
+    /* Requests made by later destructors of the thread are not recorded */
+    ring_done = true;
+    my_ring = NULL;
+    __atomic_store_n(&ring->idle, true, __ATOMIC_RELEASE);
+}
+
+/*
+ * ring_get - Give the calling thread a ring, an idle one if possible
+ */
+static ring_t *ring_get(void)
+{
+    ring_t *ring;
+
+    in_tracer = true;
+    for (ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); ring != NULL;
+         ring = ring->next) {
+        bool idle = true;
+        if (__atomic_compare_exchange_n(&ring->idle, &idle, false, false,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            break;
+        }
+    }
+    if (ring == NULL) {
+        ring = mmap(NULL, sizeof(ring_t), PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (ring == MAP_FAILED) {
+            in_tracer = false;
+            return NULL;
+        }
+        ring->next = __atomic_load_n(&rings, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&rings, &ring->next, ring, true,
+                                            __ATOMIC_RELEASE,
+                                            __ATOMIC_RELAXED)) {
+        }
+    }
+    /* The destructor hands the ring back when the thread exits */
+    pthread_setspecific(ring_key, ring);
+    my_ring = ring;
+    in_tracer = false;
+    return ring;
+}
+
+/*
+ * next_request - Take the sequence number of the next request
+ */
+static uint64_t next_request(void)
+{
+    return __atomic_fetch_add(&next_seq, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * record_as - Store request number seq in the ring of the calling
+ *     thread, waiting for the writer if the ring is full
+ */
+static void record_as(uint64_t seq, int type, void *addr, void *old_addr,
+                      size_t size)
+{
+    ring_t *ring = my_ring;
+    capture_event_t *e;
+    uint64_t head;
+
+    if (!__atomic_load_n(&enabled, __ATOMIC_RELAXED) || in_tracer
+        || ring_done) {
+        return;
+    }
+    if (ring == NULL && (ring = ring_get()) == NULL) {
+        return;
+    }
+    head = ring->head;
+    while (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE)
+           == RING_EVENTS) {
+        sched_yield();
+    }
+    e = &ring->events[head & (RING_EVENTS - 1)];
+    e->seq_type = seq << 8 | type;
+    e->addr = (uintptr_t)addr;
+    e->old_addr = (uintptr_t)old_addr;
+    e->size = size;
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * record - Store a request numbered now
+ */
+static void record(int type, void *addr, void *old_addr, size_t size)
+{
+    record_as(next_request(), type, addr, old_addr, size);
+}
+
+/*
+ * write_all - Write len bytes to the log, or stop recording on error
+ */
+static bool write_all(const void *buf, size_t len)
+{
+    static const char msg[] = "libtracer: write failed, capture stopped\n";
+    const char *p = buf;
+
+    while (len > 0) {
+        ssize_t n = write(log_fd, p, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            __atomic_store_n(&enabled, false, __ATOMIC_RELAXED);
+            if (write(STDERR_FILENO, msg, sizeof(msg) - 1) < 0) {
+                /* Nothing else to do */
+            }
+            return false;
+        }
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+/*
+ * drain - Write the requests stored in every ring.  Returns the number
+ *     of requests written.
+ */
+static uint64_t drain(void)
+{
+    uint64_t written = 0;
+    ring_t *ring;
+
+    for (ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); ring != NULL;
+         ring = ring->next) {
+        uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        uint64_t tail = ring->tail;
+
+        while (tail != head) {
+            /* The stored requests wrap around at most once */
+            uint64_t start = tail & (RING_EVENTS - 1);
+            uint64_t n = head - tail;
+
+            if (n > RING_EVENTS - start) {
+                n = RING_EVENTS - start;
+            }
+            if (!write_all(&ring->events[start],
+                           n * sizeof(capture_event_t))) {
+                /* Keep the threads from waiting for this ring */
+                tail = head;
+                break;
+            }
+            tail += n;
+            written += n;
+        }
+        __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+    }
+    return written;
+}
+
+/*
+ * writer_main - Drain the rings until the program exits
+ */
+static void *writer_main(void *arg)
+{
+    struct timespec pause = { 0, WRITER_PAUSE };
+
+    in_tracer = true;
+    while (!__atomic_load_n(&writer_stop, __ATOMIC_ACQUIRE)) {
+        if (drain() == 0) {
+            nanosleep(&pause, NULL);
+        }
+    }
+    return arg;
+}
+
+/*
+ * tracer_child - A forked child shares the log, and has no writer
+ */
+static void tracer_child(void)
+{
+    enabled = false;
+    writer_stop = true;
+}
+
+/*
+ * tracer_init - Open the log and start the writer thread, when the
+ *     library is loaded
+ */
+static void __attribute__((constructor)) tracer_init(void)
+{
+    static const uint64_t magic = CAPTURE_MAGIC;
+    const char *prefix = getenv("MM_TRACE");
+    char path[4096];
+
+    resolve();
+    if (prefix == NULL || prefix[0] == '\0') {
+        prefix = "mmtrace";
+    }
+    snprintf(path, sizeof(path), "%s.%d", prefix, (int)getpid());
+    log_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (log_fd < 0) {
+        fprintf(stderr, "libtracer: %s: %s\n", path, strerror(errno));
+        return;
+    }
+    if (!write_all(&magic, sizeof(magic))
+        || pthread_key_create(&ring_key, ring_release) != 0) {
+        close(log_fd);
+        return;
+    }
+    pthread_atfork(NULL, NULL, tracer_child);
+    __atomic_store_n(&enabled, true, __ATOMIC_RELEASE);
+    if (pthread_create(&writer, NULL, writer_main, NULL) != 0) {
+        __atomic_store_n(&enabled, false, __ATOMIC_RELAXED);
+        close(log_fd);
+        log_fd = -1;
+    }
+}
+
+/*
+ * tracer_fini - Write the last requests when the program exits.  Those
+ *     made afterwards, by later destructors, are not recorded.
+ */
+static void __attribute__((destructor)) tracer_fini(void)
+{
+    if (log_fd < 0 || writer_stop) {
+        return;
+    }
+    __atomic_store_n(&enabled, false, __ATOMIC_RELAXED);
+    __atomic_store_n(&writer_stop, true, __ATOMIC_RELEASE);
+    pthread_join(writer, NULL);
+    drain();
+    close(log_fd);
+    log_fd = -1;
+}
+
+/*
+ * resolve - Look up the C library functions wrapped below.  dlsym may
+ *     allocate, which the bootstrap buffer serves meanwhile.
+ */
+static void resolve(void)
+{
+    if (real_malloc != NULL || resolving) {
+        return;
+    }
+    resolving = true;
+    real_free = dlsym(RTLD_NEXT, "free");
+    real_realloc = dlsym(RTLD_NEXT, "realloc");
+    real_calloc = dlsym(RTLD_NEXT, "calloc");
+    real_posix_memalign = dlsym(RTLD_NEXT, "posix_memalign");
+    real_aligned_alloc = dlsym(RTLD_NEXT, "aligned_alloc");
+    real_memalign = dlsym(RTLD_NEXT, "memalign");
+    real_valloc = dlsym(RTLD_NEXT, "valloc");
+    real_pvalloc = dlsym(RTLD_NEXT, "pvalloc");
+    real_malloc = dlsym(RTLD_NEXT, "malloc");
+    resolving = false;
+}
+
+void *malloc(size_t size)
+{
+    void *p;
+
+    resolve();
+    if (real_malloc == NULL) {
+        return bootstrap_alloc(size);
+    }
+    p = real_malloc(size);
+    if (p != NULL) {
+        record(CAPTURE_ALLOC, p, NULL, size);
+    }
+    return p;
+}
+
+void free(void *p)
+{
+    if (p == NULL || is_bootstrap(p)) {
+        return;
+    }
+    resolve();
+    /* Recorded first, so that a thread reusing the block comes after */
+    record(CAPTURE_FREE, p, NULL, 0);
+    real_free(p);
+}
+
+void *realloc(void *old, size_t size)
+{
+    uint64_t seq;
+    void *p;
+
+    resolve();
+    if (real_realloc == NULL || is_bootstrap(old)) {
+        /* The size of a bootstrap block is not known, copy what fits */
+        size_t avail = is_bootstrap(old)
+            ? (size_t)(bootstrap + BOOTSTRAP_BYTES - (char *)old) : 0;
+        if ((p = malloc(size)) != NULL && old != NULL) {
+            memcpy(p, old, size < avail ? size : avail);
+        }
+        return p;
+    }
+    if (old == NULL) {
+        /* Only obtains a block, like malloc */
+        if ((p = real_realloc(old, size)) != NULL) {
+            record(CAPTURE_REALLOC, p, old, size);
+        }
+        return p;
+    }
+    /* Numbered before old can be released to another thread */
+    seq = next_request();
+    p = real_realloc(old, size);
+    if (p == old || (p == NULL && size == 0)) {
+        record_as(seq, CAPTURE_REALLOC, p, old, size);
+    } else if (p != NULL) {
+        /* ... and p is taken once it can no longer be freed by one */
+        record_as(seq, CAPTURE_REALLOC_BEGIN, p, old, size);
+        record(CAPTURE_REALLOC_END, p, old, size);
+    }
+    return p;
+}
+
+void *calloc(size_t n, size_t size)
+{
+    void *p;
+
+    resolve();
+    if (real_calloc == NULL) {
+        /* The bootstrap buffer is zero, and never reused */
+        if (size != 0 && n > SIZE_MAX / size) {
+            return NULL;
+        }
+        return bootstrap_alloc(n * size);
+    }
+    p = real_calloc(n, size);
+    if (p != NULL) {
+        record(CAPTURE_ALLOC, p, NULL, n * size);
+    }
+    return p;
+}
+
+int posix_memalign(void **memptr, size_t align, size_t size)
+{
+    int err;
+
+    resolve();
+    err = real_posix_memalign(memptr, align, size);
+    if (err == 0) {
+        record(CAPTURE_ALLOC, *memptr, NULL, size);
+    }
+    return err;
+}
+
+void *aligned_alloc(size_t align, size_t size)
+{
+    void *p;
+
+    resolve();
+    p = real_aligned_alloc(align, size);
+    if (p != NULL) {
+        record(CAPTURE_ALLOC, p, NULL, size);
+    }
+    return p;
+}
+
+void *memalign(size_t align, size_t size)
+{
+    void *p;
+
+    resolve();
+    p = real_memalign(align, size);
+    if (p != NULL) {
+        record(CAPTURE_ALLOC, p, NULL, size);
+    }
+    return p;
+}
+
+void *valloc(size_t size)
+{
+    void *p;
+
+    resolve();
+    p = real_valloc(size);
+    if (p != NULL) {
+        record(CAPTURE_ALLOC, p, NULL, size);
+    }
+    return p;
+}
+
+void *pvalloc(size_t size)
+{
+    void *p;
+
+    resolve();
+    p = real_pvalloc(size);
+    if (p != NULL) {
+        record(CAPTURE_ALLOC, p, NULL, size);
+    }
+    return p;
+}
@@ -0,0 +1,8 @@
+# Small and mid-sized blocks with short lifetimes, freed next to each
+# other, so that most frees coalesce
+ops 200000
+seed 1
+size histogram 8:30 16:20 24:10 48:10 64:10 200:5 600:10 1000:5
+lifetime exponential 200
+realloc 0.05
+realloc-growth 1.5
@@ -0,0 +1,8 @@
+# Many live blocks of scattered sizes, so that find_fit searches long
+# free lists and large trees
+ops 200000
+seed 1
+size powerlaw 64 65536 1.2
+lifetime powerlaw 1 50000 1.1
+realloc 0.01
+realloc-growth 0